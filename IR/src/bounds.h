@@ -0,0 +1,765 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <ostream>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "cfg.h"
+#include "ssa.h"
+#include "gvn.h"
+
+/*
+ * ======================================================================
+ *  Bounds check elimination
+ * ======================================================================
+ *
+ * NOTE(jordan): with -B every access checks its array first (see
+ * check_access in codegen.h). In a loop, that's a compare and a branch
+ * per index, every time around:
+ *
+ *   :loop
+ *   %i_2 <- phi(%i_1, %i_3)
+ *   %c <- %i_2 < %n
+ *   br %c :body
+ *   ...
+ *   :body
+ *   %array_A_bounds_0 <- %n <=u %i_2               <- can't happen
+ *   br %array_A_bounds_0 :A_out_of_bounds_1
+ *   ...
+ *   %i_3 <- %i_2 + 1
+ *
+ * In SSA form, after gvn (so the %n the loop tests and the size the
+ * check loads are the same variable, when they're computed the same
+ * way), we can prove most of them never fail:
+ *
+ *  - `%size <=u %i` can't be true if 0 <= %i < %size.
+ *  - %i >= 0 if it's a number >= 0, a comparison, loaded from an array
+ *    header, a non-negative value plus a non-negative constant, or a phi
+ *    of nothing but such values: a counter that starts at 0 and goes up.
+ *  - %i < %size if %i < something that's at most %size, or %i is one
+ *    less than something that's at most %size, or a phi of nothing but
+ *    such values.
+ *  - `%A = 0` can't be true if %A came from allocate.
+ *
+ * ... or if some branch we must have come through already settled it. A
+ * block with only one predecessor knows which way the predecessor's
+ * branches went, so which of their comparisons held, and that stays true
+ * for everything the block dominates: the loop test, and any earlier
+ * check of the same thing.
+ *
+ * A check that might fail in a simple counted loop (%i goes up by one
+ * from wherever it starts, the header's `%i < %n` is the only way out,
+ * and nothing in it calls anything) moves in front of the loop instead.
+ * If the loop runs at all: the checks its first trip does, in the same
+ * order, and then `%size < %n`, which means some later trip gets to %i =
+ * %size and fails there. Until then the loop can't do anything anyone
+ * would notice (nothing in it prints, and array-error never returns), so
+ * failing right away, with the same message, is as good as failing
+ * later. The loop itself doesn't check anything any more.
+ */
+namespace codegen::IR::bounds {
+  using variables = cfg::variables;
+
+  struct report {
+    std::size_t checks  = 0; // checks translate made
+    std::size_t removed = 0; // ... that could never fail
+    std::size_t hoisted = 0; // ... that moved in front of their loop
+    std::size_t loops   = 0; // loops that got a combined check
+  };
+
+  void print (report const & r, std::ostream & os) {
+    os << "bounds: " << r.removed << " of " << r.checks
+       << " checks removed, " << r.hoisted << " hoisted out of "
+       << r.loops << " loops\n";
+  }
+
+  // `lhs op rhs`, where op is one of < <= <u <=u = !=
+  struct relation {
+    std::string op;
+    std::string lhs;
+    std::string rhs;
+  };
+
+  relation negate (relation const & r) {
+    if (r.op == "<")  return { "<=", r.rhs, r.lhs };
+    if (r.op == "<=") return { "<",  r.rhs, r.lhs };
+    if (r.op == "<u")  return { "<=u", r.rhs, r.lhs };
+    if (r.op == "<=u") return { "<u",  r.rhs, r.lhs };
+    if (r.op == "=")  return { "!=", r.lhs, r.rhs };
+    return { "=", r.lhs, r.rhs };
+  }
+
+  // Does `b` report an error (and so never come back)?
+  bool is_failure (cfg::block const & b) {
+    for (cfg::instruction const & i : b.body)
+      if (i.kind == cfg::kind::call
+        && (i.target == "array-error" || i.target == "array_error"))
+        return true;
+    return false;
+  }
+
+  /*
+   * Where going to block `b` ends up, through any blocks that only
+   * jump somewhere else (ssa::split_critical_edges makes those), or -1.
+   */
+  int failure (cfg::function const & f, int b) {
+    for (int hops = 0; b >= 0 && hops < f.blocks.size(); hops++) {
+      cfg::block const & bb = f.blocks.at(b);
+      if (is_failure(bb)) return b;
+      if (!bb.body.empty() || bb.exits.size() != 1) return -1;
+      if (bb.exits.at(0).kind != cfg::kind::branch) return -1;
+      b = cfg::find_label(f, bb.exits.at(0).target);
+    }
+    return -1;
+  }
+
+  bool falls_through (cfg::block const & b) {
+    for (cfg::instruction const & exit : b.exits)
+      if (exit.ends) return false;
+    return true;
+  }
+
+  // `br %c :fail`, where :fail calls array-error (eventually)
+  struct check {
+    int block;
+    int exit;
+    std::string fail;
+    relation failure;  // what %c says when the branch is taken
+  };
+
+  // A combined check for the loop at `header`, which goes in once the
+  // function is out of SSA form (see apply).
+  struct hoist {
+    std::string header;
+    std::vector<cfg::block> checks; // right in front of the loop
+    std::vector<cfg::block> cold;   // at the end of the function
+  };
+
+  struct analysis {
+    static constexpr int limit = 16; // how far to chase a proof
+
+    ssa::form const & s;
+    cfg::facts const & known;
+    std::map<std::string, cfg::instruction const *> definition;
+    std::map<std::string, int> defined_in;
+    std::map<std::string, int> phi_block;
+    std::map<std::string, ssa::phi const *> phis;
+    std::vector<std::vector<relation>> settled; // per block, on the way in
+    variables assumed;                          // phis we're proving
+
+    analysis (ssa::form const & s, cfg::facts const & known)
+      : s(s), known(known) {
+      for (int b = 0; b < s.f.blocks.size(); b++) {
+        for (cfg::instruction const & i : s.f.blocks.at(b).body) {
+          if (i.defines.empty()) continue;
+          definition[i.defines] = &i;
+          defined_in[i.defines] = b;
+        }
+        for (ssa::phi const & p : s.phis.at(b)) {
+          phis[p.defines] = &p;
+          phi_block[p.defines] = b;
+          defined_in[p.defines] = b;
+        }
+      }
+      settle();
+    }
+
+    static bool number (std::string const & v, int64_t & value) {
+      if (!gvn::is_number(v)) return false;
+      value = std::stoll(v);
+      return true;
+    }
+
+    // What comparison %v holds the result of, if any.
+    bool condition (std::string const & v, relation & r) const {
+      auto const it = definition.find(v);
+      if (it == definition.end() || it->second->kind != cfg::kind::compare)
+        return false;
+      std::vector<std::string> const parts
+        = gvn::split(it->second->expression);
+      std::string const & op = parts.at(0);
+      if (op == ">")       r = { "<",  parts.at(2), parts.at(1) };
+      else if (op == ">=") r = { "<=", parts.at(2), parts.at(1) };
+      else                 r = { op,   parts.at(1), parts.at(2) };
+      return true;
+    }
+
+    // What we learn going from `p` straight into `b`.
+    void entering (int p, int b, std::vector<relation> & facts) const {
+      cfg::block const & from = s.f.blocks.at(p);
+      std::vector<std::string> const & labels = s.f.blocks.at(b).labels;
+      int taken = -1, ways = 0, last = from.exits.size();
+      for (int k = 0; k < from.exits.size(); k++) {
+        cfg::instruction const & exit = from.exits.at(k);
+        if (exit.kind == cfg::kind::branch
+          && helper::collection::has(exit.target, labels)) {
+          if (taken < 0) taken = k;
+          ways++;
+        }
+        if (exit.ends) { last = k + 1; break; }
+      }
+      if (falls_through(from) && b == p + 1) {
+        if (taken < 0) taken = last;
+        ways++;
+      }
+      if (ways != 1) return;
+      for (int k = 0; k <= taken && k < last; k++) {
+        cfg::instruction const & exit = from.exits.at(k);
+        relation r;
+        if (exit.kind != cfg::kind::branch || exit.ends) continue;
+        if (!condition(exit.uses.at(0), r)) continue;
+        facts.push_back(k == taken ? r : negate(r));
+      }
+    }
+
+    void settle () {
+      settled = std::vector<std::vector<relation>>(s.f.blocks.size());
+      std::vector<int> work = { 0 };
+      while (!work.empty()) {
+        int const b = work.back(); work.pop_back();
+        if (s.idom.at(b) >= 0) settled.at(b) = settled.at(s.idom.at(b));
+        std::vector<int> const & preds = s.g.predecessors.at(b);
+        if (preds.size() == 1) entering(preds.at(0), b, settled.at(b));
+        for (int c : s.children.at(b)) work.push_back(c);
+      }
+    }
+
+    /*
+     * A phi holds up if every value it can take does, assuming it holds
+     * up itself (that's the induction: the values it takes from around
+     * the loop are computed from its own).
+     */
+    template <typename Holds>
+    bool inductive (
+      std::string const & v,
+      std::string const & what,
+      Holds const & holds
+    ) {
+      std::string const key = what + " " + v;
+      if (helper::collection::has(key, assumed)) return true;
+      assumed.insert(key);
+      int const b = phi_block.at(v);
+      ssa::phi const & p = *phis.at(v);
+      bool all = true;
+      for (int k = 0; all && k < p.uses.size(); k++) {
+        int const pred = s.g.predecessors.at(b).at(k);
+        if (!s.g.reachable.at(pred)) continue;
+        all = holds(p.uses.at(k), pred);
+      }
+      assumed.erase(key);
+      return all;
+    }
+
+    // `a <u b` is `0 <= a < b` when b >= 0 (likewise <=u); `order` is
+    // the signed half, if r says that much in block `at`
+    bool ordered (
+      relation const & r,
+      std::string & order,
+      int at,
+      int depth
+    ) {
+      if (r.op == "<" || r.op == "<=") {
+        order = r.op;
+        return true;
+      }
+      if (r.op != "<u" && r.op != "<=u") return false;
+      if (!nonnegative(r.rhs, at, depth + 1)) return false;
+      order = r.op.substr(0, r.op.size() - 1);
+      return true;
+    }
+
+    // %v >= 0 in block `at`
+    bool nonnegative (std::string const & v, int at, int depth = 0) {
+      int64_t c;
+      if (number(v, c)) return c >= 0;
+      if (depth > limit) return false;
+      for (relation const & r : settled.at(at)) {
+        if (r.lhs == v && (r.op == "<u" || r.op == "<=u")
+          && nonnegative(r.rhs, at, depth + 1))
+          return true;
+        if (r.rhs != v || (r.op != "<" && r.op != "<=")) continue;
+        if (number(r.lhs, c) ? c >= (r.op == "<" ? -1 : 0)
+                             : nonnegative(r.lhs, at, depth + 1))
+          return true;
+      }
+      if (helper::collection::has(v, phis))
+        return inductive(v, ">= 0", [&] (std::string const & u, int p) {
+          return nonnegative(u, p, depth + 1);
+        });
+      auto const it = definition.find(v);
+      if (it == definition.end()) return false;
+      cfg::instruction const & i = *it->second;
+      switch (i.kind) {
+        case cfg::kind::compare:
+          return true;
+        case cfg::kind::load:
+          // sizes, dimensions and strides
+          return gvn::pure(i, known);
+        case cfg::kind::move:
+          return nonnegative(i.expression, at, depth + 1);
+        case cfg::kind::arithmetic: {
+          std::vector<std::string> const parts = gvn::split(i.expression);
+          std::string const & op = parts.at(0);
+          std::string const & lhs = parts.at(1);
+          std::string const & rhs = parts.at(2);
+          if (op == ">>") return nonnegative(lhs, at, depth + 1);
+          if (op == "&") return false
+            || nonnegative(lhs, at, depth + 1)
+            || nonnegative(rhs, at, depth + 1);
+          // (a constant can't push a counter past 2^63, in practice)
+          if (op == "+" || op == "*") return false
+            || (number(rhs, c) && c >= 0 && nonnegative(lhs, at, depth + 1))
+            || (number(lhs, c) && c >= 0 && nonnegative(rhs, at, depth + 1));
+          return false;
+        }
+        default:
+          return false;
+      }
+    }
+
+    // %v <= %size in block `at`
+    bool at_most (
+      std::string const & v,
+      std::string const & size,
+      int at,
+      int depth = 0
+    ) {
+      std::string order;
+      if (v == size) return true;
+      if (depth > limit) return false;
+      for (relation const & r : settled.at(at))
+        if (r.lhs == v && ordered(r, order, at, depth)
+          && at_most(r.rhs, size, at, depth + 1))
+          return true;
+      auto const it = definition.find(v);
+      if (it != definition.end() && it->second->kind == cfg::kind::move)
+        return at_most(it->second->expression, size, at, depth + 1);
+      return below(v, size, at, depth + 1);
+    }
+
+    // %v < %size in block `at`
+    bool below (
+      std::string const & v,
+      std::string const & size,
+      int at,
+      int depth = 0
+    ) {
+      int64_t c;
+      std::string order;
+      if (v == size || depth > limit) return false;
+      for (relation const & r : settled.at(at)) {
+        if (r.lhs != v || !ordered(r, order, at, depth)) continue;
+        if (order == "<" && at_most(r.rhs, size, at, depth + 1)) return true;
+        if (order == "<=" && below(r.rhs, size, at, depth + 1)) return true;
+      }
+      if (helper::collection::has(v, phis))
+        return inductive(v, "< " + size, [&] (std::string const & u, int p) {
+          return below(u, size, p, depth + 1);
+        });
+      auto const it = definition.find(v);
+      if (it == definition.end()) return false;
+      cfg::instruction const & i = *it->second;
+      if (i.kind == cfg::kind::move)
+        return below(i.expression, size, at, depth + 1);
+      if (i.kind != cfg::kind::arithmetic) return false;
+      std::vector<std::string> const parts = gvn::split(i.expression);
+      std::string const & op = parts.at(0);
+      // %u - c, or %u + -c
+      std::string u;
+      if (op == "-" && number(parts.at(2), c)) {
+        u = parts.at(1);
+      } else if (op == "+" && number(parts.at(2), c)) {
+        u = parts.at(1);
+        c = -c;
+      } else if (op == "+" && number(parts.at(1), c)) {
+        u = parts.at(2);
+        c = -c;
+      } else {
+        return false;
+      }
+      return false
+        || (c >= 1 && at_most(u, size, at, depth + 1))
+        || (c >= 0 && below(u, size, at, depth + 1));
+    }
+
+    // %v != 0 in block `at`
+    bool nonnull (std::string const & v, int at, int depth = 0) {
+      int64_t c;
+      if (number(v, c)) return c != 0;
+      if (depth > limit) return false;
+      for (relation const & r : settled.at(at))
+        if (r.op == "!=" && ((r.lhs == v && r.rhs == "0")
+                          || (r.rhs == v && r.lhs == "0")))
+          return true;
+      if (helper::collection::has(v, phis))
+        return inductive(v, "!= 0", [&] (std::string const & u, int p) {
+          return nonnull(u, p, depth + 1);
+        });
+      auto const it = definition.find(v);
+      if (it == definition.end()) return false;
+      cfg::instruction const & i = *it->second;
+      if (i.kind == cfg::kind::move)
+        return nonnull(i.expression, at, depth + 1);
+      return i.kind == cfg::kind::call && i.target == "allocate";
+    }
+
+    // The array a null check is about, if that's what it is.
+    static std::string null_checked (relation const & r) {
+      if (r.op != "=") return "";
+      if (r.rhs == "0") return r.lhs;
+      if (r.lhs == "0") return r.rhs;
+      return "";
+    }
+
+    bool cannot_fail (check const & c) {
+      relation const & r = c.failure;
+      if (r.op == "<=u") return nonnegative(r.rhs, c.block)
+                             && below(r.rhs, r.lhs, c.block);
+      std::string const array = null_checked(r);
+      return !array.empty() && nonnull(array, c.block);
+    }
+
+    std::vector<check> checks () const {
+      std::vector<check> found;
+      for (int b = 0; b < s.f.blocks.size(); b++) {
+        if (!s.g.reachable.at(b)) continue;
+        std::vector<cfg::instruction> const & exits = s.f.blocks.at(b).exits;
+        for (int k = 0; k < exits.size(); k++) {
+          cfg::instruction const & exit = exits.at(k);
+          if (exit.kind != cfg::kind::branch || exit.ends) continue;
+          int const to = failure(s.f, cfg::find_label(s.f, exit.target));
+          relation r;
+          if (to < 0 || !condition(exit.uses.at(0), r)) continue;
+          found.push_back({ b, k, s.f.blocks.at(to).labels.at(0), r });
+        }
+      }
+      return found;
+    }
+  };
+
+  /*
+   * Can the checks `inside` loop `l` go in front of it (see the NOTE)? If
+   * so, say how in `h`.
+   */
+  bool combine (
+    analysis & a,
+    cfg::loop const & l,
+    std::vector<cfg::loop> const & all,
+    std::vector<check> inside,
+    hoist & h
+  ) {
+    ssa::form const & s = a.s;
+    int const header = l.header;
+    auto const in_loop = [&] (int b) {
+      return helper::collection::has(b, l.blocks);
+    };
+    auto const invariant = [&] (std::string const & v) {
+      int64_t c;
+      if (analysis::number(v, c)) return true;
+      auto const it = a.defined_in.find(v);
+      return it == a.defined_in.end() || !in_loop(it->second);
+    };
+    // Innermost loops, that nothing falls into from inside.
+    for (cfg::loop const & other : all)
+      if (other.header != header && in_loop(other.header)) return false;
+    if (header > 0 && in_loop(header - 1)
+      && falls_through(s.f.blocks.at(header - 1))) return false;
+    // Nothing anyone could notice, and no way out but the header.
+    for (int b : l.blocks) {
+      cfg::block const & bb = s.f.blocks.at(b);
+      for (cfg::instruction const & i : bb.body)
+        if (i.kind == cfg::kind::call) return false;
+      for (cfg::instruction const & i : bb.exits)
+        if (i.kind == cfg::kind::ret) return false;
+      if (b == header) continue;
+      for (int succ : s.g.successors.at(b))
+        if (!in_loop(succ) && failure(s.f, succ) < 0) return false;
+    }
+    // `br %c :body` `br :done` (or the other way around), `%c <- %i < %n`
+    cfg::block const & top = s.f.blocks.at(header);
+    if (top.exits.empty() || top.exits.size() > 2) return false;
+    cfg::instruction const & test = top.exits.at(0);
+    if (test.kind != cfg::kind::branch || test.ends) return false;
+    int const taken = cfg::find_label(s.f, test.target);
+    int otherwise = -1;
+    if (top.exits.size() == 2) {
+      cfg::instruction const & rest = top.exits.at(1);
+      if (rest.kind != cfg::kind::branch || !rest.ends) return false;
+      otherwise = cfg::find_label(s.f, rest.target);
+    } else if (header + 1 < s.f.blocks.size()) {
+      otherwise = header + 1;
+    }
+    if (otherwise < 0 || in_loop(taken) == in_loop(otherwise)) return false;
+    relation stay;
+    if (!a.condition(test.uses.at(0), stay)) return false;
+    if (!in_loop(taken)) stay = negate(stay);
+    std::string const & i = stay.lhs;
+    std::string const & n = stay.rhs;
+    if (stay.op != "<" || !invariant(n)) return false;
+    if (!helper::collection::has(i, a.phis) || a.phi_block.at(i) != header)
+      return false;
+    // %i goes up by one every time around.
+    ssa::phi const & counter = *a.phis.at(i);
+    std::vector<int> latches;
+    for (int k = 0; k < counter.uses.size(); k++) {
+      int const pred = s.g.predecessors.at(header).at(k);
+      if (!in_loop(pred)) continue;
+      latches.push_back(pred);
+      auto const it = a.definition.find(counter.uses.at(k));
+      if (it == a.definition.end()) return false;
+      cfg::instruction const & step = *it->second;
+      if (step.kind != cfg::kind::arithmetic) return false;
+      if (step.expression != "+ " + i + " 1"
+        && step.expression != "+ 1 " + i) return false;
+    }
+    // Every trip does every check, in the same order.
+    for (check const & c : inside)
+      for (int latch : latches)
+        if (!s.g.dominators.at(latch).at(c.block)) return false;
+    std::vector<int> depth(s.f.blocks.size(), 0);
+    for (check const & c : inside)
+      for (bool d : s.g.dominators.at(c.block)) depth.at(c.block) += d;
+    std::stable_sort(inside.begin(), inside.end(),
+      [&] (check const & x, check const & y) {
+        return depth.at(x.block) < depth.at(y.block)
+          || (x.block == y.block && x.exit < y.exit);
+      });
+
+    variables taken_names = cfg::mentioned(s.f);
+    for (auto const & entry : a.phis) taken_names.insert(entry.first);
+    variables taken_labels = cfg::labels(s.f);
+    auto const name = [&] (std::string const & base) {
+      std::string const fresh = cfg::fresh(base, taken_names);
+      taken_names.insert(fresh);
+      return fresh;
+    };
+    auto const label = [&] (std::string const & suffix) {
+      std::string const fresh
+        = cfg::fresh(top.labels.at(0) + "_" + suffix, taken_labels);
+      taken_labels.insert(fresh);
+      return fresh;
+    };
+    auto const same = [] (std::string const & v) { return v; };
+
+    // Sizes loaded inside the loop get loaded again out in front, as long
+    // as their array is known to be there by then.
+    variables checked; // arrays null-checked so far, out in front
+    std::map<std::string, std::string> sizes;
+    std::vector<cfg::instruction> loads;
+    auto const size = [&] (std::string const & v, std::string & out) {
+      if (invariant(v)) { out = v; return true; }
+      if (helper::collection::has(v, sizes)) { out = sizes.at(v); return true; }
+      auto const there = [&] (std::string const & array) {
+        return helper::collection::has(array, checked)
+          || a.nonnull(array, s.idom.at(header));
+      };
+      auto const it = a.definition.find(v);
+      if (it == a.definition.end()) return false;
+      cfg::instruction const & decode = *it->second;
+      if (decode.kind == cfg::kind::load) {
+        // a tuple's size
+        std::string const & array = decode.uses.at(0);
+        if (!gvn::pure(decode, a.known) || !invariant(array)) return false;
+        if (!there(array)) return false;
+        out = name(v + "_before");
+        loads.push_back(cfg::rewrite(decode, out, same));
+        sizes[v] = out;
+        return true;
+      }
+      // an array's dimension: (load (offset + %A)) >> 1
+      if (decode.kind != cfg::kind::arithmetic) return false;
+      if (gvn::split(decode.expression).at(0) != ">>") return false;
+      auto const load_it = a.definition.find(decode.uses.at(0));
+      if (load_it == a.definition.end()) return false;
+      cfg::instruction const & load = *load_it->second;
+      if (load.kind != cfg::kind::load || !gvn::pure(load, a.known))
+        return false;
+      auto const cell_it = a.definition.find(load.uses.at(0));
+      if (cell_it == a.definition.end()) return false;
+      cfg::instruction const & cell = *cell_it->second;
+      if (cell.kind != cfg::kind::arithmetic || cell.uses.size() != 1)
+        return false;
+      if (!invariant(cell.uses.at(0)) || !there(cell.uses.at(0)))
+        return false;
+      std::string const cell_name = name(cell.defines + "_before");
+      std::string const load_name = name(load.defines + "_before");
+      out = name(v + "_before");
+      loads.push_back(cfg::rewrite(cell, cell_name, same));
+      loads.push_back(cfg::rewrite(load, load_name,
+        [&] (std::string const &) { return cell_name; }));
+      loads.push_back(cfg::rewrite(decode, out,
+        [&] (std::string const &) { return load_name; }));
+      sizes[v] = out;
+      return true;
+    };
+    // Whatever a failure reports has to be around out in front, too.
+    // (Anything not defined in the loop is: the failure only came from
+    // inside it, so it's defined in the failure, or before the loop.)
+    auto const reports_invariant = [&] (check const & c) {
+      cfg::block const & fail
+        = s.f.blocks.at(cfg::find_label(s.f, c.fail));
+      for (cfg::instruction const & x : fail.body)
+        for (std::string const & use : x.uses)
+          if (use != i && !invariant(use)) return false;
+      return true;
+    };
+
+    std::string const enter = label("bounds");
+    std::string const first = label("bounds_check");
+    std::string const run = name("%bounds_run");
+    h.header = top.labels.at(0);
+    h.checks.push_back({ { enter }, {
+      cfg::parse(run + " <- " + i + " < " + n),
+    }, {
+      cfg::parse("br " + run + " " + first),
+      cfg::parse("br " + h.header),
+    } });
+    h.checks.push_back({ { first } });
+    check const * upper = nullptr;
+    std::string upper_size;
+    for (check const & c : inside) {
+      relation r = c.failure;
+      if (!reports_invariant(c)) return false;
+      loads.clear();
+      std::string const array = analysis::null_checked(r);
+      if (!array.empty()) {
+        if (!invariant(array)) return false;
+        checked.insert(array);
+      } else if (r.op == "<=u") {
+        std::string loaded;
+        if (!size(r.lhs, loaded)) return false;
+        r.lhs = loaded;
+        if (r.rhs == i) {
+          if (upper != nullptr) return false;
+          upper = &c;
+          upper_size = r.lhs;
+        } else if (!invariant(r.rhs)) {
+          return false;
+        }
+      } else {
+        return false;
+      }
+      // The first trip's check, with %i where it starts.
+      std::string const failed = name("%bounds_failed");
+      cfg::block & b = h.checks.back();
+      b.body.insert(b.body.end(), loads.begin(), loads.end());
+      b.body.push_back(cfg::parse(
+        failed + " <- " + r.lhs + " " + r.op + " " + r.rhs
+      ));
+      b.exits.push_back(cfg::parse("br " + failed + " " + c.fail));
+      h.checks.push_back({});
+    }
+    if (upper != nullptr) {
+      // Some later trip gets to %i = size, and fails there.
+      std::string const over = name("%bounds_failed");
+      std::string const overrun = label("overrun");
+      h.checks.back().body.push_back(
+        cfg::parse(over + " <- " + upper_size + " < " + n)
+      );
+      h.checks.back().exits.push_back(
+        cfg::parse("br " + over + " " + overrun)
+      );
+      h.cold.push_back({ { overrun }, {
+        cfg::parse(i + " <- " + upper_size),
+      }, {
+        cfg::parse("br " + upper->fail),
+      } });
+    }
+    h.checks.back().exits.push_back(cfg::parse("br " + h.header));
+    return true;
+  }
+
+  /*
+   * Take out the checks that can't fail, and work out which loops get a
+   * combined check instead of theirs (see apply).
+   */
+  std::vector<hoist> run (
+    ssa::form & s,
+    cfg::facts const & known,
+    report * r = nullptr
+  ) {
+    report scratch;
+    report & tally = r ? *r : scratch;
+    std::vector<hoist> hoists;
+    std::vector<check> remaining;
+    std::map<int, std::set<int>> gone; // block -> exits to take out
+    {
+      analysis a(s, known);
+      std::vector<check> const found = a.checks();
+
+      tally.checks += found.size();
+      for (check const & c : found) {
+        if (a.cannot_fail(c)) {
+          gone[c.block].insert(c.exit);
+          tally.removed++;
+        } else {
+          remaining.push_back(c);
+        }
+      }
+      std::vector<cfg::loop> const all = cfg::loops(s.g);
+      for (cfg::loop const & l : all) {
+        std::vector<check> inside;
+        for (check const & c : remaining)
+          if (helper::collection::has(c.block, l.blocks)) inside.push_back(c);
+        if (inside.empty()) continue;
+        hoist h;
+        if (!combine(a, l, all, inside, h)) continue;
+        for (check const & c : inside) gone[c.block].insert(c.exit);
+        tally.hoisted += inside.size();
+        tally.loops++;
+        hoists.push_back(std::move(h));
+      }
+    }
+    for (auto const & entry : gone) {
+      auto & exits = s.f.blocks.at(entry.first).exits;
+      for (auto k = entry.second.rbegin(); k != entry.second.rend(); k++)
+        exits.erase(exits.begin() + *k);
+    }
+    // The comparisons, and the sizes loaded for them, may be dead now.
+    gvn::report dead;
+    gvn::eliminate_dead(s, known, dead);
+    return hoists;
+  }
+
+  /*
+   * Out of SSA form: put each combined check in front of its loop, and
+   * throw out the failures nothing goes to any more.
+   */
+  void apply (cfg::function & f, std::vector<hoist> const & hoists) {
+    for (hoist const & h : hoists) {
+      int const header = cfg::find_label(f, h.header);
+      assert(header >= 0 && "bounds::apply: loop header went away");
+      cfg::graph const g = cfg::analyze(f);
+      std::set<int> inside;
+      for (cfg::loop const & l : cfg::loops(g))
+        if (l.header == header) inside = l.blocks;
+      std::string const & to = h.checks.front().labels.at(0);
+      for (int b = 0; b < f.blocks.size(); b++) {
+        if (helper::collection::has(b, inside)) continue;
+        for (cfg::instruction & exit : f.blocks.at(b).exits)
+          if (exit.kind == cfg::kind::branch
+            && helper::collection::has(exit.target, f.blocks.at(header).labels))
+            cfg::retarget(exit, to);
+      }
+      f.blocks.insert(f.blocks.begin() + header, h.checks.begin(), h.checks.end());
+      f.blocks.insert(f.blocks.end(), h.cold.begin(), h.cold.end());
+    }
+    variables targets;
+    for (cfg::block const & b : f.blocks)
+      for (cfg::instruction const & exit : b.exits)
+        if (exit.kind == cfg::kind::branch) targets.insert(exit.target);
+    for (int b = f.blocks.size() - 1; b > 0; b--) {
+      cfg::block const & bb = f.blocks.at(b);
+      if (!is_failure(bb) || falls_through(f.blocks.at(b - 1))) continue;
+      bool used = false;
+      for (std::string const & label : bb.labels)
+        used = used || helper::collection::has(label, targets);
+      if (!used) f.blocks.erase(f.blocks.begin() + b);
+    }
+  }
+}
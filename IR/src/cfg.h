@@ -0,0 +1,506 @@
+#pragma once
+
+#include <algorithm>
+#include <cctype>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "ast.h"
+#include "helper.h"
+#include "grammar.h"
+
+/*
+ * ======================================================================
+ *  Lowered control flow graph
+ * ======================================================================
+ *
+ * NOTE(jordan): translate (codegen.h) turns each IR instruction into a
+ * handful of L3 instructions, and the interesting redundancy (header
+ * loads, decoding, address arithmetic) only shows up *after* that. So
+ * the IR optimizations work on the translated code, still grouped into
+ * the IR's basic blocks:
+ *
+ *   block: | labels | body (no control flow) | exits (br, return) |
+ *
+ * Every instruction keeps its L3 text, which is what gets printed back
+ * out; we parse each one with the L3 grammar to find out what it defines
+ * and reads, rather than trusting the spacing of whatever the IR source
+ * or translate produced.
+ */
+namespace codegen::IR::cfg {
+  using node    = ast::node;
+  using up_node = ast::up_node;
+
+  enum class kind {
+    move,        // %v <- s
+    arithmetic,  // %v <- t op t (arithmetic and shifts)
+    compare,     // %v <- t cmp t
+    load,        // %v <- load %p
+    store,       // store %p <- s
+    call,        // [%v <-] call callee (args)
+    label,       // :l
+    branch,      // br [t] :l
+    ret,         // return [t]
+  };
+
+  struct instruction {
+    cfg::kind kind;
+    std::string text;
+    std::string defines;             // empty if nothing
+    std::vector<std::string> uses;   // variables read, in order
+    // move/arithmetic/compare/load: the right-hand side, normalized, so
+    // that two instructions computing the same thing compare equal.
+    std::string expression;
+    std::string target;              // branch: the label; call: callee
+    bool ends = false;               // br :l and return
+  };
+
+  struct block {
+    std::vector<std::string> labels;
+    std::vector<instruction> body;
+    std::vector<instruction> exits;
+  };
+
+  struct function {
+    std::string header;              // "define :f (%a, %b) {"
+    std::vector<block> blocks;
+  };
+}
+
+namespace codegen::IR::cfg {
+  void gather_uses (node const & n, std::vector<std::string> & uses) {
+    if (n.is<grammar::L3::operand::variable>()) {
+      uses.push_back(n.content());
+      return;
+    }
+    for (up_node const & child : n.children) gather_uses(*child, uses);
+  }
+
+  // The callee of the (only) call in `n`.
+  std::string callee (node const & n) {
+    if (false
+      || n.is<grammar::L3::expression::call::intrinsic>()
+      || n.is<grammar::L3::expression::call::defined>()
+    ) return n.children.at(0)->content();
+    for (up_node const & child : n.children) {
+      std::string found = callee(*child);
+      if (!found.empty()) return found;
+    }
+    return "";
+  }
+
+  std::string binary (node const & expression) {
+    // [0] lhs  [1] op  [2] rhs
+    return helper::string::from_strings({
+      expression.children.at(1)->content(), " ",
+      expression.children.at(0)->content(), " ",
+      expression.children.at(2)->content(),
+    });
+  }
+
+  instruction parse (std::string const & text) {
+    namespace L3 = grammar::L3::instruction;
+    using line = tao::pegtl::sor<
+      L3::context::entry,
+      L3::context::terminator,
+      L3::context::body
+    >;
+    up_node const root = ast::L3::construct::from_string<line>(text);
+    node const & n = *root->children.at(0);
+    instruction i = { kind::call, text };
+    if (n.is<L3::define::label>()) {
+      i.kind = kind::label;
+      i.target = n.children.at(0)->content();
+      return i;
+    }
+    if (n.is<L3::branch::variable>() || n.is<L3::branch::unconditional>()) {
+      i.kind = kind::branch;
+      i.target = n.children.back()->content();
+      i.ends = n.is<L3::branch::unconditional>();
+      gather_uses(n, i.uses);
+      return i;
+    }
+    if (n.is<L3::ret::value>() || n.is<L3::ret::nothing>()) {
+      i.kind = kind::ret;
+      i.ends = true;
+      gather_uses(n, i.uses);
+      return i;
+    }
+    if (n.is<L3::assign::address::gets_movable>()) {
+      i.kind = kind::store;
+      gather_uses(n, i.uses);
+      return i;
+    }
+    if (n.is<L3::call>()) {
+      i.target = callee(n);
+      gather_uses(n, i.uses);
+      return i;
+    }
+    // Everything else is `%v <- something`.
+    // [0] variable  [1] gets  [2] right-hand side
+    node const & rhs = *n.children.at(2);
+    i.defines = n.children.at(0)->content();
+    gather_uses(rhs, i.uses);
+    if (n.is<L3::assign::variable::gets_movable>()) {
+      i.kind = kind::move;
+      i.expression = rhs.content();
+    } else if (false
+      || n.is<L3::assign::variable::gets_arithmetic>()
+      || n.is<L3::assign::variable::gets_shift>()
+    ) {
+      i.kind = kind::arithmetic;
+      i.expression = binary(rhs);
+    } else if (n.is<L3::assign::variable::gets_comparison>()) {
+      i.kind = kind::compare;
+      i.expression = binary(rhs);
+    } else if (n.is<L3::assign::variable::gets_load>()) {
+      i.kind = kind::load;
+      i.expression = "load " + i.uses.at(0);
+    } else {
+      i.kind = kind::call; // gets_call
+      i.target = callee(rhs);
+    }
+    return i;
+  }
+
+  // Split translated text into one instruction per line.
+  void parse_lines (
+    std::vector<std::string> const & strings,
+    std::vector<instruction> & into
+  ) {
+    std::string text = helper::string::from_strings(strings);
+    std::size_t start = 0;
+    while (start < text.size()) {
+      std::size_t end = text.find('\n', start);
+      if (end == std::string::npos) end = text.size();
+      std::string line = helper::string::trim(
+        text.substr(start, end - start)
+      );
+      // (the IR's instructions bring their trailing comments along)
+      if (!line.empty() && line.rfind("//", 0) != 0)
+        into.push_back(parse(line));
+      start = end + 1;
+    }
+  }
+
+  std::string print (function const & f) {
+    std::vector<std::string> strings = { f.header, "\n" };
+    for (block const & b : f.blocks) {
+      for (std::string const & label : b.labels)
+        helper::collection::append(strings, { label, "\n" });
+      for (instruction const & i : b.body)
+        helper::collection::append(strings, { i.text, "\n" });
+      for (instruction const & i : b.exits)
+        helper::collection::append(strings, { i.text, "\n" });
+    }
+    strings.push_back("}\n");
+    return helper::string::from_strings(strings);
+  }
+}
+
+/*
+ * Successors, dominators, and natural loops
+ */
+namespace codegen::IR::cfg {
+  struct graph {
+    std::vector<std::vector<int>> successors;
+    std::vector<std::vector<int>> predecessors;
+    std::vector<bool> reachable;
+    // dominators[b][d]: every path from the entry to b goes through d
+    std::vector<std::vector<bool>> dominators;
+  };
+
+  struct loop {
+    int header;
+    std::set<int> blocks;    // including the header
+    std::set<int> exits;     // blocks outside the loop it branches to
+  };
+
+  int find_label (function const & f, std::string const & label) {
+    for (int b = 0; b < f.blocks.size(); b++)
+      if (helper::collection::has(label, f.blocks.at(b).labels))
+        return b;
+    return -1;
+  }
+
+  graph analyze (function const & f) {
+    int const n = f.blocks.size();
+    graph g = {
+      std::vector<std::vector<int>>(n),
+      std::vector<std::vector<int>>(n),
+      std::vector<bool>(n, false),
+      std::vector<std::vector<bool>>(n, std::vector<bool>(n, true)),
+    };
+    for (int b = 0; b < n; b++) {
+      bool ended = false;
+      for (instruction const & exit : f.blocks.at(b).exits) {
+        if (exit.kind == kind::branch) {
+          int target = find_label(f, exit.target);
+          assert(target >= 0 && "branch to a label that isn't defined");
+          if (!helper::collection::has(target, g.successors.at(b)))
+            g.successors.at(b).push_back(target);
+        }
+        if ((ended = exit.ends)) break;
+      }
+      if (!ended && b + 1 < n) g.successors.at(b).push_back(b + 1);
+      for (int s : g.successors.at(b)) g.predecessors.at(s).push_back(b);
+    }
+    if (n == 0) return g;
+    // reachability from the entry (block 0)
+    std::vector<int> work = { 0 };
+    g.reachable.at(0) = true;
+    while (!work.empty()) {
+      int b = work.back(); work.pop_back();
+      for (int s : g.successors.at(b))
+        if (!g.reachable.at(s)) { g.reachable.at(s) = true; work.push_back(s); }
+    }
+    // dominators: the usual iterative intersection, over reachable blocks
+    g.dominators.at(0) = std::vector<bool>(n, false);
+    g.dominators.at(0).at(0) = true;
+    bool changed = true;
+    while (changed) {
+      changed = false;
+      for (int b = 1; b < n; b++) {
+        if (!g.reachable.at(b)) continue;
+        std::vector<bool> next(n, true);
+        for (int p : g.predecessors.at(b)) {
+          if (!g.reachable.at(p)) continue;
+          for (int d = 0; d < n; d++)
+            next[d] = next[d] && g.dominators.at(p).at(d);
+        }
+        next[b] = true;
+        if (next != g.dominators.at(b)) {
+          g.dominators.at(b) = next;
+          changed = true;
+        }
+      }
+    }
+    return g;
+  }
+
+  /*
+   * One loop per header: every edge b -> h where h dominates b is a back
+   * edge, and the loop is everything that can reach b without going
+   * through h. Innermost (smallest) loops first.
+   */
+  std::vector<loop> loops (graph const & g) {
+    std::map<int, loop> by_header;
+    int const n = g.successors.size();
+    for (int b = 0; b < n; b++) {
+      if (!g.reachable.at(b)) continue;
+      for (int h : g.successors.at(b)) {
+        if (!g.dominators.at(b).at(h)) continue;
+        loop & l = by_header[h];
+        l.header = h;
+        l.blocks.insert(h);
+        std::vector<int> work = { b };
+        while (!work.empty()) {
+          int m = work.back(); work.pop_back();
+          if (!l.blocks.insert(m).second) continue;
+          for (int p : g.predecessors.at(m))
+            if (g.reachable.at(p)) work.push_back(p);
+        }
+      }
+    }
+    std::vector<loop> result;
+    for (auto & entry : by_header) {
+      loop & l = entry.second;
+      for (int b : l.blocks)
+        for (int s : g.successors.at(b))
+          if (!helper::collection::has(s, l.blocks)) l.exits.insert(s);
+      result.push_back(l);
+    }
+    std::stable_sort(result.begin(), result.end(),
+      [] (loop const & a, loop const & b) {
+        return a.blocks.size() < b.blocks.size();
+      });
+    return result;
+  }
+}
+
+/*
+ * Liveness, per block
+ */
+namespace codegen::IR::cfg {
+  using variables = std::set<std::string>;
+
+  // What translate knows that the L3 code doesn't say.
+  struct facts {
+    variables header_cells; // only ever point into an array's header
+    variables pointers;     // declared arrays and tuples
+  };
+
+  struct liveness {
+    std::vector<variables> in;
+    std::vector<variables> out;
+  };
+
+  void step_backward (instruction const & i, variables & live) {
+    if (!i.defines.empty()) live.erase(i.defines);
+    for (std::string const & use : i.uses) live.insert(use);
+  }
+
+  liveness live (function const & f, graph const & g) {
+    int const n = f.blocks.size();
+    liveness l = { std::vector<variables>(n), std::vector<variables>(n) };
+    bool changed = true;
+    while (changed) {
+      changed = false;
+      for (int b = n - 1; b >= 0; b--) {
+        variables out;
+        for (int s : g.successors.at(b))
+          out.insert(l.in.at(s).begin(), l.in.at(s).end());
+        variables in = out;
+        block const & bb = f.blocks.at(b);
+        for (auto i = bb.exits.rbegin(); i != bb.exits.rend(); i++)
+          step_backward(*i, in);
+        for (auto i = bb.body.rbegin(); i != bb.body.rend(); i++)
+          step_backward(*i, in);
+        if (in != l.in.at(b) || out != l.out.at(b)) {
+          l.in.at(b) = std::move(in);
+          l.out.at(b) = std::move(out);
+          changed = true;
+        }
+      }
+    }
+    return l;
+  }
+
+  // Every variable the function mentions, for making up fresh ones.
+  variables mentioned (function const & f) {
+    variables all;
+    for (block const & b : f.blocks) {
+      for (auto const * list : { &b.body, &b.exits })
+        for (instruction const & i : *list) {
+          if (!i.defines.empty()) all.insert(i.defines);
+          all.insert(i.uses.begin(), i.uses.end());
+        }
+    }
+    return all;
+  }
+
+  // The function's parameters, from its header.
+  std::vector<std::string> parameters (function const & f) {
+    std::vector<std::string> names;
+    std::size_t at = f.header.find('%');
+    while (at != std::string::npos) {
+      std::size_t end = at + 1;
+      while (end < f.header.size()
+        && (std::isalnum(f.header.at(end)) || f.header.at(end) == '_'))
+        end++;
+      names.push_back(f.header.substr(at, end - at));
+      at = f.header.find('%', end);
+    }
+    return names;
+  }
+
+  /*
+   * Rename the variables `i` mentions: what it defines (if anything) to
+   * `defines`, everything it reads through `use`.
+   */
+  template <typename Use>
+  instruction rewrite (
+    instruction const & i,
+    std::string const & defines,
+    Use const & use
+  ) {
+    std::string text;
+    bool first = !i.defines.empty();
+    std::size_t at = 0;
+    while (at < i.text.size()) {
+      char const c = i.text.at(at);
+      if (c != '%') { text += c; at++; continue; }
+      std::size_t end = at + 1;
+      while (end < i.text.size()
+        && (std::isalnum(i.text.at(end)) || i.text.at(end) == '_'))
+        end++;
+      std::string const name = i.text.substr(at, end - at);
+      text += first ? defines : use(name);
+      first = false;
+      at = end;
+    }
+    return parse(text);
+  }
+
+  std::string fresh (std::string name, std::set<std::string> const & taken) {
+    while (helper::collection::has(name, taken)) name += "_";
+    return name;
+  }
+
+  std::set<std::string> labels (function const & f) {
+    std::set<std::string> all;
+    for (block const & b : f.blocks)
+      all.insert(b.labels.begin(), b.labels.end());
+    return all;
+  }
+}
+
+/*
+ * Tidying up
+ */
+namespace codegen::IR::cfg {
+  /*
+   * Skip over blocks that do nothing but jump somewhere else, and drop
+   * conditional branches to wherever the block goes anyway. Passes that
+   * add blocks (or empty them out) leave plenty of both behind.
+   */
+  void retarget (instruction & branch, std::string const & to) {
+    branch = parse(branch.uses.empty()
+      ? "br " + to
+      : "br " + branch.uses.at(0) + " " + to);
+  }
+
+  // Is `label` ever used as a value (`%v <- :l`, `call :l`)?
+  bool escapes (function const & f, std::string const & label) {
+    for (block const & b : f.blocks)
+      for (instruction const & i : b.body)
+        if (i.expression == label || (i.kind == kind::call && i.target == label))
+          return true;
+    return false;
+  }
+
+  void thread (function & f) {
+    bool changed = true;
+    while (changed) {
+      changed = false;
+      for (block & b : f.blocks) {
+        auto & exits = b.exits;
+        if (exits.size() == 2
+          && exits.at(0).kind == kind::branch && !exits.at(0).ends
+          && exits.at(1).kind == kind::branch && exits.at(1).ends
+          && exits.at(0).target == exits.at(1).target
+        ) {
+          exits.erase(exits.begin());
+          changed = true;
+        }
+      }
+      for (int b = 1; b < f.blocks.size(); b++) {
+        block const & bb = f.blocks.at(b);
+        if (!bb.body.empty() || bb.exits.size() != 1) continue;
+        instruction const & exit = bb.exits.at(0);
+        if (exit.kind != kind::branch || !exit.ends) continue;
+        if (helper::collection::has(exit.target, bb.labels)) continue;
+        // Whatever comes before it would fall through into the next one.
+        bool ends = false;
+        for (instruction const & i : f.blocks.at(b - 1).exits)
+          ends = ends || i.ends;
+        if (!ends) continue;
+        bool used = false;
+        for (std::string const & label : bb.labels)
+          used = used || escapes(f, label);
+        if (used) continue;
+        std::string const to = exit.target;
+        std::vector<std::string> const from = bb.labels;
+        for (block & other : f.blocks)
+          for (instruction & i : other.exits)
+            if (i.kind == kind::branch && helper::collection::has(i.target, from))
+              retarget(i, to);
+        f.blocks.erase(f.blocks.begin() + b);
+        changed = true;
+        break;
+      }
+    }
+  }
+}
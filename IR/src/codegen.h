@@ -4,6 +4,7 @@
 #include "helper.h"
 #include "grammar.h"
 #include "analysis.h"
+#include "cfg.h"
 
 namespace codegen::IR {
   using node    = ast::node;
@@ -11,8 +12,218 @@ namespace codegen::IR {
   struct result {
     analysis::IR::variables::result variables_summary;
     std::vector<std::string> instructions;
+    bool stride_headers = false; // see strided_index, below
+    // Temporaries that only ever point into an array's header, which
+    // nothing writes to once the array is made (see licm.h).
+    std::set<std::string> header_cells;
+    bool check_bounds = false;   // see check_access, below
+    std::set<std::string> labels;         // the function's, and ours
+    std::vector<std::string> cold;        // blocks that go at the end
+    int out_of_bounds = 0;                // how many of those
   };
   struct translate { static bool act (node const &, result &); };
+
+  /* NOTE(jordan): with -S, arrays of 2 or more dimensions also keep a
+   * stride (how many bytes apart consecutive indices are) for every
+   * dimension but the last, already decoded, right after the sizes:
+   *
+   * | size | 8n + 2 | dim 0 | ... | dim n-1 | stride 0 | ... | data ...
+   *
+   * so indexing is a dot product: one load and one multiply per index,
+   * instead of Horner's rule over the encoded sizes. The `8n + 2` (the
+   * number of dimensions) is neither a number (odd) nor a pointer
+   * (aligned), which tells the runtime's print to skip over the strides.
+   * The strides themselves are far too small to be heap addresses, so the
+   * GC leaves them be. `length` never sees any of it.
+   */
+  inline bool strided (result const & result, int num_dimensions) {
+    return result.stride_headers && num_dimensions > 1;
+  }
+
+  inline int header_cells (result const & result, int num_dimensions) {
+    return strided(result, num_dimensions)
+      ? 2 * num_dimensions       // #dimensions, each size, each stride
+      : num_dimensions + 1;      // #dimensions, each size
+  }
+
+  // index_variable <- address of array[accessors...]
+  inline void strided_index (
+    node const & array,
+    node const & accessors,
+    std::string const & index_variable,
+    result & result
+  ) {
+    auto & instructions = result.instructions;
+    int num_dimensions = accessors.children.size();
+    node const & last = helper::unwrap_assert(
+      *accessors.children.at(num_dimensions - 1)
+    );
+    // the last index is always 8 bytes from the next
+    helper::collection::append(instructions, {
+      index_variable, " <- ", last.content(), " * 8", "\n",
+    });
+    for (int index = 0; index < num_dimensions - 1; index++) {
+      node const & index_node
+        = helper::unwrap_assert(*accessors.children.at(index));
+      std::string cell_variable = helper::IR::variable::gen_pointer(
+        array,
+        index,
+        "stride_cell"
+      );
+      std::string stride_variable = helper::IR::variable::gen_pointer(
+        array,
+        index,
+        "stride"
+      );
+      result.header_cells.insert(cell_variable);
+      std::string term_variable = helper::IR::variable::gen_pointer(
+        array,
+        index,
+        "term"
+      );
+      helper::collection::append(instructions, {
+        // ptr: array + stride cell
+        cell_variable,
+          " <- ", std::to_string((num_dimensions + 2 + index) * 8),
+          " + ", array.content(),
+          "\n",
+        stride_variable,
+          " <- load ", cell_variable,
+          "\n",
+        term_variable,
+          " <- ", stride_variable, " * ", index_node.content(),
+          "\n",
+        index_variable,
+          " <- ", index_variable, " + ", term_variable,
+          "\n",
+      });
+    }
+    helper::collection::append(instructions, {
+      // skip over the header cells (size, #dimensions, sizes, strides)
+      index_variable,
+        " <- ", index_variable,
+        " + ", std::to_string((2 * num_dimensions + 1) * 8),
+        "\n",
+      index_variable,
+        " <- ", index_variable, " + ", array.content(),
+        "\n",
+    });
+  }
+
+  /* NOTE(jordan): with -B, every access to an array or a tuple first
+   * makes sure it exists and that each index is inside its dimension, the
+   * way LA wants, and calls array-error otherwise:
+   *
+   *   %array_A_check_null <- %A = 0
+   *   br %array_A_check_null :A_out_of_bounds_0
+   *   %array_A_dimension_0 <- 16 + %A
+   *   ...
+   *   %array_A_bounds_0 <- %array_A_dimension_size_0 <=u %i
+   *   br %array_A_bounds_0 :A_out_of_bounds_1
+   *
+   * One unsigned compare per index: a negative %i is a huge unsigned
+   * number, so it's past the end of anything too.
+   *
+   * Each check ends a basic block (see lower, below), and the calls to
+   * array-error go at the end of the function, out of the way: the access
+   * itself just falls through. At -O1, bounds.h throws out the checks
+   * that can't fail.
+   */
+  // (a value is a variable, or a number)
+  inline bool is_number (node const & value) {
+    return value.content().at(0) != '%';
+  }
+
+  inline std::string out_of_bounds (
+    node const & array,
+    node const & index_node,
+    result & result
+  ) {
+    std::string label = cfg::fresh(helper::string::from_strings({
+      ":", helper::L3::strip_variable_prefix(array.content()),
+      "_out_of_bounds_", std::to_string(result.out_of_bounds++),
+    }), result.labels);
+    result.labels.insert(label);
+    std::string index_variable
+      = helper::IR::variable::gen_pointer(array, "index", "error");
+    std::string encoded = is_number(index_node)
+      ? std::to_string(std::stoll(index_node.content()) * 2 + 1)
+      : index_variable;
+    helper::collection::append(result.cold, { label, "\n" });
+    if (encoded == index_variable)
+      helper::collection::append(result.cold, {
+        index_variable, " <- ", index_node.content(), " << 1", "\n",
+        index_variable, " <- ", index_variable, " + 1", "\n",
+      });
+    helper::collection::append(result.cold, {
+      "call array-error(", array.content(), ", ", encoded, ")", "\n",
+      // (array-error never returns)
+      "return", "\n",
+    });
+    return label;
+  }
+
+  inline void check_access (
+    node const & array,
+    node const & accessors,
+    bool tuple,
+    result & result
+  ) {
+    auto & instructions = result.instructions;
+    node const & first = helper::unwrap_assert(*accessors.children.at(0));
+    std::string null_variable = helper::IR::variable::gen_pointer(
+      array, "null", "check", tuple ? "tuple" : "array"
+    );
+    helper::collection::append(instructions, {
+      null_variable, " <- ", array.content(), " = 0", "\n",
+      "br ", null_variable, " ", out_of_bounds(array, first, result), "\n",
+    });
+    for (int index = 0; index < accessors.children.size(); index++) {
+      node const & index_node
+        = helper::unwrap_assert(*accessors.children.at(index));
+      std::string size_variable;
+      if (tuple) {
+        // a tuple's size is its first word, as is
+        size_variable = helper::IR::variable::gen_pointer(
+          array, index, "size", "tuple"
+        );
+        result.header_cells.insert(array.content());
+        helper::collection::append(instructions, {
+          size_variable, " <- load ", array.content(), "\n",
+        });
+      } else {
+        // the same cells (and names) that indexing and length use
+        std::string cell_variable = helper::IR::variable::gen_pointer(
+          array, index, "dimension"
+        );
+        std::string encoded_variable = helper::IR::variable::gen_pointer(
+          array, index, "encoded_dimension"
+        );
+        size_variable = helper::IR::variable::gen_pointer(
+          array, index, "dimension_size"
+        );
+        result.header_cells.insert(cell_variable);
+        helper::collection::append(instructions, {
+          cell_variable,
+            " <- ", std::to_string((index + 2) * 8),
+            " + ", array.content(),
+            "\n",
+          encoded_variable, " <- load ", cell_variable, "\n",
+          size_variable, " <- ", encoded_variable, " >> 1", "\n",
+        });
+      }
+      std::string fail = out_of_bounds(array, index_node, result);
+      std::string check_variable = helper::IR::variable::gen_pointer(
+        array, index, "bounds", tuple ? "tuple" : "array"
+      );
+      helper::collection::append(instructions, {
+        check_variable,
+          " <- ", size_variable, " <=u ", index_node.content(),
+          "\n",
+        "br ", check_variable, " ", fail, "\n",
+      });
+    }
+  }
 }
 
 bool codegen::IR::translate::act(
@@ -42,7 +253,9 @@ bool codegen::IR::translate::act(
       for (up_node const & argument : arguments.children)
         dimensions.push_back(&helper::unwrap_assert(*argument));
       int num_dimensions = dimensions.size();
-      int num_dimensions_encoded = (num_dimensions << 1) + 1;
+      int num_dimensions_encoded = strided(result, num_dimensions)
+        ? (num_dimensions << 3) + 2
+        : (num_dimensions << 1) + 1;
       /*
        * | total size | # dimensions | dimension size | ... | data ...
        */
@@ -72,7 +285,7 @@ bool codegen::IR::translate::act(
         });
       }
       // add extra header data to size
-      int header_size = num_dimensions + 1; // #dimensions + each size
+      int header_size = header_cells(result, num_dimensions);
       helper::collection::append(instructions, {
         size_variable,
           " <- ", size_variable,
@@ -125,6 +338,43 @@ bool codegen::IR::translate::act(
             "\n",
         });
       }
+      // store each stride, last to first (in bytes; not encoded)
+      if (strided(result, num_dimensions)) {
+        std::string stride_variable = helper::string::from_strings({
+          "%", helper::L3::strip_variable_prefix(variable.content()),
+          "_stride",
+        });
+        helper::collection::append(instructions, {
+          stride_variable, " <- 8", "\n",
+        });
+        for (int index = num_dimensions - 2; index >= 0; index--) {
+          int bytes = 8 * (num_dimensions + 2 + index);
+          std::string dim_variable
+            = helper::IR::variable::gen_dimension(
+              variable,
+              *dimensions.at(index + 1),
+              index + 1
+            );
+          std::string header_stride_variable
+            = helper::IR::variable::gen_pointer(
+              variable,
+              num_dimensions + 2 + index,
+              "header"
+            );
+          helper::collection::append(instructions, {
+            stride_variable,
+              " <- ", stride_variable, " * ", dim_variable,
+              "\n",
+            header_stride_variable,
+              " <- ", variable.content(),
+              " + ", std::to_string(bytes),
+              "\n",
+            "store ", header_stride_variable,
+              " <- ", stride_variable,
+              "\n",
+          });
+        }
+      }
       return false;
     }
     if (object.is<grammar::IR::literal::object::tuple>()) {
@@ -162,6 +412,12 @@ bool codegen::IR::translate::act(
     // must unwrap the actual type from its  'any type' wrapper
     node const & any_type = *typed.children.at(0);
     node const & type     = helper::unwrap_assert(any_type);
+    if (result.check_bounds) check_access(
+      array,
+      accessors,
+      type.is<grammar::IR::literal::type::tuple_>(),
+      result
+    );
     if (type.is<grammar::IR::literal::type::multiarray::any>()) {
       node const & array_type = helper::unwrap_assert(type);
       node const & type_dimensions = *array_type.children.at(1);
@@ -182,6 +438,16 @@ bool codegen::IR::translate::act(
         array,
         helper::string::from_strings(index_strings, "_")
       );
+      if (
+        strided(result, num_dimensions)
+        && accessors.children.size() == num_dimensions
+      ) {
+        strided_index(array, accessors, index_variable, result);
+        helper::collection::append(instructions, {
+          variable.content(), " <- load ", index_variable, "\n",
+        });
+        return false;
+      }
       // Prepare the index!
       helper::collection::append(instructions, {
         index_variable, " <- 0", "\n",
@@ -196,25 +462,38 @@ bool codegen::IR::translate::act(
         // if this is the 1st index, skip multiplying 0 by a dimension
         if (index_index > 0) {
           // multiply index-so-far by the size of its dimension
-          std::string dim_size_variable
+          std::string dim_cell_variable
             = helper::IR::variable::gen_pointer(
               array,
               index_index,
               "dimension"
             );
+          std::string dim_encoded_variable
+            = helper::IR::variable::gen_pointer(
+              array,
+              index_index,
+              "encoded_dimension"
+            );
+          std::string dim_size_variable
+            = helper::IR::variable::gen_pointer(
+              array,
+              index_index,
+              "dimension_size"
+            );
+          result.header_cells.insert(dim_cell_variable);
           helper::collection::append(instructions, {
             // ptr: array + offset
-            dim_size_variable,
+            dim_cell_variable,
               " <- ", std::to_string((index_index + 2) * 8),
               " + ", array.content(),
               "\n",
             // load that address
-            dim_size_variable,
-              " <- load ", dim_size_variable,
+            dim_encoded_variable,
+              " <- load ", dim_cell_variable,
               "\n",
             // decode the size
             dim_size_variable,
-              " <- ", dim_size_variable, " >> 1",
+              " <- ", dim_encoded_variable, " >> 1",
               "\n",
             // and then multiply by it
             index_variable,
@@ -307,6 +586,33 @@ bool codegen::IR::translate::act(
     node const & any_type = *typed.children.at(0);
     node const & type     = helper::unwrap_assert(any_type);
     if (type.is<grammar::IR::literal::type::multiarray::any>()) {
+      node const & array_type = helper::unwrap_assert(type);
+      int num_dimensions = array_type.children.at(1)->children.size();
+      node const & dim = helper::unwrap_assert(dim_index);
+      int64_t constant = dim.is<grammar::L3::operand::number>()
+        ? std::stoll(dim.content())
+        : -1;
+      if (0 <= constant && constant < num_dimensions) {
+        // a constant dimension: the header cell is known, and the same
+        // one the accesses use for it
+        std::string cell_variable
+          = helper::IR::variable::gen_pointer(
+            array,
+            std::to_string(constant),
+            "dimension"
+          );
+        result.header_cells.insert(cell_variable);
+        helper::collection::append(instructions, {
+          cell_variable,
+            " <- ", std::to_string((constant + 2) * 8),
+            " + ", array.content(),
+            "\n",
+          variable.content(),
+            " <- load ", cell_variable,
+            "\n",
+        });
+        return false;
+      }
       // get a pointer address to: %<array> + 8 * (%<dim_index> + 2)
       std::string index_variable
         = helper::IR::variable::gen_pointer(
@@ -359,6 +665,12 @@ bool codegen::IR::translate::act(
     node const & typed    = declaration->typed_operand;
     node const & any_type = *typed.children.at(0);
     node const & type     = helper::unwrap_assert(any_type);
+    if (result.check_bounds) check_access(
+      array,
+      accessors,
+      type.is<grammar::IR::literal::type::tuple_>(),
+      result
+    );
     if (type.is<grammar::IR::literal::type::tuple_>()) {
       node const & accessor = helper::unwrap_assert(accessors);
       node const & index_node = helper::unwrap_assert(accessor);
@@ -409,6 +721,16 @@ bool codegen::IR::translate::act(
         array,
         helper::string::from_strings(index_strings, "_")
       );
+      if (
+        strided(result, num_dimensions)
+        && accessors.children.size() == num_dimensions
+      ) {
+        strided_index(array, accessors, index_variable, result);
+        helper::collection::append(instructions, {
+          "store ", index_variable, " <- ", variable.content(), "\n",
+        });
+        return false;
+      }
       // Prepare the index!
       helper::collection::append(instructions, {
         index_variable, " <- 0", "\n",
@@ -423,25 +745,38 @@ bool codegen::IR::translate::act(
         // if this is the 1st index, skip multiplying 0 by a dimension
         if (index_index > 0) {
           // multiply index-so-far by the size of its dimension
-          std::string dim_size_variable
+          std::string dim_cell_variable
             = helper::IR::variable::gen_pointer(
               array,
               index_index,
               "dimension"
             );
+          std::string dim_encoded_variable
+            = helper::IR::variable::gen_pointer(
+              array,
+              index_index,
+              "encoded_dimension"
+            );
+          std::string dim_size_variable
+            = helper::IR::variable::gen_pointer(
+              array,
+              index_index,
+              "dimension_size"
+            );
+          result.header_cells.insert(dim_cell_variable);
           helper::collection::append(instructions, {
             // ptr: array + offset
-            dim_size_variable,
+            dim_cell_variable,
               " <- ", std::to_string((index_index + 2) * 8),
               " + ", array.content(),
               "\n",
             // load that address
-            dim_size_variable,
-              " <- load ", dim_size_variable,
+            dim_encoded_variable,
+              " <- load ", dim_cell_variable,
               "\n",
             // decode the size
             dim_size_variable,
-              " <- ", dim_size_variable, " >> 1",
+              " <- ", dim_encoded_variable, " >> 1",
               "\n",
             // and then multiply by it
             index_variable,
@@ -517,3 +852,69 @@ bool codegen::IR::translate::act(
     return true;
   }
 }
+
+namespace codegen::IR {
+  /*
+   * Translate a function one basic block at a time, and keep the blocks
+   * apart (see cfg.h). A bounds check in the middle of a block ends it
+   * there, and the rest of the block goes on in the next one.
+   */
+  cfg::function lower (
+    std::string const & header,
+    node const & blocks,
+    result & result
+  ) {
+    using namespace grammar::IR::instruction;
+    cfg::function f = { header };
+    result.labels.clear();
+    result.cold.clear();
+    result.out_of_bounds = 0;
+    for (up_node const & up_block : blocks.children)
+      for (up_node const & up_part : up_block->children)
+        if (up_part->is<basic_block::landing_pad>())
+          for (up_node const & label : up_part->children)
+            result.labels.insert(label->children.at(0)->content());
+    for (up_node const & up_block : blocks.children) {
+      cfg::block b;
+      for (up_node const & up_part : up_block->children) {
+        node const & part = *up_part;
+        if (part.is<basic_block::landing_pad>()) {
+          for (up_node const & label : part.children)
+            b.labels.push_back(label->children.at(0)->content());
+          continue;
+        }
+        result.instructions.clear();
+        ast::walk<translate>(part.children, result);
+        if (part.is<basic_block::launch_pad>()) {
+          cfg::parse_lines(result.instructions, b.exits);
+          continue;
+        }
+        std::vector<cfg::instruction> body;
+        cfg::parse_lines(result.instructions, body);
+        for (cfg::instruction & i : body) {
+          if (i.kind != cfg::kind::branch) {
+            b.body.push_back(std::move(i));
+            continue;
+          }
+          b.exits.push_back(std::move(i));
+          f.blocks.push_back(std::move(b));
+          b = {};
+        }
+      }
+      f.blocks.push_back(std::move(b));
+    }
+    // The calls to array-error: a label, a call, a return.
+    std::vector<cfg::instruction> cold;
+    cfg::parse_lines(result.cold, cold);
+    for (cfg::instruction & i : cold) {
+      if (i.kind == cfg::kind::label) {
+        f.blocks.push_back({ { i.target } });
+      } else if (i.kind == cfg::kind::ret) {
+        f.blocks.back().exits.push_back(std::move(i));
+      } else {
+        f.blocks.back().body.push_back(std::move(i));
+      }
+    }
+    return f;
+  }
+}
@@ -10,6 +10,10 @@
 #include "grammar.h"
 #include "analysis.h"
 #include "codegen.h"
+#include "ssa.h"
+#include "gvn.h"
+#include "bounds.h"
+#include "licm.h"
 #include "helper.h"
 
 namespace driver::IR {
@@ -42,12 +46,47 @@ namespace driver::IR {
     assert(false && "parse: unreachable! Mode unrecognized.");
   }
 
+  // What each optimization pass did, for -r.
+  struct reports {
+    codegen::IR::gvn::report    gvn;
+    codegen::IR::bounds::report bounds;
+    codegen::IR::licm::report   licm;
+  };
+
+  void print_report (Options & opt, reports & r) {
+    if (!opt.print_report) return;
+    if (opt.optimization_level < 1) {
+      std::cerr << "gvn, bounds, licm: off (needs -O1)\n";
+    } else {
+      codegen::IR::gvn::print(r.gvn, std::cerr);
+      if (opt.check_bounds) codegen::IR::bounds::print(r.bounds, std::cerr);
+      codegen::IR::licm::print(r.licm, std::cerr);
+    }
+  }
+
+  // What translate and the declarations know about the lowered code.
+  codegen::IR::cfg::facts facts (codegen::IR::result const & result) {
+    codegen::IR::cfg::facts known = { result.header_cells };
+    auto const & declarations = result.variables_summary.declaration;
+    for (auto const & entry : declarations) {
+      node const & typed    = entry.second->typed_operand;
+      node const & any_type = *typed.children.at(0);
+      node const & type     = helper::unwrap_assert(any_type);
+      if (false
+        || type.is<grammar::IR::literal::type::tuple_>()
+        || type.is<grammar::IR::literal::type::multiarray::any>()
+      ) known.pointers.insert(*entry.first);
+    }
+    return known;
+  }
+
   template <typename Input>
   int execute (Options & opt, Input & in) {
     up_node const root = parse(opt, in);
     if (Options::Mode::x86 == opt.mode) {
       node const & program = *root->children.at(0);
       std::vector<std::string> function_strings = {};
+      reports report;
       for (up_node const & up_function : program.children) {
         node const & function = *up_function;
         auto variables_summary
@@ -73,14 +112,30 @@ namespace driver::IR {
         // transform if/else branches
         node const & blocks = *function.children.at(3);
         codegen::IR::result result = { std::move(variables_summary) };
+        result.stride_headers = opt.stride_headers;
+        result.check_bounds = opt.check_bounds;
         // NOTE(jordan): to trim instructions for better printing:
         ast::walk< ast::mutator::trim_content >(blocks.children);
-        ast::walk< codegen::IR::translate >(blocks.children, result);
-        std::string function_string = helper::string::from_strings({
-          "define ", label.content(), " (", untyped_parameters, ") {\n",
-            helper::string::from_strings(result.instructions),
-          "}\n",
-        });
+        auto lowered = codegen::IR::lower(
+          helper::string::from_strings({
+            "define ", label.content(), " (", untyped_parameters, ") {",
+          }),
+          blocks,
+          result
+        );
+        if (opt.optimization_level >= 1) {
+          namespace ssa = codegen::IR::ssa;
+          ssa::form form = ssa::construct(std::move(lowered));
+          codegen::IR::cfg::facts const known
+            = ssa::translate(facts(result), form);
+          codegen::IR::gvn::run(form, known, &report.gvn);
+          auto const hoists
+            = codegen::IR::bounds::run(form, known, &report.bounds);
+          lowered = ssa::destruct(std::move(form));
+          codegen::IR::bounds::apply(lowered, hoists);
+          codegen::IR::licm::run(lowered, known, &report.licm);
+        }
+        std::string function_string = codegen::IR::cfg::print(lowered);
         function_strings.push_back(function_string);
         up_node const fun_root = ast::L3::construct::from_string<
           grammar::L3::function::define
@@ -91,6 +146,7 @@ namespace driver::IR {
       out.open("prog.L3");
       for (auto function_string : function_strings)
         out << function_string;
+      print_report(opt, report);
       return 0;
     }
     if (Options::Mode::run_tests == opt.mode) {
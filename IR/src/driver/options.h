@@ -2,6 +2,7 @@
 #include <unistd.h>
 #include <cassert>
 #include <cstring>
+#include <cstdlib>
 
 namespace driver::IR {
   struct Options {
@@ -12,6 +13,13 @@ namespace driver::IR {
     bool parsed_mode = false;
     bool print_trace = false;
     bool print_ast   = false;
+    // Print what the optimization passes did (to stderr).
+    bool print_report = false;
+    int optimization_level = 0;
+    // Lay arrays out with precomputed strides (see codegen.h)
+    bool stride_headers = false;
+    // Check array accesses, as LA does (see codegen.h)
+    bool check_bounds = false;
     char * input_name;
     static Options argv (int argc, char ** argv);
   };
@@ -51,7 +59,7 @@ namespace driver::IR {
   Options Options::argv (int argc, char ** argv) {
     int c;
     Options opt;
-    while ((c = getopt(argc, argv, "tpQg:O:")) != -1)
+    while ((c = getopt(argc, argv, "tpQrg:O:GASB")) != -1)
       switch (c) {
       /*
        * ----------------------------------------------------------------
@@ -70,11 +78,26 @@ namespace driver::IR {
           break;
       /*
        * ----------------------------------------------------------------
-       *  Optimization level (TODO)
+       *  Optimization level
        * ----------------------------------------------------------------
        */
         case 'O':
-          // TODO(jordan): maybe we should care about opt level later.
+          opt.optimization_level = atoi(optarg);
+          break;
+        case 'r':
+          opt.print_report = true;
+          break;
+        case 'G':
+          // Write barriers: L1's business. Lc hands it down.
+          break;
+        case 'A':
+          // Allocation sites: likewise.
+          break;
+        case 'S':
+          opt.stride_headers = true;
+          break;
+        case 'B':
+          opt.check_bounds = true;
           break;
       /*
        * ----------------------------------------------------------------
@@ -0,0 +1,292 @@
+#pragma once
+
+#include <algorithm>
+#include <cctype>
+#include <cstddef>
+#include <map>
+#include <ostream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "cfg.h"
+#include "ssa.h"
+
+/*
+ * ======================================================================
+ *  Global value numbering
+ * ======================================================================
+ *
+ * NOTE(jordan): in SSA form a variable never changes, so two instructions
+ * computing the same operation on the same variables compute the same
+ * value, and the second one can just use the first one's result as long
+ * as the first one dominates it. We walk the dominator tree with a table
+ * of what's been computed on the way down:
+ *
+ *   %array_A_index_i_j_3 <- %array_A_index_i_j_2 + %i_1
+ *   %array_A_index_i_j_7 <- %array_A_index_i_j_6 + %i_1    <- same thing
+ *
+ * Operands are compared by value, not by name: a variable defined by a
+ * copy is the variable it copied, one defined by a constant is that
+ * constant (so both indices above start from the same `0`). Redundant
+ * instructions go away and their uses read the original instead.
+ *
+ * Loads from memory are only the same if nothing wrote to it in between,
+ * which we don't keep track of, except for array headers: nothing ever
+ * writes one after `new Array`, so loading the same cell (by value: the
+ * same offset from the same array) always gives the same size.
+ *
+ * A pointer into the middle of an array (`%A + 16`; see licm.h) goes
+ * stale when the GC moves the array. Those are only reused within their
+ * block and never across a call, so we don't keep one alive any longer
+ * than the GC can stand.
+ *
+ * Phis that pick the same value from every way in are that value, and
+ * afterwards anything without side effects that nothing reads goes too.
+ */
+namespace codegen::IR::gvn {
+  using variables = cfg::variables;
+
+  struct report {
+    std::size_t expressions = 0; // recomputations removed
+    std::size_t loads       = 0; // ... of which header loads
+    std::size_t copies      = 0; // copies propagated
+    std::size_t phis        = 0; // phis of a single value
+    std::size_t dead        = 0; // unused results removed
+  };
+
+  void print (report const & r, std::ostream & os) {
+    os << "gvn: " << r.expressions << " redundant computations removed ("
+       << r.loads << " header loads), " << r.copies << " copies, "
+       << r.phis << " phis, " << r.dead << " dead\n";
+  }
+
+  bool is_variable (std::string const & operand) {
+    return !operand.empty() && operand.at(0) == '%';
+  }
+
+  bool is_number (std::string const & operand) {
+    if (operand.empty()) return false;
+    std::size_t start = operand.at(0) == '-' || operand.at(0) == '+';
+    if (start == operand.size()) return false;
+    for (std::size_t c = start; c < operand.size(); c++)
+      if (!std::isdigit(operand.at(c))) return false;
+    return true;
+  }
+
+  // "op lhs rhs" (see cfg::binary)
+  std::vector<std::string> split (std::string const & expression) {
+    std::vector<std::string> parts;
+    std::size_t start = 0;
+    while (start <= expression.size()) {
+      std::size_t end = expression.find(' ', start);
+      if (end == std::string::npos) end = expression.size();
+      parts.push_back(expression.substr(start, end - start));
+      start = end + 1;
+    }
+    return parts;
+  }
+
+  bool commutes (std::string const & op) {
+    return op == "+" || op == "*" || op == "&" || op == "=";
+  }
+
+  // Side-effect free, so it can go if nobody needs it.
+  bool pure (cfg::instruction const & i, cfg::facts const & known) {
+    switch (i.kind) {
+      case cfg::kind::move:
+      case cfg::kind::arithmetic:
+      case cfg::kind::compare:
+        return true;
+      case cfg::kind::load:
+        return helper::collection::has(i.uses.at(0), known.header_cells);
+      default:
+        return false;
+    }
+  }
+
+  struct numbering {
+    std::map<std::string, std::string> same;     // variable -> its leader
+    std::map<std::string, std::string> constant; // variable -> its number
+    std::map<std::string, std::string> key;      // variable -> its value
+    variables interior;
+
+    std::string leader (std::string v) const {
+      for (auto it = same.find(v); it != same.end(); it = same.find(v))
+        v = it->second;
+      return v;
+    }
+
+    // What an operand stands for: a number, or the leader of a variable.
+    std::string value (std::string const & operand) const {
+      if (!is_variable(operand)) return operand;
+      std::string const v = leader(operand);
+      auto const it = constant.find(v);
+      return it == constant.end() ? v : it->second;
+    }
+  };
+
+  // Anything computed from a pointer with arithmetic points inside it.
+  bool derives_pointer (
+    cfg::instruction const & i,
+    numbering const & n,
+    cfg::facts const & known
+  ) {
+    if (i.kind != cfg::kind::arithmetic && i.kind != cfg::kind::move)
+      return false;
+    for (std::string const & use : i.uses) {
+      std::string const v = n.leader(use);
+      if (helper::collection::has(v, n.interior)) return true;
+      if (i.kind == cfg::kind::arithmetic
+        && helper::collection::has(v, known.pointers)) return true;
+    }
+    return false;
+  }
+
+  void number (ssa::form & s, cfg::facts const & known, report & tally) {
+    numbering n;
+    std::map<std::string, std::string> available; // value -> variable
+    // Undo log: what each block added to `available`.
+    std::vector<std::vector<std::string>> added(s.f.blocks.size());
+    std::vector<std::pair<int, bool>> work = { { 0, false } };
+    auto const read = [&] (std::string const & v) { return n.leader(v); };
+    while (!work.empty()) {
+      auto const [b, leaving] = work.back(); work.pop_back();
+      if (leaving) {
+        for (std::string const & k : added.at(b)) available.erase(k);
+        continue;
+      }
+      work.push_back({ b, true });
+
+      // Phis of one value (not counting themselves) are that value.
+      auto & phis = s.phis.at(b);
+      for (auto p = phis.begin(); p != phis.end();) {
+        std::string only;
+        bool single = true;
+        for (std::string const & use : p->uses) {
+          std::string const v = n.leader(use);
+          if (v == p->defines) continue;
+          if (only.empty()) only = v;
+          single = single && v == only;
+        }
+        if (single && !only.empty()) {
+          n.same[p->defines] = only;
+          p = phis.erase(p);
+          tally.phis++;
+        } else {
+          p++;
+        }
+      }
+
+      // Pointers into the middle of an array: this block only, until the
+      // next call.
+      std::map<std::string, std::string> interior;
+      cfg::block & bb = s.f.blocks.at(b);
+      std::vector<cfg::instruction> body;
+      for (cfg::instruction const & original : bb.body) {
+        cfg::instruction const i = cfg::rewrite(original, original.defines, read);
+        if (i.kind == cfg::kind::call) interior.clear();
+        if (i.defines.empty() || !pure(i, known)) {
+          body.push_back(i);
+          continue;
+        }
+        if (i.kind == cfg::kind::move) {
+          std::string const & from = i.expression;
+          if (is_variable(from)) {
+            n.same[i.defines] = from;
+            tally.copies++;
+            continue;
+          }
+          if (is_number(from)) n.constant[i.defines] = from;
+          body.push_back(i);
+          continue;
+        }
+        std::string k;
+        if (i.kind == cfg::kind::load) {
+          std::string const & cell = i.uses.at(0);
+          auto const it = n.key.find(cell);
+          k = "load [" + (it == n.key.end() ? cell : it->second) + "]";
+        } else {
+          std::vector<std::string> parts = split(i.expression);
+          std::string lhs = n.value(parts.at(1));
+          std::string rhs = n.value(parts.at(2));
+          if (commutes(parts.at(0)) && rhs < lhs) std::swap(lhs, rhs);
+          k = parts.at(0) + " " + lhs + " " + rhs;
+        }
+        n.key[i.defines] = k;
+        bool const inside = derives_pointer(i, n, known);
+        if (inside) n.interior.insert(i.defines);
+        auto & table = inside ? interior : available;
+        auto const found = table.find(k);
+        if (found != table.end()) {
+          n.same[i.defines] = found->second;
+          tally.expressions++;
+          if (i.kind == cfg::kind::load) tally.loads++;
+          continue;
+        }
+        table[k] = i.defines;
+        if (!inside) added.at(b).push_back(k);
+        body.push_back(i);
+      }
+      bb.body = std::move(body);
+      for (cfg::instruction & exit : bb.exits)
+        exit = cfg::rewrite(exit, "", read);
+
+      for (auto c = s.children.at(b).rbegin(); c != s.children.at(b).rend(); c++)
+        work.push_back({ *c, false });
+    }
+    // Phi uses along back edges were numbered after we saw them.
+    for (auto & phis : s.phis)
+      for (ssa::phi & p : phis)
+        for (std::string & use : p.uses) use = n.leader(use);
+    // And so were any blocks the walk never got to.
+    for (int b = 0; b < s.f.blocks.size(); b++) {
+      if (s.g.reachable.at(b)) continue;
+      for (auto * list : { &s.f.blocks.at(b).body, &s.f.blocks.at(b).exits })
+        for (cfg::instruction & i : *list) i = cfg::rewrite(i, i.defines, read);
+    }
+  }
+
+  void eliminate_dead (ssa::form & s, cfg::facts const & known, report & tally) {
+    bool changed = true;
+    while (changed) {
+      changed = false;
+      std::map<std::string, std::size_t> uses;
+      for (int b = 0; b < s.f.blocks.size(); b++) {
+        cfg::block const & bb = s.f.blocks.at(b);
+        for (auto const * list : { &bb.body, &bb.exits })
+          for (cfg::instruction const & i : *list)
+            for (std::string const & use : i.uses) uses[use]++;
+        for (ssa::phi const & p : s.phis.at(b))
+          for (std::string const & use : p.uses)
+            if (use != p.defines) uses[use]++;
+      }
+      auto const unused = [&] (std::string const & v) {
+        return !helper::collection::has(v, uses);
+      };
+      for (int b = 0; b < s.f.blocks.size(); b++) {
+        auto & body = s.f.blocks.at(b).body;
+        std::size_t const before = body.size();
+        body.erase(std::remove_if(body.begin(), body.end(),
+          [&] (cfg::instruction const & i) {
+            return !i.defines.empty() && pure(i, known) && unused(i.defines);
+          }), body.end());
+        auto & phis = s.phis.at(b);
+        std::size_t const phis_before = phis.size();
+        phis.erase(std::remove_if(phis.begin(), phis.end(),
+          [&] (ssa::phi const & p) { return unused(p.defines); }), phis.end());
+        std::size_t const removed
+          = (before - body.size()) + (phis_before - phis.size());
+        tally.dead += removed;
+        changed = changed || removed > 0;
+      }
+    }
+  }
+
+  void run (ssa::form & s, cfg::facts const & known, report * r = nullptr) {
+    report scratch;
+    report & tally = r ? *r : scratch;
+    number(s, known, tally);
+    eliminate_dead(s, known, tally);
+  }
+}
@@ -0,0 +1,451 @@
+#pragma once
+
+#include <cstddef>
+#include <map>
+#include <ostream>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "cfg.h"
+
+/*
+ * ======================================================================
+ *  Loop-invariant code motion
+ * ======================================================================
+ *
+ * NOTE(jordan): `%A[%i][%j]` in a loop reloads and decodes the sizes of
+ * %A on every iteration, although they can't change for as long as %A
+ * doesn't. Same for `length`, and for any arithmetic on values the loop
+ * never redefines. For each natural loop, innermost first, we move
+ * those into a new block (the preheader) that runs once, right before
+ * the loop is entered:
+ *
+ *   %v <- <expression>   moves out when every definition of %v in the
+ *                        loop is that same pure expression (move,
+ *                        arithmetic, shift, comparison) over values the
+ *                        loop doesn't define, or that moved out already;
+ *   %v <- load %p        ... or a load of an array header cell (translate
+ *                        tells us which temporaries only ever hold those),
+ *
+ * as long as %v isn't live on the way into the loop (some iteration
+ * would have seen the old value) or on the way out of it (the loop may
+ * have exited without defining it).
+ *
+ * Two things keep this honest:
+ *
+ *  - The preheader runs even if the loop body doesn't, and `load` on an
+ *    array that doesn't exist yet crashes. Unless the array certainly
+ *    exists (it was allocated, or we already read its length, on every
+ *    way into the loop), the header loads sit behind a null check on it.
+ *    If that fails, none of the skipped values can be needed: the loop
+ *    would have crashed reading them.
+ *
+ *  - The GC moves arrays (and only fixes up pointers to their start). So
+ *    a pointer into the middle of one, like `%A + 16`, can only move out
+ *    if everything that uses it does too: it must be dead before the loop
+ *    calls anything that might allocate.
+ */
+namespace codegen::IR::licm {
+  using variables = cfg::variables;
+  using facts     = cfg::facts;
+
+  struct report {
+    std::size_t loops   = 0; // loops that got a preheader
+    std::size_t hoisted = 0; // instructions moved into one
+    std::size_t checks  = 0; // null checks guarding header loads
+  };
+
+  void print (report const & r, std::ostream & os) {
+    os << "licm: " << r.hoisted << " instructions hoisted out of "
+       << r.loops << " loops (" << r.checks << " null checks)\n";
+  }
+
+  bool pure (cfg::instruction const & i, facts const & known) {
+    switch (i.kind) {
+      case cfg::kind::move:
+      case cfg::kind::arithmetic:
+      case cfg::kind::compare:
+        return true;
+      case cfg::kind::load:
+        return helper::collection::has(i.uses.at(0), known.header_cells);
+      default:
+        return false;
+    }
+  }
+
+  // Anything computed from a pointer with arithmetic points inside it.
+  variables interior_pointers (cfg::function const & f, facts const & known) {
+    variables interior;
+    bool changed = true;
+    while (changed) {
+      changed = false;
+      for (cfg::block const & b : f.blocks)
+        for (cfg::instruction const & i : b.body) {
+          if (i.defines.empty() || helper::collection::has(i.defines, interior))
+            continue;
+          bool derived = false;
+          for (std::string const & use : i.uses)
+            derived = derived
+              || helper::collection::has(use, interior)
+              || (i.kind == cfg::kind::arithmetic
+                && helper::collection::has(use, known.pointers));
+          if (derived && (false
+            || i.kind == cfg::kind::move
+            || i.kind == cfg::kind::arithmetic
+          )) {
+            interior.insert(i.defines);
+            changed = true;
+          }
+        }
+    }
+    return interior;
+  }
+
+  // `%v <- K + %p` or `%v <- %p + K`, 0 <= K < 4096 (the page at 0 is
+  // never mapped).
+  bool small_offset (cfg::instruction const & i) {
+    std::string const & e = i.expression; // "+ lhs rhs"
+    std::size_t const space = e.find(' ', 2);
+    std::string const lhs = e.substr(2, space - 2);
+    std::string const rhs = e.substr(space + 1);
+    std::string const & k = lhs == i.uses.at(0) ? rhs : lhs;
+    if (k.empty() || k.size() > 4) return false;
+    for (char c : k) if (c < '0' || c > '9') return false;
+    return std::stoi(k) < 4096;
+  }
+
+  /*
+   * Which arrays are certainly not null at the end of each block: they
+   * came from `allocate`, or we loaded or stored through them (or through
+   * a pointer into them) on every way there, and haven't changed since.
+   */
+  std::vector<variables> dereferenced (
+    cfg::function const & f,
+    cfg::graph const & g,
+    facts const & known
+  ) {
+    int const n = f.blocks.size();
+    std::vector<variables> out(n);
+    std::vector<bool> visited(n, false);
+    auto const transfer = [&] (cfg::block const & b, variables & safe) {
+      std::map<std::string, std::string> base; // pointer -> array
+      auto const array_of = [&] (std::string const & v) -> std::string {
+        if (helper::collection::has(v, known.pointers)) return v;
+        auto const it = base.find(v);
+        return it == base.end() ? "" : it->second;
+      };
+      for (cfg::instruction const & i : b.body) {
+        std::string array;
+        if (i.kind == cfg::kind::load || i.kind == cfg::kind::store)
+          array = array_of(i.uses.at(0));
+        if (!array.empty()) safe.insert(array);
+        if (i.defines.empty()) continue;
+        std::string derived;
+        if (i.kind == cfg::kind::move && i.uses.size() == 1)
+          derived = array_of(i.uses.at(0));
+        // Only a small constant offset: `%A + %i` might be somewhere
+        // else entirely when %A is 0, but `%A + 16` never is.
+        if (i.kind == cfg::kind::arithmetic && i.uses.size() == 1
+          && i.expression.rfind("+ ", 0) == 0 && small_offset(i))
+          derived = array_of(i.uses.at(0));
+        safe.erase(i.defines);
+        for (auto it = base.begin(); it != base.end();)
+          it = it->second == i.defines ? base.erase(it) : std::next(it);
+        base.erase(i.defines);
+        if (!derived.empty() && derived != i.defines)
+          base[i.defines] = derived;
+        if (i.kind == cfg::kind::call && i.target == "allocate")
+          safe.insert(i.defines);
+      }
+    };
+    bool changed = true;
+    while (changed) {
+      changed = false;
+      for (int b = 0; b < n; b++) {
+        if (!g.reachable.at(b)) continue;
+        variables safe;
+        bool first = true;
+        for (int p : g.predecessors.at(b)) {
+          if (!g.reachable.at(p) || !visited.at(p)) continue;
+          if (first) safe = out.at(p);
+          else {
+            variables both;
+            for (std::string const & v : safe)
+              if (helper::collection::has(v, out.at(p))) both.insert(v);
+            safe = std::move(both);
+          }
+          first = false;
+        }
+        if (b == 0) safe.clear();
+        transfer(f.blocks.at(b), safe);
+        if (!visited.at(b) || safe != out.at(b)) {
+          out.at(b) = std::move(safe);
+          visited.at(b) = true;
+          changed = true;
+        }
+      }
+    }
+    return out;
+  }
+
+  struct candidate {
+    cfg::instruction const * first = nullptr; // the copy that moves
+    bool pure = true;                         // every definition agrees
+    std::vector<cfg::instruction const *> users;
+  };
+
+  /*
+   * Which of the variables defined in loop `l` can move out, in an order
+   * that computes each before anything that needs it.
+   */
+  std::vector<std::string> invariants (
+    cfg::function const & f,
+    cfg::loop const & l,
+    cfg::liveness const & live,
+    facts const & known,
+    variables const & interior
+  ) {
+    std::map<std::string, candidate> defined;
+    for (int b : l.blocks) {
+      cfg::block const & bb = f.blocks.at(b);
+      for (auto const * list : { &bb.body, &bb.exits })
+        for (cfg::instruction const & i : *list) {
+          for (std::string const & use : i.uses)
+            defined[use].users.push_back(&i);
+          if (i.defines.empty()) continue;
+          candidate & c = defined[i.defines];
+          if (c.first == nullptr) c.first = &i;
+          c.pure = c.pure
+            && pure(i, known)
+            && i.expression == c.first->expression;
+        }
+    }
+    auto const escapes = [&] (std::string const & v) {
+      if (helper::collection::has(v, live.in.at(l.header))) return true;
+      for (int exit : l.exits)
+        if (helper::collection::has(v, live.in.at(exit))) return true;
+      return false;
+    };
+    variables moved;
+    std::vector<std::string> order;
+    bool changed = true;
+    while (changed) {
+      changed = false;
+      for (auto const & entry : defined) {
+        std::string const & v = entry.first;
+        candidate const & c = entry.second;
+        if (c.first == nullptr || !c.pure) continue;
+        if (helper::collection::has(v, moved) || escapes(v)) continue;
+        bool invariant = true;
+        for (std::string const & use : c.first->uses) {
+          auto const it = defined.find(use);
+          bool const outside = it == defined.end() || it->second.first == nullptr;
+          invariant = invariant
+            && (outside || helper::collection::has(use, moved));
+        }
+        if (!invariant) continue;
+        moved.insert(v);
+        order.push_back(v);
+        changed = true;
+      }
+    }
+    // Interior pointers stay unless all of their users went with them;
+    // whatever needed one that stays, stays too.
+    changed = true;
+    while (changed) {
+      changed = false;
+      for (std::string const & v : order) {
+        if (!helper::collection::has(v, moved)) continue;
+        candidate const & c = defined.at(v);
+        bool stays = false;
+        for (std::string const & use : c.first->uses)
+          stays = stays
+            || (helper::collection::has(use, defined)
+              && defined.at(use).first != nullptr
+              && !helper::collection::has(use, moved));
+        if (helper::collection::has(v, interior))
+          for (cfg::instruction const * user : c.users)
+            stays = stays
+              || user->defines.empty()
+              || !helper::collection::has(user->defines, moved);
+        if (stays) {
+          moved.erase(v);
+          changed = true;
+        }
+      }
+    }
+    std::vector<std::string> result;
+    for (std::string const & v : order)
+      if (helper::collection::has(v, moved)) result.push_back(v);
+    return result;
+  }
+
+  cfg::instruction branch (std::string const & label) {
+    return cfg::parse("br " + label);
+  }
+
+  /*
+   * Point every branch from outside the loop to its header at `to`
+   * instead.
+   */
+  void redirect (
+    cfg::function & f,
+    cfg::loop const & l,
+    std::string const & header,
+    std::string const & to
+  ) {
+    for (int b = 0; b < f.blocks.size(); b++) {
+      if (helper::collection::has(b, l.blocks)) continue;
+      for (cfg::instruction & exit : f.blocks.at(b).exits) {
+        if (exit.kind != cfg::kind::branch) continue;
+        if (!helper::collection::has(exit.target, f.blocks.at(l.header).labels))
+          continue;
+        cfg::retarget(exit, to);
+      }
+    }
+  }
+
+  bool falls_through (cfg::block const & b) {
+    for (cfg::instruction const & exit : b.exits)
+      if (exit.ends) return false;
+    return true;
+  }
+
+  // Hoist what we can out of loop `l`. True if anything moved.
+  bool hoist (
+    cfg::function & f,
+    cfg::graph const & g,
+    cfg::loop const & l,
+    facts const & known,
+    report & tally
+  ) {
+    // A loop block that falls into the header would fall into the
+    // preheader instead. translate never does that, but don't find out.
+    for (int p : g.predecessors.at(l.header))
+      if (helper::collection::has(p, l.blocks) && falls_through(f.blocks.at(p)))
+        return false;
+    cfg::liveness const live = cfg::live(f, g);
+    variables const interior = interior_pointers(f, known);
+    std::vector<std::string> const order
+      = invariants(f, l, live, known, interior);
+    if (order.empty()) return false;
+
+    // Where each moved value came from, and which arrays its header
+    // loads need to exist.
+    std::map<std::string, cfg::instruction> moved;
+    for (int b : l.blocks)
+      for (cfg::instruction const & i : f.blocks.at(b).body)
+        if (!i.defines.empty() && !helper::collection::has(i.defines, moved)
+          && helper::collection::has(i.defines, order))
+          moved.emplace(i.defines, i);
+    std::map<std::string, variables> roots, checks;
+    for (std::string const & v : order) {
+      cfg::instruction const & i = moved.at(v);
+      for (std::string const & use : i.uses) {
+        if (helper::collection::has(use, moved)) {
+          roots[v].insert(roots[use].begin(), roots[use].end());
+          checks[v].insert(checks[use].begin(), checks[use].end());
+        } else {
+          roots[v].insert(use);
+        }
+      }
+      if (i.kind == cfg::kind::load)
+        checks[v].insert(roots[v].begin(), roots[v].end());
+    }
+    // No need to check arrays we know exist on every way into the loop.
+    std::vector<variables> const safe = dereferenced(f, g, known);
+    variables outside;
+    bool first = true;
+    for (int p : g.predecessors.at(l.header)) {
+      if (helper::collection::has(p, l.blocks) || !g.reachable.at(p)) continue;
+      variables both;
+      for (std::string const & v : safe.at(p))
+        if (first || helper::collection::has(v, outside)) both.insert(v);
+      outside = std::move(both);
+      first = false;
+    }
+    if (l.header == 0) outside.clear();
+    for (auto & entry : checks)
+      for (std::string const & array : outside)
+        entry.second.erase(array);
+    std::map<std::pair<std::size_t, variables>, std::vector<std::string>>
+      guarded;
+    for (std::string const & v : order)
+      guarded[{ checks[v].size(), checks[v] }].push_back(v);
+
+    // The preheader: unchecked values first, then each group of header
+    // loads behind the null checks it needs.
+    std::string const header = f.blocks.at(l.header).labels.at(0);
+    variables taken = cfg::labels(f);
+    auto const label = [&] (std::string const & suffix) {
+      std::string name = cfg::fresh(header + "_" + suffix, taken);
+      taken.insert(name);
+      return name;
+    };
+    std::string const null = cfg::fresh("%licm_null", cfg::mentioned(f));
+    std::vector<cfg::block> pre;
+    std::string const entry = label("preheader");
+    pre.push_back({ { entry } });
+    for (auto const & group : guarded) {
+      variables const & arrays = group.first.second;
+      if (arrays.empty()) {
+        for (std::string const & v : group.second)
+          pre.back().body.push_back(moved.at(v));
+        tally.hoisted += group.second.size();
+        continue;
+      }
+      std::string const next = label("invariant");
+      for (std::string const & array : arrays) {
+        std::string const check = label("check");
+        pre.back().exits.push_back(branch(check));
+        pre.push_back({ { check }, {
+          cfg::parse(null + " <- " + array + " = 0"),
+        }, {
+          cfg::parse("br " + null + " " + next),
+        } });
+        tally.checks++;
+      }
+      std::string const loads = label("loads");
+      pre.back().exits.push_back(branch(loads));
+      pre.push_back({ { loads } });
+      for (std::string const & v : group.second)
+        pre.back().body.push_back(moved.at(v));
+      tally.hoisted += group.second.size();
+      pre.back().exits.push_back(branch(next));
+      pre.push_back({ { next } });
+    }
+    pre.back().exits.push_back(branch(header));
+
+    for (int b : l.blocks) {
+      auto & body = f.blocks.at(b).body;
+      body.erase(std::remove_if(body.begin(), body.end(),
+        [&] (cfg::instruction const & i) {
+          return helper::collection::has(i.defines, moved);
+        }), body.end());
+    }
+    redirect(f, l, header, entry);
+    f.blocks.insert(f.blocks.begin() + l.header, pre.begin(), pre.end());
+    tally.loops++;
+    return true;
+  }
+
+  void run (cfg::function & f, facts const & known, report * r = nullptr) {
+    report scratch;
+    report & tally = r ? *r : scratch;
+    variables done; // loop headers, by label
+    bool changed = true;
+    while (changed) {
+      changed = false;
+      cfg::graph const g = cfg::analyze(f);
+      for (cfg::loop const & l : cfg::loops(g)) {
+        std::string const header = f.blocks.at(l.header).labels.at(0);
+        if (helper::collection::has(header, done)) continue;
+        done.insert(header);
+        // Anything we did moved blocks around: start over.
+        if ((changed = hoist(f, g, l, known, tally))) break;
+      }
+    }
+    cfg::thread(f);
+  }
+}
@@ -0,0 +1,282 @@
+#pragma once
+
+#include <algorithm>
+#include <cassert>
+#include <map>
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "cfg.h"
+
+/*
+ * ======================================================================
+ *  Static single assignment form
+ * ======================================================================
+ *
+ * NOTE(jordan): the lowered code reuses its temporaries everywhere (every
+ * access to %A names its index `%array_A_index_i_j`, every `length` its
+ * cell `%array_A_dimension_0`), so "is this the same value as before?"
+ * depends on which definition reaches. In SSA form it doesn't: every
+ * variable is defined exactly once, and where control flow merges two
+ * definitions a phi picks between them:
+ *
+ *   :loop                               :loop
+ *   %i <- %i + 1          becomes       %i_2 <- phi(%i_1, %i_3)
+ *   ...                                 %i_3 <- %i_2 + 1
+ *
+ * We don't have phis in L3, so they live next to the blocks (one use per
+ * predecessor, in the graph's order) and `destruct` turns them back into
+ * copies at the end of each predecessor. For that to be right:
+ *
+ *  - Every edge from a block with several successors to a block with
+ *    several predecessors gets a block of its own first (otherwise the
+ *    copies for one successor would run on the way to the other).
+ *  - The copies for one edge happen all at once: `%a <- %b, %b <- %a`
+ *    goes through temporaries.
+ *
+ * Phis only go where the variable is live (pruned SSA). Parameters, and
+ * variables read before they're ever written, keep their own name.
+ */
+namespace codegen::IR::ssa {
+  using variables = cfg::variables;
+
+  struct phi {
+    std::string variable;          // what it was called before
+    std::string defines;
+    std::vector<std::string> uses; // one per predecessor
+  };
+
+  struct form {
+    cfg::function f;
+    cfg::graph g;
+    std::vector<std::vector<phi>> phis;       // per block
+    std::vector<int> idom;                    // -1: entry, or unreachable
+    std::vector<std::vector<int>> children;   // the dominator tree
+    std::map<std::string, std::string> original; // new name -> old
+  };
+
+  /*
+   * Give every edge from a block with several successors to a block with
+   * several predecessors a block of its own.
+   */
+  void split_critical_edges (cfg::function & f) {
+    cfg::graph const g = cfg::analyze(f);
+    variables taken = cfg::labels(f);
+    int const n = f.blocks.size();
+    for (int b = 0; b < n; b++) {
+      if (!g.reachable.at(b) || g.successors.at(b).size() < 2) continue;
+      for (int s : g.successors.at(b)) {
+        if (g.predecessors.at(s).size() < 2) continue;
+        std::vector<std::string> const into = f.blocks.at(s).labels;
+        assert(!into.empty() && "split_critical_edges: block without a label");
+        cfg::block & from = f.blocks.at(b);
+        bool ends = false;
+        for (cfg::instruction const & exit : from.exits) ends = ends || exit.ends;
+        if (!ends && s == b + 1)
+          from.exits.push_back(cfg::parse("br " + into.at(0)));
+        std::string const edge = cfg::fresh(into.at(0) + "_edge", taken);
+        taken.insert(edge);
+        for (cfg::instruction & exit : from.exits)
+          if (exit.kind == cfg::kind::branch
+            && helper::collection::has(exit.target, into))
+            cfg::retarget(exit, edge);
+        f.blocks.push_back({ { edge }, {}, { cfg::parse("br " + into.at(0)) } });
+      }
+    }
+  }
+
+  void dominator_tree (form & s) {
+    int const n = s.f.blocks.size();
+    s.idom = std::vector<int>(n, -1);
+    s.children = std::vector<std::vector<int>>(n);
+    std::vector<int> depth(n, 0);
+    for (int b = 0; b < n; b++)
+      for (int d = 0; d < n; d++)
+        depth.at(b) += s.g.dominators.at(b).at(d);
+    // The closest strict dominator is the one with the most dominators.
+    for (int b = 1; b < n; b++) {
+      if (!s.g.reachable.at(b)) continue;
+      for (int d = 0; d < n; d++) {
+        if (d == b || !s.g.dominators.at(b).at(d)) continue;
+        if (s.idom.at(b) < 0 || depth.at(d) > depth.at(s.idom.at(b)))
+          s.idom.at(b) = d;
+      }
+      s.children.at(s.idom.at(b)).push_back(b);
+    }
+  }
+
+  std::vector<std::set<int>> frontiers (form const & s) {
+    int const n = s.f.blocks.size();
+    std::vector<std::set<int>> df(n);
+    for (int b = 0; b < n; b++) {
+      if (!s.g.reachable.at(b)) continue;
+      std::vector<int> const & preds = s.g.predecessors.at(b);
+      if (preds.size() < 2) continue;
+      for (int p : preds) {
+        if (!s.g.reachable.at(p)) continue;
+        for (int runner = p; runner != s.idom.at(b) && runner >= 0;
+             runner = s.idom.at(runner))
+          df.at(runner).insert(b);
+      }
+    }
+    return df;
+  }
+
+  void place_phis (form & s) {
+    int const n = s.f.blocks.size();
+    s.phis = std::vector<std::vector<phi>>(n);
+    std::vector<std::set<int>> const df = frontiers(s);
+    cfg::liveness const live = cfg::live(s.f, s.g);
+    std::map<std::string, std::set<int>> sites;
+    for (std::string const & p : cfg::parameters(s.f)) sites[p].insert(0);
+    for (int b = 0; b < n; b++)
+      for (cfg::instruction const & i : s.f.blocks.at(b).body)
+        if (!i.defines.empty()) sites[i.defines].insert(b);
+    for (auto const & entry : sites) {
+      std::string const & v = entry.first;
+      std::set<int> placed;
+      std::vector<int> work(entry.second.begin(), entry.second.end());
+      while (!work.empty()) {
+        int d = work.back(); work.pop_back();
+        for (int y : df.at(d)) {
+          if (helper::collection::has(y, placed)) continue;
+          if (!helper::collection::has(v, live.in.at(y))) continue;
+          placed.insert(y);
+          s.phis.at(y).push_back({ v, v,
+            std::vector<std::string>(s.g.predecessors.at(y).size(), v) });
+          if (!helper::collection::has(y, entry.second)) work.push_back(y);
+        }
+      }
+    }
+  }
+
+  void rename (form & s) {
+    variables taken = cfg::mentioned(s.f);
+    std::map<std::string, std::vector<std::string>> stacks;
+    std::map<std::string, int> counts;
+    auto const top = [&] (std::string const & v) {
+      auto const it = stacks.find(v);
+      return it == stacks.end() || it->second.empty() ? v : it->second.back();
+    };
+    auto const name = [&] (std::string const & v, std::vector<std::string> & pushed) {
+      std::string fresh = cfg::fresh(
+        v + "_" + std::to_string(++counts[v]), taken);
+      taken.insert(fresh);
+      s.original[fresh] = v;
+      stacks[v].push_back(fresh);
+      pushed.push_back(v);
+      return fresh;
+    };
+    // Walk the dominator tree; each block undoes its names on the way out.
+    std::vector<std::pair<int, bool>> work = { { 0, false } };
+    std::vector<std::vector<std::string>> pushed(s.f.blocks.size());
+    while (!work.empty()) {
+      auto const [b, leaving] = work.back(); work.pop_back();
+      if (leaving) {
+        for (std::string const & v : pushed.at(b)) stacks.at(v).pop_back();
+        continue;
+      }
+      work.push_back({ b, true });
+      for (phi & p : s.phis.at(b)) p.defines = name(p.variable, pushed.at(b));
+      cfg::block & bb = s.f.blocks.at(b);
+      for (cfg::instruction & i : bb.body) {
+        // `%x <- %x + 1` reads the old %x.
+        std::map<std::string, std::string> reads;
+        for (std::string const & use : i.uses) reads[use] = top(use);
+        std::string const defines = i.defines.empty()
+          ? "" : name(i.defines, pushed.at(b));
+        i = cfg::rewrite(i, defines, [&] (std::string const & v) {
+          return helper::collection::has(v, reads) ? reads.at(v) : top(v);
+        });
+      }
+      for (cfg::instruction & i : bb.exits) i = cfg::rewrite(i, "", top);
+      for (int succ : s.g.successors.at(b)) {
+        std::vector<int> const & preds = s.g.predecessors.at(succ);
+        int const k = std::find(preds.begin(), preds.end(), b) - preds.begin();
+        for (phi & p : s.phis.at(succ)) p.uses.at(k) = top(p.variable);
+      }
+      for (auto c = s.children.at(b).rbegin(); c != s.children.at(b).rend(); c++)
+        work.push_back({ *c, false });
+    }
+  }
+
+  form construct (cfg::function f) {
+    cfg::thread(f);
+    split_critical_edges(f);
+    // Phis in the entry block would have nowhere to get the values we
+    // came in with: give it a block to come from.
+    if (!f.blocks.empty() && !cfg::analyze(f).predecessors.at(0).empty()) {
+      std::vector<std::string> const & first = f.blocks.at(0).labels;
+      assert(!first.empty() && "construct: entry block without a label");
+      std::string const entry = cfg::fresh(first.at(0) + "_entry", cfg::labels(f));
+      cfg::instruction const jump = cfg::parse("br " + first.at(0));
+      f.blocks.insert(f.blocks.begin(), { { entry }, {}, { jump } });
+    }
+    form s = { std::move(f) };
+    s.g = cfg::analyze(s.f);
+    dominator_tree(s);
+    place_phis(s);
+    rename(s);
+    return s;
+  }
+
+  // Extend what we know about each variable to all of its new names.
+  cfg::facts translate (cfg::facts const & known, form const & s) {
+    cfg::facts renamed = known;
+    for (auto const & entry : s.original) {
+      if (helper::collection::has(entry.second, known.header_cells))
+        renamed.header_cells.insert(entry.first);
+      if (helper::collection::has(entry.second, known.pointers))
+        renamed.pointers.insert(entry.first);
+    }
+    return renamed;
+  }
+
+  /*
+   * Back to plain L3: each phi becomes a copy at the end of each of its
+   * block's predecessors (which, with critical edges split, only go one
+   * place).
+   */
+  cfg::function destruct (form s) {
+    variables taken = cfg::mentioned(s.f);
+    for (std::vector<phi> const & phis : s.phis)
+      for (phi const & p : phis) taken.insert(p.defines);
+    for (int b = 0; b < s.f.blocks.size(); b++) {
+      std::vector<phi> const & phis = s.phis.at(b);
+      if (phis.empty()) continue;
+      std::vector<int> const & preds = s.g.predecessors.at(b);
+      for (int k = 0; k < preds.size(); k++) {
+        std::vector<std::pair<std::string, std::string>> copies;
+        variables sources;
+        for (phi const & p : phis) {
+          if (p.defines == p.uses.at(k)) continue;
+          copies.push_back({ p.defines, p.uses.at(k) });
+          sources.insert(p.uses.at(k));
+        }
+        bool overlap = false;
+        for (auto const & copy : copies)
+          overlap = overlap || helper::collection::has(copy.first, sources);
+        auto & body = s.f.blocks.at(preds.at(k)).body;
+        if (!overlap) {
+          for (auto const & copy : copies)
+            body.push_back(cfg::parse(copy.first + " <- " + copy.second));
+          continue;
+        }
+        // All at once: read every source before writing anything.
+        std::vector<std::string> temporaries;
+        for (auto const & copy : copies) {
+          std::string const t = cfg::fresh(copy.first + "_copy", taken);
+          taken.insert(t);
+          temporaries.push_back(t);
+          body.push_back(cfg::parse(t + " <- " + copy.second));
+        }
+        for (int c = 0; c < copies.size(); c++)
+          body.push_back(cfg::parse(copies.at(c).first + " <- " + temporaries.at(c)));
+      }
+    }
+    cfg::thread(s.f);
+    return std::move(s.f);
+  }
+}
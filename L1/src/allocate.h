@@ -0,0 +1,163 @@
+#pragma once
+#include <cstddef>
+#include <ostream>
+#include <string_view>
+
+#include "machine.h"
+
+/*
+ * ======================================================================
+ *  Inline allocation
+ * ======================================================================
+ *
+ * NOTE(jordan): `call allocate 2` is a real call into the runtime, every
+ * time: its stub saves six registers, allocate_helper checks the size,
+ * bumps the heap pointer and fills the array one word at a time, and then
+ * the stub puts all six registers back. For a 2-tuple.
+ *
+ * The runtime exports its allocation pointer and limit (see runtime.c),
+ * so in the common case we can do the bump ourselves:
+ *
+ *     movq %rdi, %rcx
+ *     sarq $1, %rcx                        # n, decoded
+ *     jle .Lf_0                            # n <= 0
+ *     jnc .Lf_0                            # size wasn't encoded
+ *     movq allocation_pointer(%rip), %rax
+ *     lea (%rax, %rcx, 8), %rdx            # the array's last word
+ *     cmpq allocation_limit(%rip), %rdx
+ *     jae .Lf_0                            # heap's full
+ *     cmpq $16, %rcx
+ *     ja .Lf_2                             # long: out of line
+ *     lea 8(%rdx), %rdx
+ *     movq %rdx, allocation_pointer(%rip)
+ *     movq %rcx, 0(%rax)                   # header
+ *   .Lf_3:
+ *     movq %rsi, (%rax, %rcx, 8)           # fill, last word first
+ *     dec %rcx
+ *     jne .Lf_3
+ *   .Lf_1:
+ *     ...
+ *     .text 1
+ *   .Lf_0:
+ *     call allocate                        # the old way
+ *     jmp .Lf_1
+ *   .Lf_2:
+ *     cmpq large_object_words(%rip), %rcx
+ *     jae .Lf_0                            # huge: the runtime's problem
+ *     lea 8(%rdx), %rdx
+ *     movq %rdx, allocation_pointer(%rip)
+ *     movq %rcx, 0(%rax)
+ *     movq %rax, %rdx
+ *     lea 8(%rax), %rdi
+ *     movq %rsi, %rax
+ *     rep stosq                            # n copies of the fill value
+ *     movq %rdx, %rax
+ *     jmp .Lf_1
+ *
+ * rep stosq takes a few dozen cycles to get going, which is more than a
+ * whole tuple costs to fill by hand; it only pays off for long arrays.
+ * Really long ones don't belong in the heap at all (the runtime maps them
+ * separately), so those take the slow path.
+ *
+ * Everything the slow path needs (rdi, rsi, and the stack) is untouched
+ * until we've committed to the fast one, so the runtime sees exactly what
+ * it used to: it still gets to complain about bad sizes, and collect. We
+ * only clobber caller-save registers, which `call allocate` may do anyway.
+ *
+ * Runs last (after profile.h, too): the passes before it don't know about
+ * the new jumps, and there's nothing in here for them to improve.
+ */
+namespace codegen::L1::allocate {
+  using namespace machine;
+
+  constexpr std::string_view pointer = "allocation_pointer";
+  constexpr std::string_view limit   = "allocation_limit";
+  constexpr std::string_view large   = "large_object_words";
+  // Longer than this, and we fill with rep stosq.
+  constexpr int64_t short_fill = 16;
+
+  struct report {
+    std::size_t inlined = 0; // call sites given a fast path
+  };
+
+  inline void print (report const & r, std::ostream & os) {
+    os << "allocate: " << r.inlined << " call sites inlined\n";
+  }
+
+  inline bool is_allocate (instruction const & i) {
+    return i.code == op::call
+      && i.dst.is(operand::Kind::symbol)
+      && i.dst.name == "allocate";
+  }
+
+  inline void run (
+    instructions & code,
+    out_of_line & stubs,
+    report * r = nullptr
+  ) {
+    report scratch;
+    report & tally = r ? *r : scratch;
+
+    operand const rax = operand::reg(Register::rax);
+    operand const rcx = operand::reg(Register::rcx);
+    operand const rdx = operand::reg(Register::rdx);
+    operand const rdi = operand::reg(Register::rdi);
+    operand const rsi = operand::reg(Register::rsi);
+    operand const next  = operand::global(pointer);
+    operand const bound = operand::global(limit);
+
+    instructions out;
+    out.reserve(code.size());
+    for (auto const & i : code) {
+      if (!is_allocate(i)) {
+        out.push_back(i);
+        continue;
+      }
+      operand const slow = stubs.fresh();
+      operand const done = stubs.fresh();
+      operand const big  = stubs.fresh();
+      operand const fill = stubs.fresh();
+      out.push_back(make(op::movq, rdi, rcx));
+      out.push_back(make(op::sarq, operand::immediate(1), rcx));
+      out.push_back(make(op::jle, slow));
+      out.push_back(make(op::jnc, slow));
+      out.push_back(make(op::movq, next, rax));
+      out.push_back(make(op::lea,
+        operand::address(Register::rax, Register::rcx, 8), rdx));
+      out.push_back(make(op::cmpq, bound, rdx));
+      out.push_back(make(op::jae, slow));
+      out.push_back(make(op::cmpq, operand::immediate(short_fill), rcx));
+      out.push_back(make(op::ja, big));
+      out.push_back(make(op::lea, operand::memory(Register::rdx, 8), rdx));
+      out.push_back(make(op::movq, rdx, next));
+      out.push_back(make(op::movq, rcx, operand::memory(Register::rax, 0)));
+      out.push_back(define_label(fill));
+      out.push_back(make(op::movq, rsi,
+        operand::address(Register::rax, Register::rcx, 8)));
+      out.push_back(make(op::dec, rcx));
+      out.push_back(make(op::jne, fill));
+      out.push_back(define_label(done));
+
+      stubs.code.push_back(define_label(slow));
+      stubs.code.push_back(i);
+      stubs.code.push_back(make(op::jmp, done));
+      stubs.code.push_back(define_label(big));
+      stubs.code.push_back(make(op::cmpq, operand::global(large), rcx));
+      stubs.code.push_back(make(op::jae, slow));
+      stubs.code.push_back(make(op::lea,
+        operand::memory(Register::rdx, 8), rdx));
+      stubs.code.push_back(make(op::movq, rdx, next));
+      stubs.code.push_back(make(op::movq, rcx,
+        operand::memory(Register::rax, 0)));
+      stubs.code.push_back(make(op::movq, rax, rdx));
+      stubs.code.push_back(make(op::lea,
+        operand::memory(Register::rax, 8), rdi));
+      stubs.code.push_back(make(op::movq, rsi, rax));
+      stubs.code.push_back(make(op::rep_stosq));
+      stubs.code.push_back(make(op::movq, rdx, rax));
+      stubs.code.push_back(make(op::jmp, done));
+      tally.inlined++;
+    }
+    code.swap(out);
+  }
+}
@@ -38,6 +38,8 @@ namespace ast::L1 {
           op::less,
           op::equal,
           op::less_equal,
+          op::below,
+          op::below_equal,
           operand::shift,
           operand::assignable,
           operand::memory,
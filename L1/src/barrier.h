@@ -0,0 +1,117 @@
+#pragma once
+#include <cstddef>
+#include <ostream>
+#include <string_view>
+
+#include "machine.h"
+#include "emit.h"
+
+/*
+ * ======================================================================
+ *  Write barriers
+ * ======================================================================
+ *
+ * NOTE(jordan): in generational mode (-G) the runtime collects its small
+ * nursery without looking at the old space, so it needs to be told about
+ * every old object that might now point into the nursery. Every store of
+ * a register into the heap (`mem x N <- y`; anything but `mem rsp N`)
+ * marks the 512-byte card it lands in, if that's in the old space (which,
+ * as far as we're concerned, includes the large objects):
+ *
+ *     movq %rax, barrier_scratch(%rip)      # borrow a register
+ *     lea 8(%rdi), %rax                     # the slot
+ *     subq old_space_start(%rip), %rax
+ *     cmpq old_space_bytes(%rip), %rax
+ *     jae .Lf_0                             # not in the old space
+ *     shrq $9, %rax
+ *     addq card_table(%rip), %rax
+ *     movb $1, 0(%rax)
+ *   .Lf_0:
+ *     movq barrier_scratch(%rip), %rax
+ *     movq %rsi, 8(%rdi)                    # the store itself
+ *
+ * Any register can be live here, so we park one in the runtime instead
+ * of on the stack (where the stack maps would have to know about it).
+ * Immediates and labels never point into the heap: storing one needs no
+ * barrier. Neither do the stores that fill a new array (allocate.h): it
+ * is in the nursery, or the runtime marked its cards for us.
+ *
+ * The program also defines `write_barriers`, which is how the runtime
+ * knows it can turn the nursery on (see runtime.c).
+ *
+ * Runs right before inline allocation; like it, nothing before it needs
+ * to know about the extra jumps.
+ */
+namespace codegen::L1::barrier {
+  using namespace machine;
+
+  constexpr std::string_view scratch = "barrier_scratch";
+  constexpr std::string_view start   = "old_space_start";
+  constexpr std::string_view bytes   = "old_space_bytes";
+  constexpr std::string_view cards   = "card_table";
+  constexpr int64_t card_shift = 9;
+
+  struct report {
+    std::size_t stores = 0; // stores given a barrier
+  };
+
+  inline void print (report const & r, std::ostream & os) {
+    os << "barrier: " << r.stores << " heap stores\n";
+  }
+
+  inline bool is_heap_store (instruction const & i) {
+    return i.code == op::movq
+      && i.src.is(operand::Kind::reg)
+      && i.dst.is(operand::Kind::memory)
+      && i.dst.base != Register::rsp;
+  }
+
+  inline void run (
+    instructions & code,
+    out_of_line & stubs,
+    report * r = nullptr
+  ) {
+    report ignored;
+    report & tally = r ? *r : ignored;
+
+    instructions out;
+    out.reserve(code.size());
+    for (auto const & i : code) {
+      if (!is_heap_store(i)) {
+        out.push_back(i);
+        continue;
+      }
+      // Any register but the two the store needs.
+      Register t = Register::rax;
+      for (Register c : { Register::rax, Register::rcx, Register::rdx })
+        if (c != i.src.base && c != i.dst.base) { t = c; break; }
+      operand const reg = operand::reg(t);
+      operand const park = operand::global(scratch);
+      operand const skip = stubs.fresh();
+      out.push_back(make(op::movq, reg, park));
+      out.push_back(make(op::lea, i.dst, reg));
+      out.push_back(make(op::subq, operand::global(start), reg));
+      out.push_back(make(op::cmpq, operand::global(bytes), reg));
+      out.push_back(make(op::jae, skip));
+      out.push_back(make(op::shrq, operand::immediate(card_shift), reg));
+      out.push_back(make(op::addq, operand::global(cards), reg));
+      out.push_back(make(op::movb, operand::immediate(1),
+        operand::memory(t, 0)));
+      out.push_back(define_label(skip));
+      out.push_back(make(op::movq, park, reg));
+      out.push_back(i);
+      tally.stores++;
+    }
+    code.swap(out);
+  }
+
+  // Tells the runtime this program marks its cards.
+  inline void mark_program (emit::buffer & os) {
+    os << "  .data\n"
+          "  .p2align 3\n"
+          "  .globl write_barriers\n"
+          "write_barriers:\n"
+          "  .quad 1\n"
+          "  .text 0\n";
+  }
+}
@@ -1,18 +1,56 @@
 #pragma once
 
+#include <fcntl.h>
 #include <cassert>
-#include <fstream>
+#include <cstdint>
 #include <iostream>
+#include <string_view>
 
 #include "tao/pegtl.hpp"
 
 #include "grammar.h"
+#include "register.h"
+#include "machine.h"
+#include "peephole.h"
+#include "encode.h"
+#include "layout.h"
+#include "profile.h"
+#include "barrier.h"
+#include "allocate.h"
+#include "stackmap.h"
+#include "emit.h"
 #include "ast.h"
 
 namespace codegen::L1::generate {
   namespace grammar = grammar::L1;
   namespace ast = ast::L1;
   using namespace ast;
+  using emit::buffer;
+  using opcode = emit::op;
+  using Register = x86_64::Register;
+  using mop = machine::operand;
+  using machine::make;
+
+  /* NOTE(jordan): how hard to try, and where to say what we did.
+   * Threaded from the driver down to each function, which is where the
+   * passes run.
+   */
+  struct settings {
+    int optimization_level = 0;
+    // If set, the passes tally what they changed here.
+    peephole::report * peephole = nullptr;
+    layout::report   * layout   = nullptr;
+    encode::report   * encode   = nullptr;
+    barrier::report  * barrier  = nullptr;
+    allocate::report * allocate = nullptr;
+    stackmap::report * stackmap = nullptr;
+    // Count taken branches at runtime (see profile.h)
+    bool count_branches = false;
+    // Mark cards on heap stores, for the nursery (see barrier.h)
+    bool write_barriers = false;
+    // Tell the runtime where each allocation comes from (see profile.h)
+    bool allocation_sites = false;
+  };
 
   namespace helper {
     /* NOTE(jordan): nothing about this helper is L1-specific due to
@@ -36,162 +74,158 @@ namespace codegen::L1::generate {
   }
 
   namespace helper {
-    std::string register_to_lower8 (std::string rxx) {
-      if (rxx ==  "r8") return  "r8b";
-      if (rxx ==  "r9") return  "r9b";
-      if (rxx == "r10") return "r10b";
-      if (rxx == "r11") return "r11b";
-      if (rxx == "r12") return "r12b";
-      if (rxx == "r13") return "r13b";
-      if (rxx == "r14") return "r14b";
-      if (rxx == "r15") return "r15b";
-      if (rxx == "rax") return   "al";
-      if (rxx == "rbp") return  "bpl";
-      if (rxx == "rbx") return   "bl";
-      if (rxx == "rcx") return   "cl";
-      if (rxx == "rdi") return  "dil";
-      if (rxx == "rdx") return   "dl";
-      if (rxx == "rsi") return  "sil";
-      assert(false && "register_to_lower8: unreachable!");
-    }
-    std::string register_to_lower8 (const node & n) {
-      assert(n.has_content()
-          && "helper::register_to_lower8: no content!");
-      return register_to_lower8(n.content());
+    // NOTE(jordan): content() copies into a fresh std::string. Don't.
+    std::string_view view (const node & n) {
+      assert(n.has_content() && "helper::view: no content!");
+      return std::string_view(n.m_begin.data, n.m_end.data - n.m_begin.data);
     }
   }
 
   namespace helper {
-    char constant_prefix = '$';
-    void constant (const node & n, std::ostream & os) {
-      assert(n.has_content() && "helper::constant: no content!");
-      int value = std::stoi(n.content());
-      os << constant_prefix << value;
+    int64_t integer (const node & n) {
+      std::string_view digits = helper::view(n);
+      bool negative = false;
+      if (!digits.empty() && (digits[0] == '-' || digits[0] == '+')) {
+        negative = digits[0] == '-';
+        digits.remove_prefix(1);
+      }
+      assert(!digits.empty() && "helper::integer: no digits!");
+      uint64_t magnitude = 0;
+      for (char c : digits) magnitude = 10 * magnitude + (c - '0');
+      return negative
+        ? static_cast<int64_t>(~magnitude + 1)
+        : static_cast<int64_t>(magnitude);
     }
   }
 
   namespace helper {
-    void gas_register (const node & n, std::ostream & os) {
-      assert(n.has_content() && "helper::gas_register: no content!");
-      std::string name = n.content();
-      os << "%" << name;
-    }
-    void gas_register (std::string name, std::ostream & os) {
-      os << "%" << name;
+    mop constant (const node & n) {
+      return mop::immediate(helper::integer(n));
     }
   }
 
   namespace helper {
-    int integer (const node & n) {
-      assert(n.has_content() && "helper::integer: no content!");
-      return std::stoi(n.content());
+    Register to_register (const node & n) {
+      Register r = x86_64::from_name(helper::view(n));
+      assert(r != Register::none && "helper::to_register: not a register!");
+      return r;
+    }
+    mop gas_register (const node & n) {
+      return mop::reg(helper::to_register(n));
+    }
+    mop gas_register8 (const node & n) {
+      return mop::reg8(helper::to_register(n));
+    }
+    bool is_register (const node & n) {
+      return n.has_content()
+        && x86_64::from_name(helper::view(n)) != Register::none;
     }
   }
 
   namespace helper::label {
-    std::string get_underscore_name (const node & n) {
+    std::string_view get_name (const node & n) {
       assert(n.children.size() == 1 && "label: no name child!");
       const node & name = *n.children.at(0);
-      assert(name.has_content() && "label: name has no content!");
-      return "_" + name.content();
+      return helper::view(name);
     }
   }
 
   namespace helper::expression {
-    void mem (const node & n, std::ostream & os) {
+    mop mem (const node & n) {
       assert(n.children.size() == 2);
       node & reg     = *n.children.at(0);
       node & integer = *n.children.at(1);
-      assert(integer.has_content()
-          && "helper::expression::mem: integer: no content!");
-      std::string offset = integer.content();
-      os << offset << "(";
-      helper::gas_register(reg, os);
-      os << ")";
+      return mop::memory(helper::to_register(reg), helper::integer(integer));
     }
   }
 
   namespace helper::op {
-    void aop (const node & n, std::ostream & os) {
-      if (n.is<grammar::op::add>())         { os <<  "addq"; return; }
-      if (n.is<grammar::op::subtract>())    { os <<  "subq"; return; }
-      if (n.is<grammar::op::multiply>())    { os << "imulq"; return; }
-      if (n.is<grammar::op::bitwise_and>()) { os <<  "andq"; return; }
+    opcode aop (const node & n) {
+      if (n.is<grammar::op::add>())         return opcode::addq;
+      if (n.is<grammar::op::subtract>())    return opcode::subq;
+      if (n.is<grammar::op::multiply>())    return opcode::imulq;
+      if (n.is<grammar::op::bitwise_and>()) return opcode::andq;
       assert(false && "op::aop: unreachable!");
     }
-    void sop (const node & n, std::ostream & os) {
-      if (n.is<grammar::op::shift_left>())  { os << "salq"; return; }
-      if (n.is<grammar::op::shift_right>()) { os << "sarq"; return; }
+    opcode sop (const node & n) {
+      if (n.is<grammar::op::shift_left>())  return opcode::salq;
+      if (n.is<grammar::op::shift_right>()) return opcode::sarq;
       assert(false && "op::sop: unreachable!");
     }
   }
 
   namespace helper::cmp {
-    std::string op_l_suffix (std::string op) {
-      if (op ==  "=") return "e";
-      if (op ==  "<") return "l";
-      if (op == "<=") return "le";
-      assert(false && "op_l_suffix: unreachable!");
-    }
-    std::string op_l_suffix (const node & n) {
-      assert(n.has_content() && "helper::cmp::op_l_suffix: no content!");
-      return op_l_suffix(n.content());
-    }
-    std::string op_g_suffix (std::string op) {
-      if (op ==  "=") return "e";
-      if (op ==  "<") return "g";
-      if (op == "<=") return "ge";
-      assert(false && "op_g_suffix: unreachable!");
-    }
-    std::string op_g_suffix (const node & n) {
-      assert(n.has_content() && "helper::cmp::op_g_suffix: no content!");
-      return op_g_suffix(n.content());
-    }
-    void setl_le_e (
-      const node & dest,
-      const node & op,
-      std::ostream & os
-    ) {
-      std::string d8 = helper::register_to_lower8(dest);
-      os << "set" << helper::cmp::op_l_suffix(op);
-      os  << " ";
-      helper::gas_register(d8, os);
-    }
-    void setg_ge_e (
-      const node & dest,
-      const node & op,
-      std::ostream & os
-    ) {
-      std::string d8 = helper::register_to_lower8(dest);
-      os << "set" << helper::cmp::op_g_suffix(op);
-      os << " ";
-      helper::gas_register(d8, os);
-    }
-    void jl_le_e (const node & op, std::ostream & os) {
-      os << "j" << helper::cmp::op_l_suffix(op);
-    }
-    void jg_ge_e (const node & op, std::ostream & os) {
-      os << "j" << helper::cmp::op_g_suffix(op);
-    }
-    void movzbq (const node & dest, std::ostream & os) {
-      std::string d8 = helper::register_to_lower8(dest);
-      os << "movzbq ";
-      helper::gas_register(d8, os);
-      os << ", ";
-      helper::gas_register(dest, os);
-    }
-    void rr (const node & lhs, const node & rhs, std::ostream & os) {
+    /* NOTE(jordan): the _l_ variants are for `reg cmp x`; the _g_ ones
+     * are for `con cmp reg`, where the operands get swapped for cmpq.
+     */
+    opcode set_l (const node & n) {
+      if (n.is<grammar::op::equal>())      return opcode::sete;
+      if (n.is<grammar::op::less>())       return opcode::setl;
+      if (n.is<grammar::op::less_equal>()) return opcode::setle;
+      if (n.is<grammar::op::below>())       return opcode::setb;
+      if (n.is<grammar::op::below_equal>()) return opcode::setbe;
+      assert(false && "set_l: unreachable!");
+    }
+    opcode set_g (const node & n) {
+      if (n.is<grammar::op::equal>())      return opcode::sete;
+      if (n.is<grammar::op::less>())       return opcode::setg;
+      if (n.is<grammar::op::less_equal>()) return opcode::setge;
+      if (n.is<grammar::op::below>())       return opcode::seta;
+      if (n.is<grammar::op::below_equal>()) return opcode::setae;
+      assert(false && "set_g: unreachable!");
+    }
+    opcode j_l (const node & n) {
+      if (n.is<grammar::op::equal>())      return opcode::je;
+      if (n.is<grammar::op::less>())       return opcode::jl;
+      if (n.is<grammar::op::less_equal>()) return opcode::jle;
+      if (n.is<grammar::op::below>())       return opcode::jb;
+      if (n.is<grammar::op::below_equal>()) return opcode::jbe;
+      assert(false && "j_l: unreachable!");
+    }
+    opcode j_g (const node & n) {
+      if (n.is<grammar::op::equal>())      return opcode::je;
+      if (n.is<grammar::op::less>())       return opcode::jg;
+      if (n.is<grammar::op::less_equal>()) return opcode::jge;
+      if (n.is<grammar::op::below>())       return opcode::ja;
+      if (n.is<grammar::op::below_equal>()) return opcode::jae;
+      assert(false && "j_g: unreachable!");
+    }
+    bool evaluate (const node & lhs, const node & op, const node & rhs) {
+      int64_t lhs_ = helper::integer(lhs);
+      int64_t rhs_ = helper::integer(rhs);
+      if (op.is<grammar::op::less>())       return lhs_  < rhs_;
+      if (op.is<grammar::op::equal>())      return lhs_ == rhs_;
+      if (op.is<grammar::op::less_equal>()) return lhs_ <= rhs_;
+      if (op.is<grammar::op::below>())
+        return static_cast<uint64_t>(lhs_) <  static_cast<uint64_t>(rhs_);
+      if (op.is<grammar::op::below_equal>())
+        return static_cast<uint64_t>(lhs_) <= static_cast<uint64_t>(rhs_);
+      assert(false && "cmp::evaluate: unreachable!");
+    }
+    void set (opcode set, const node & dest, machine::instructions & out) {
+      out.push_back(make(set, helper::gas_register8(dest)));
+    }
+    void movzbq (const node & dest, machine::instructions & out) {
+      out.push_back(make(
+        opcode::movzbq,
+        helper::gas_register8(dest),
+        helper::gas_register(dest)
+      ));
+    }
+    void rr (const node & lhs, const node & rhs, machine::instructions & out) {
       // at&t is bardswack but that's just how it do
-      os << "cmpq ";
-      helper::gas_register(rhs, os);
-      os << ", ";
-      helper::gas_register(lhs, os);
-    }
-    void rc (const node & reg, const node & con, std::ostream & os) {
-      os << "cmpq ";
-      helper::constant(con, os);
-      os << ", ";
-      helper::gas_register(reg, os);
+      out.push_back(make(
+        opcode::cmpq,
+        helper::gas_register(rhs),
+        helper::gas_register(lhs)
+      ));
+    }
+    void rc (const node & reg, const node & con, machine::instructions & out) {
+      out.push_back(make(
+        opcode::cmpq,
+        helper::constant(con),
+        helper::gas_register(reg)
+      ));
     }
   }
 
@@ -200,50 +234,39 @@ namespace codegen::L1::generate {
       assert(n.children.size() == 1);
       const node & value = *n.children.at(0);
       return n.is<grammar::operand::comparable>()
-        && helper::matches<grammar::literal::number::integer::any>(value);
+        && value.is<grammar::literal::number::integer::any>();
     }
     bool reg (const node & n) {
       assert(n.children.size() == 1);
       const node & value = *n.children.at(0);
       return n.is<grammar::operand::comparable>()
-        && helper::matches<grammar::register_set::any>(value);
+        && helper::is_register(value);
     }
   }
 
-  void label (const node & n, std::ostream & os) {
-    os << helper::label::get_underscore_name(n);
+  mop label (const node & n) {
+    return mop::label(helper::label::get_name(n));
   }
 
   namespace operand {
-    void movable (const node & n, std::ostream & os) {
+    mop movable (const node & n) {
       assert(n.children.size() == 1);
       const node & value = *n.children.at(0);
-      if (value.is<grammar::literal::number::integer::any>()) {
-        helper::constant(value, os);
-        return;
-      }
-      if (value.is<grammar::identifier::label>()) {
-        os << helper::constant_prefix;
-        generate::label(value, os);
-        return;
-      }
-      if (helper::matches<grammar::register_set::any>(value)) {
-        helper::gas_register(value, os);
-        return;
-      }
+      if (value.is<grammar::literal::number::integer::any>())
+        return helper::constant(value);
+      if (value.is<grammar::identifier::label>())
+        return mop::label_value(helper::label::get_name(value));
+      if (helper::is_register(value))
+        return helper::gas_register(value);
       assert(false && "operand::movable: unreachable!");
     }
-    void comparable (const node & n, std::ostream & os) {
+    mop comparable (const node & n) {
       assert(n.children.size() == 1);
       const node & value = *n.children.at(0);
-      if (value.is<grammar::literal::number::integer::any>()) {
-        helper::constant(value, os);
-        return;
-      }
-      if (helper::matches<grammar::register_set::any>(value)) {
-        helper::gas_register(value, os);
-        return;
-      }
+      if (value.is<grammar::literal::number::integer::any>())
+        return helper::constant(value);
+      if (helper::is_register(value))
+        return helper::gas_register(value);
       assert(false && "operand::comparable: unreachable!");
     }
   }
@@ -252,14 +275,14 @@ namespace codegen::L1::generate {
     const node & n,
     int args,
     int locals,
-    std::ostream & os
+    machine::instructions & out
   ) {
     using namespace grammar::instruction;
 
     if (n.is<grammar::instruction::any>()) {
       assert(n.children.size() == 1);
       const node & actual_instruction = *n.children.at(0);
-      generate::instruction(actual_instruction, args, locals, os);
+      generate::instruction(actual_instruction, args, locals, out);
       return;
     }
 
@@ -267,10 +290,11 @@ namespace codegen::L1::generate {
       assert(n.children.size() == 2);
       const node & dest = *n.children.at(0);
       const node & src  = *n.children.at(1);
-      os << "movq ";
-      operand::movable(src, os);
-      os << ", ";
-      helper::gas_register(dest, os);
+      out.push_back(make(
+        opcode::movq,
+        operand::movable(src),
+        helper::gas_register(dest)
+      ));
       return;
     }
 
@@ -278,10 +302,11 @@ namespace codegen::L1::generate {
       assert(n.children.size() == 2);
       const node & dest = *n.children.at(0);
       const node & src  = *n.children.at(1);
-      os << "movq ";
-      helper::expression::mem(src, os);
-      os << ", ";
-      helper::gas_register(dest, os);
+      out.push_back(make(
+        opcode::movq,
+        helper::expression::mem(src),
+        helper::gas_register(dest)
+      ));
       return;
     }
 
@@ -289,10 +314,11 @@ namespace codegen::L1::generate {
       assert(n.children.size() == 2);
       const node & dest = *n.children.at(0);
       const node & src  = *n.children.at(1);
-      os << "movq ";
-      operand::movable(src, os);
-      os << ", ";
-      helper::expression::mem(dest, os);
+      out.push_back(make(
+        opcode::movq,
+        operand::movable(src),
+        helper::expression::mem(dest)
+      ));
       return;
     }
 
@@ -301,11 +327,11 @@ namespace codegen::L1::generate {
       const node & dest = *n.children.at(0);
       const node & op   = *n.children.at(1);
       const node & src  = *n.children.at(2);
-      helper::op::aop(op, os);
-      os << " ";
-      operand::comparable(src, os);
-      os << ", ";
-      helper::gas_register(dest, os);
+      out.push_back(make(
+        helper::op::aop(op),
+        operand::comparable(src),
+        helper::gas_register(dest)
+      ));
       return;
     }
 
@@ -314,12 +340,11 @@ namespace codegen::L1::generate {
       const node & dest = *n.children.at(0);
       const node & op   = *n.children.at(1);
       const node & src  = *n.children.at(2);
-      auto src8 = helper::register_to_lower8(src);
-      helper::op::sop(op, os);
-      os << " ";
-      helper::gas_register(src8, os);
-      os << ", ";
-      helper::gas_register(dest, os);
+      out.push_back(make(
+        helper::op::sop(op),
+        helper::gas_register8(src),
+        helper::gas_register(dest)
+      ));
       return;
     }
 
@@ -328,11 +353,11 @@ namespace codegen::L1::generate {
       const node & dest = *n.children.at(0);
       const node & op   = *n.children.at(1);
       const node & con  = *n.children.at(2);
-      helper::op::sop(op, os);
-      os << " ";
-      helper::constant(con, os);
-      os << ", ";
-      helper::gas_register(dest, os);
+      out.push_back(make(
+        helper::op::sop(op),
+        helper::constant(con),
+        helper::gas_register(dest)
+      ));
       return;
     }
 
@@ -342,11 +367,11 @@ namespace codegen::L1::generate {
       const node & dest = *n.children.at(0);
       const node & op   = *n.children.at(1);
       const node & src  = *n.children.at(2);
-      helper::op::aop(op, os);
-      os << " ";
-      operand::comparable(src, os);
-      os << ", ";
-      helper::expression::mem(dest, os);
+      out.push_back(make(
+        helper::op::aop(op),
+        operand::comparable(src),
+        helper::expression::mem(dest)
+      ));
       return;
     }
 
@@ -356,11 +381,11 @@ namespace codegen::L1::generate {
       const node & dest = *n.children.at(0);
       const node & op   = *n.children.at(1);
       const node & src  = *n.children.at(2);
-      helper::op::aop(op, os);
-      os << " ";
-      helper::expression::mem(src, os);
-      os << ", ";
-      helper::gas_register(dest, os);
+      out.push_back(make(
+        helper::op::aop(op),
+        helper::expression::mem(src),
+        helper::gas_register(dest)
+      ));
       return;
     }
 
@@ -374,34 +399,28 @@ namespace codegen::L1::generate {
       const node & op   = *cmp.children.at(1);
       const node & rhs  = *cmp.children.at(2);
       if (predicate::constant(lhs) && predicate::constant(rhs)) {
-        assert(op.has_content() && "gets_comparison: op: no content!");
-        assert(lhs.has_content() && "gets_comparison: lhs: no content!");
-        assert(rhs.has_content() && "gets_comparison: rhs: no content!");
-        std::string op_  = op.content();
-        int lhs_ = helper::integer(lhs);
-        int rhs_ = helper::integer(rhs);
-        os << "movq ";
-        if      (op_ ==  "<" && lhs_  < rhs_) os << "$1";
-        else if (op_ ==  "=" && lhs_ == rhs_) os << "$1";
-        else if (op_ == "<=" && lhs_ <= rhs_) os << "$1";
-        else                                  os << "$0";
-        os << ", ";
-        helper::gas_register(dest, os);
+        const node & lhs_ = *lhs.children.at(0);
+        const node & rhs_ = *rhs.children.at(0);
+        out.push_back(make(
+          opcode::movq,
+          mop::immediate(helper::cmp::evaluate(lhs_, op, rhs_) ? 1 : 0),
+          helper::gas_register(dest)
+        ));
         return;
       } else if (predicate::constant(lhs) && predicate::reg(rhs)) {
-        helper::cmp::rc(rhs, lhs, os);        os << "\n  ";
-        helper::cmp::setg_ge_e(dest, op, os); os << "\n  ";
-        helper::cmp::movzbq(dest, os);
+        helper::cmp::rc(rhs, lhs, out);
+        helper::cmp::set(helper::cmp::set_g(op), dest, out);
+        helper::cmp::movzbq(dest, out);
         return;
       } else if (predicate::reg(lhs) && predicate::constant(rhs)) {
-        helper::cmp::rc(lhs, rhs, os);        os << "\n  ";
-        helper::cmp::setl_le_e(dest, op, os); os << "\n  ";
-        helper::cmp::movzbq(dest, os);
+        helper::cmp::rc(lhs, rhs, out);
+        helper::cmp::set(helper::cmp::set_l(op), dest, out);
+        helper::cmp::movzbq(dest, out);
         return;
       } else if (predicate::reg(lhs) && predicate::reg(rhs)) {
-        helper::cmp::rr(lhs, rhs, os);        os << "\n  ";
-        helper::cmp::setl_le_e(dest, op, os); os << "\n  ";
-        helper::cmp::movzbq(dest, os);
+        helper::cmp::rr(lhs, rhs, out);
+        helper::cmp::set(helper::cmp::set_l(op), dest, out);
+        helper::cmp::movzbq(dest, out);
         return;
       }
       assert(false
@@ -418,41 +437,26 @@ namespace codegen::L1::generate {
       const node & rhs  = *cmp.children.at(2);
       const node & then = *n.children.at(1);
       const node & els  = *n.children.at(2);
-      std::string then_label = helper::label::get_underscore_name(then);
-      std::string else_label = helper::label::get_underscore_name(els);
       if (predicate::constant(lhs) && predicate::constant(rhs)) {
-        assert(op.has_content() && "gets_comparison: op: no content!");
-        assert(lhs.has_content() && "gets_comparison: lhs: no content!");
-        assert(rhs.has_content() && "gets_comparison: rhs: no content!");
-        std::string op_  = op.content();
-        int lhs_ = helper::integer(lhs);
-        int rhs_ = helper::integer(rhs);
-        os << "jmp ";
-        if      (op_ ==  "<" && lhs_  < rhs_) os << then_label;
-        else if (op_ ==  "=" && lhs_ == rhs_) os << then_label;
-        else if (op_ == "<=" && lhs_ <= rhs_) os << then_label;
-        else                                  os << else_label;
+        const node & lhs_ = *lhs.children.at(0);
+        const node & rhs_ = *rhs.children.at(0);
+        bool taken = helper::cmp::evaluate(lhs_, op, rhs_);
+        out.push_back(make(opcode::jmp, label(taken ? then : els)));
         return;
       } else if (predicate::constant(lhs) && predicate::reg(rhs)) {
-        helper::cmp::rc(rhs, lhs, os);
-        os << "\n  ";
-        helper::cmp::jg_ge_e(op, os);
-        os << " "    << then_label << "\n  ";
-        os << "jmp " << else_label;
+        helper::cmp::rc(rhs, lhs, out);
+        out.push_back(make(helper::cmp::j_g(op), label(then)));
+        out.push_back(make(opcode::jmp,          label(els)));
         return;
       } else if (predicate::reg(lhs) && predicate::constant(rhs)) {
-        helper::cmp::rc(lhs, rhs, os);
-        os << "\n  ";
-        helper::cmp::jl_le_e(op, os);
-        os << " "    << then_label << "\n  ";
-        os << "jmp " << else_label;
+        helper::cmp::rc(lhs, rhs, out);
+        out.push_back(make(helper::cmp::j_l(op), label(then)));
+        out.push_back(make(opcode::jmp,          label(els)));
         return;
       } else if (predicate::reg(lhs) && predicate::reg(rhs)) {
-        helper::cmp::rr(lhs, rhs, os);
-        os << "\n  ";
-        helper::cmp::jl_le_e(op, os);
-        os << " "    << then_label << "\n  ";
-        os << "jmp " << else_label;
+        helper::cmp::rr(lhs, rhs, out);
+        out.push_back(make(helper::cmp::j_l(op), label(then)));
+        out.push_back(make(opcode::jmp,          label(els)));
         return;
       }
       assert(false && "jump::cjump::if_else: unreachable!");
@@ -467,35 +471,23 @@ namespace codegen::L1::generate {
       const node & op   = *cmp.children.at(1);
       const node & rhs  = *cmp.children.at(2);
       const node & then = *n.children.at(1);
-      std::string then_label = helper::label::get_underscore_name(then);
       if (predicate::constant(lhs) && predicate::constant(rhs)) {
-        assert(op.has_content() && "gets_comparison: op: no content!");
-        assert(lhs.has_content() && "gets_comparison: lhs: no content!");
-        assert(rhs.has_content() && "gets_comparison: rhs: no content!");
-        std::string op_  = op.content();
-        std::string lhs_ = lhs.content();
-        std::string rhs_ = rhs.content();
-        if      (op_ ==  "<" && lhs_  < rhs_) os << "jmp " << then_label;
-        else if (op_ ==  "=" && lhs_ == rhs_) os << "jmp " << then_label;
-        else if (op_ == "<=" && lhs_ <= rhs_) os << "jmp " << then_label;
+        const node & lhs_ = *lhs.children.at(0);
+        const node & rhs_ = *rhs.children.at(0);
+        if (helper::cmp::evaluate(lhs_, op, rhs_))
+          out.push_back(make(opcode::jmp, label(then)));
         return;
       } else if (predicate::constant(lhs) && predicate::reg(rhs)) {
-        helper::cmp::rc(rhs, lhs, os);
-        os << "\n  ";
-        helper::cmp::jg_ge_e(op, os);
-        os << " " << then_label;
+        helper::cmp::rc(rhs, lhs, out);
+        out.push_back(make(helper::cmp::j_g(op), label(then)));
         return;
       } else if (predicate::reg(lhs) && predicate::constant(rhs)) {
-        helper::cmp::rc(lhs, rhs, os);
-        os << "\n  ";
-        helper::cmp::jl_le_e(op, os);
-        os << " " << then_label;
+        helper::cmp::rc(lhs, rhs, out);
+        out.push_back(make(helper::cmp::j_l(op), label(then)));
         return;
       } else if (predicate::reg(lhs) && predicate::reg(rhs)) {
-        helper::cmp::rr(lhs, rhs, os);
-        os << "\n  ";
-        helper::cmp::jl_le_e(op, os);
-        os << " " << then_label;
+        helper::cmp::rr(lhs, rhs, out);
+        out.push_back(make(helper::cmp::j_l(op), label(then)));
         return;
       }
       assert(false && "jump::cjump::when: unreachable!");
@@ -503,28 +495,27 @@ namespace codegen::L1::generate {
 
     if (n.is<define::label>()) {
       assert(n.children.size() == 1);
-      const node & label = *n.children.at(0);
-      generate::label(label, os);
-      os << ":";
+      const node & name = *n.children.at(0);
+      out.push_back(machine::define_label(helper::label::get_name(name)));
       return;
     }
 
     if (n.is<jump::go2>()) {
       assert(n.children.size() == 1);
-      const node & label = *n.children.at(0);
-      os << "jmp ";
-      generate::label(label, os);
+      const node & target = *n.children.at(0);
+      out.push_back(make(opcode::jmp, label(target)));
       return;
     }
 
     if (n.is<invoke::ret>()) {
       int stack = 8 * locals;
       if (args  > 6) stack += 8 * (args - 6);
-      if (stack > 0) {
-        os << "addq $" << stack << ", %rsp\n";
-        os << "  "; // Reindent
-      }
-      os << "ret";
+      if (stack > 0) out.push_back(make(
+        opcode::addq,
+        mop::immediate(stack),
+        mop::reg(Register::rsp)
+      ));
+      out.push_back(make(opcode::ret));
       return;
     }
 
@@ -534,51 +525,55 @@ namespace codegen::L1::generate {
       const node & integer  = *n.children.at(1);
       assert(callable.children.size() == 1);
       const node & value = *callable.children.at(0);
-      int args  = helper::integer(integer);
-      int spill = 8; // return address!
+      int64_t args  = helper::integer(integer);
+      int64_t spill = 8; // return address!
       if (args  > 6) spill += 8 * (args - 6);
-      os << "subq $" << spill << ", %rsp\n  ";
-      os << "jmp ";
+      out.push_back(make(
+        opcode::subq,
+        mop::immediate(spill),
+        mop::reg(Register::rsp)
+      ));
       if (value.is<grammar::operand::assignable>()) {
-        os << "*"; // at&t indirect jump
-        helper::gas_register(value, os);
+        // at&t indirect jump
+        out.push_back(make(
+          opcode::jmp,
+          mop::indirect(helper::to_register(value))
+        ));
         return;
       }
       if (value.is<grammar::identifier::label>()) {
-        label(value, os);
+        out.push_back(make(opcode::jmp, label(value)));
         return;
       }
       assert(false && "invoke::call::callable: unreachable!");
     }
 
     if (n.is<invoke::call::intrinsic::print>()) {
-      os << "call print";
+      out.push_back(make(opcode::call, mop::symbol("print")));
       return;
     }
 
     if (n.is<invoke::call::intrinsic::allocate>()) {
-      os << "call allocate";
+      out.push_back(make(opcode::call, mop::symbol("allocate")));
       return;
     }
 
     if (n.is<invoke::call::intrinsic::array_error>()) {
-      os << "call array_error";
+      out.push_back(make(opcode::call, mop::symbol("array_error")));
       return;
     }
 
     if (n.is<update::assignable::arithmetic::increment>()) {
       assert(n.children.size() == 2); // ignore '++'
       const node & dest = *n.children.at(0);
-      os << "inc ";
-      helper::gas_register(dest, os);
+      out.push_back(make(opcode::inc, helper::gas_register(dest)));
       return;
     }
 
     if (n.is<update::assignable::arithmetic::decrement>()) {
       assert(n.children.size() == 2); // ignore '--'
       const node & dest = *n.children.at(0);
-      os << "dec ";
-      helper::gas_register(dest, os);
+      out.push_back(make(opcode::dec, helper::gas_register(dest)));
       return;
     }
 
@@ -589,13 +584,15 @@ namespace codegen::L1::generate {
       const node & base   = *n.children.at(2);
       const node & offset = *n.children.at(3);
       const node & scale  = *n.children.at(4);
-      os << "lea ";
-        os << "(" ; helper::gas_register(base, os);
-        os << ", "; helper::gas_register(offset, os);
-        os << ", "; os << helper::integer(scale);
-        os << ")";
-      os << ", ";
-      helper::gas_register(dest, os);
+      out.push_back(make(
+        opcode::lea,
+        mop::address(
+          helper::to_register(base),
+          helper::to_register(offset),
+          helper::integer(scale)
+        ),
+        helper::gas_register(dest)
+      ));
       return;
     }
 
@@ -607,19 +604,17 @@ namespace codegen::L1::generate {
     const node & n,
     int args,
     int locals,
-    std::ostream & os
+    machine::instructions & out
   ) {
     for (auto & child : n.children) {
       assert(child->is<grammar::instruction::any>()
           && "instructions: got non-instruction!");
-      os << "  "; // indent the instruction
-      generate::instruction(*child, args, locals, os);
-      os << "\n"; // make a new line after it
+      generate::instruction(*child, args, locals, out);
     }
     return;
   }
 
-  void function (const node & n, std::ostream & os) {
+  void function (const node & n, settings const & s, buffer & os) {
     assert(n.children.size() == 4);
     const node & name         = *n.children.at(0);
     const node & arg_count    = *n.children.at(1);
@@ -627,56 +622,97 @@ namespace codegen::L1::generate {
     const node & instructions = *n.children.at(3);
     int args   = helper::integer(arg_count);
     int locals = helper::integer(local_count);
-    label(name, os); os << ":\n";
-    if (locals > 0)  os << "  subq $" << 8 * locals << ", %rsp\n";
-    return generate::instructions(instructions, args, locals, os);
+    machine::instructions code;
+    code.reserve(2 * instructions.children.size() + 1);
+    if (locals > 0) code.push_back(make(
+      opcode::subq,
+      mop::immediate(8 * locals),
+      mop::reg(Register::rsp)
+    ));
+    generate::instructions(instructions, args, locals, code);
+    if (s.optimization_level >= 1) peephole::run(code, s.peephole);
+    if (s.optimization_level >= 2) layout::run(code, s.layout);
+    if (s.optimization_level >= 2) encode::run(code, s.encode);
+    machine::out_of_line stubs { helper::label::get_name(name) };
+    profile::sites sites;
+    if (s.count_branches) profile::taken_branches(code, stubs);
+    if (s.allocation_sites)
+      profile::allocation_sites(code, stubs.function, sites);
+    if (s.write_barriers) barrier::run(code, stubs, s.barrier);
+    if (s.optimization_level >= 1) allocate::run(code, stubs, s.allocate);
+    int64_t frame = locals + (args > 6 ? args - 6 : 0);
+    auto map = stackmap::run(code, stubs, frame, s.stackmap);
+    os << label(name) << ":\n";
+    machine::write(code, os);
+    stackmap::write(map, os);
+    profile::write_sites(sites, os);
+    if (stubs.code.empty()) return;
+    os << "  .text 1\n";
+    machine::write(stubs.code, os);
+    os << "  .text 0\n";
   }
 
-  void functions (const node & n, std::ostream & os) {
+  void functions (const node & n, settings const & s, buffer & os) {
     for (auto & child : n.children) {
       assert(child->is<grammar::function::define>()
           && "functions: got non-function!");
-      generate::function(*child, os);
+      generate::function(*child, s, os);
     }
     return;
   }
 
-  void program (const node & n, std::ostream & os) {
+  void program (const node & n, settings const & s, buffer & os) {
     assert(n.is<grammar::program::define>() && "top is not a program!");
     assert(n.children.size() == 2);
     const node & entry     = *n.children.at(0);
     const node & functions = *n.children.at(1);
-    os << ".text\n";
-    os << "  .globl go\n";
-    os << "go:\n";
-    os << "  pushq %rbx\n";
-    os << "  pushq %rbp\n";
-    os << "  pushq %r12\n";
-    os << "  pushq %r13\n";
-    os << "  pushq %r14\n";
-    os << "  pushq %r15\n";
-    os << "  call "; generate::label(entry, os); os << "\n";
-    os << "  popq %r15\n";
-    os << "  popq %r14\n";
-    os << "  popq %r13\n";
-    os << "  popq %r12\n";
-    os << "  popq %rbp\n";
-    os << "  popq %rbx\n";
-    os << "  retq\n";
-    return generate::functions(functions, os);
+    os << ".text\n"
+          "  .globl go\n"
+          "go:\n"
+          "  pushq %rbx\n"
+          "  pushq %rbp\n"
+          "  pushq %r12\n"
+          "  pushq %r13\n"
+          "  pushq %r14\n"
+          "  pushq %r15\n";
+    os << make(opcode::call, label(entry));
+    if (s.count_branches) profile::print_taken_branches(os);
+    os << "  popq %r15\n"
+          "  popq %r14\n"
+          "  popq %r13\n"
+          "  popq %r12\n"
+          "  popq %rbp\n"
+          "  popq %rbx\n"
+          "  retq\n";
+    stackmap::begin(os);
+    if (s.allocation_sites) profile::begin_sites(os);
+    generate::functions(functions, s, os);
+    stackmap::end(os);
+    if (s.allocation_sites) profile::end_sites(os);
+    if (s.write_barriers) barrier::mark_program(os);
+    if (s.count_branches) profile::data(os);
   }
 
-  void root (const node & root, std::ostream & os) {
+  void root (const node & root, settings const & s, buffer & os) {
     assert(root.is_root() && "generate: got a non-root node!");
     assert(!root.children.empty() && "generate: got an empty AST!");
     assert(root.children.size() == 1);
-    return generate::program(*root.children.at(0), os);
+    return generate::program(*root.children.at(0), s, os);
   }
 
-  void to_file (std::string file_name, const node & root) {
-    std::ofstream out;
-    out.open(file_name);
-    generate::root(root, out);
-    out.close();
+  void to_fd (int fd, const node & root, settings const & s = {}) {
+    buffer out (fd);
+    generate::root(root, s, out);
+  }
+
+  void to_file (
+    std::string file_name,
+    const node & root,
+    settings const & s = {}
+  ) {
+    int fd = open(file_name.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    assert(fd >= 0 && "generate::to_file: could not open output!");
+    generate::to_fd(fd, root, s);
+    close(fd);
   }
 }
@@ -0,0 +1,193 @@
+// vim: set foldmethod=marker:
+#pragma once
+#include <fcntl.h>
+#include <unistd.h>
+#include <cstdio>
+#include <chrono>
+#include <memory>
+#include <vector>
+#include <string>
+#include <cassert>
+#include <iostream>
+
+#include "tao/pegtl.hpp"
+#include "tao/pegtl/contrib/tracer.hpp"
+
+#include "driver/options.h"
+
+#include "grammar.h"
+#include "codegen.h"
+#include "ast.h"
+
+namespace driver::L1 {
+  namespace peg = tao::pegtl;
+  namespace generate = codegen::L1::generate;
+  using entry = peg::must<grammar::L1::entry>;
+  using node  = ast::L1::node;
+
+  template <typename Input>
+  std::unique_ptr<node> parse (Options & opt, Input & in) {
+    if (opt.print_trace) {
+      ast::L1::parse<
+        entry,
+        ast::L1::filter::selector,
+        peg::nothing,
+        peg::tracer
+      >(in);
+      std::cerr << "Parse trace written. Exiting.\n";
+      exit(-1);
+    }
+    auto root = ast::L1::parse<entry, ast::L1::filter::selector>(in);
+    if (opt.print_ast) { ast::L1::print_node(*root); }
+    return root;
+  }
+
+  // What each optimization pass did, for -r.
+  struct reports {
+    codegen::L1::peephole::report peephole;
+    codegen::L1::layout::report   layout;
+    codegen::L1::encode::report   encode;
+    codegen::L1::barrier::report  barrier;
+    codegen::L1::allocate::report allocate;
+    codegen::L1::stackmap::report stackmap;
+  };
+
+  generate::settings settings (Options & opt, reports & r) {
+    generate::settings s;
+    s.optimization_level = opt.optimization_level;
+    s.count_branches     = opt.count_branches;
+    s.write_barriers     = opt.write_barriers;
+    s.allocation_sites   = opt.allocation_sites;
+    if (opt.print_report) {
+      s.peephole = &r.peephole;
+      s.layout   = &r.layout;
+      s.encode   = &r.encode;
+      s.barrier  = &r.barrier;
+      s.allocate = &r.allocate;
+      s.stackmap = &r.stackmap;
+    }
+    return s;
+  }
+
+  void print_report (Options & opt, reports & r) {
+    if (!opt.print_report) return;
+    if (opt.optimization_level < 1) {
+      std::cerr << "peephole, allocate: off (needs -O1)\n";
+    } else {
+      codegen::L1::peephole::print(r.peephole, std::cerr);
+      codegen::L1::allocate::print(r.allocate, std::cerr);
+    }
+    if (opt.optimization_level < 2) {
+      std::cerr << "layout, encode: off (needs -O2)\n";
+    } else {
+      codegen::L1::layout::print(r.layout, std::cerr);
+      codegen::L1::encode::print(r.encode, std::cerr);
+    }
+    if (opt.write_barriers) codegen::L1::barrier::print(r.barrier, std::cerr);
+    codegen::L1::stackmap::print(r.stackmap, std::cerr);
+  }
+
+  /* NOTE(jordan): `-a prog.o` skips the round trip through prog.S and
+   * hands the assembly straight to the assembler's stdin.
+   */
+  int assemble (
+    Options & opt,
+    node const & root,
+    generate::settings const & s
+  ) {
+    std::string command = "as -o '";
+    command += opt.object_name;
+    command += "' -";
+    FILE * as = popen(command.c_str(), "w");
+    assert(as && "assemble: could not start the assembler!");
+    generate::to_fd(fileno(as), root, s);
+    return pclose(as) == 0 ? 0 : 1;
+  }
+
+  int compile (Options & opt) { // {{{
+    peg::file_input<> in(opt.input_name);
+    auto const root = parse(opt, in);
+    reports report;
+    auto const s = settings(opt, report);
+    int status = 0;
+    if (opt.object_name != nullptr) {
+      status = assemble(opt, *root, s);
+    } else if (strcmp(opt.output_name, "-") == 0) {
+      generate::to_fd(STDOUT_FILENO, *root, s);
+    } else {
+      generate::to_file(opt.output_name, *root, s);
+    }
+    print_report(opt, report);
+    return status;
+  } // }}}
+
+  /*
+   * Codegen throughput: parse every input once, then regenerate all of
+   * them `passes` times into /dev/null. Parsing is not on the clock.
+   */
+  int benchmark (Options & opt) { // {{{
+    struct program {
+      std::unique_ptr<peg::file_input<>> in;
+      std::unique_ptr<node> root;
+    };
+    std::vector<program> programs;
+    int skipped = 0;
+    for (int i = 0; i < opt.input_count; i++) {
+      program p;
+      try {
+        p.in   = std::make_unique<peg::file_input<>>(opt.input_names[i]);
+        p.root = ast::L1::parse<entry, ast::L1::filter::selector>(*p.in);
+      } catch (peg::parse_error const &) {
+        skipped++;
+        continue;
+      }
+      programs.push_back(std::move(p));
+    }
+
+    int sink = open("/dev/null", O_WRONLY);
+    assert(sink >= 0 && "benchmark: could not open /dev/null!");
+    std::size_t bytes = 0;
+    reports report;
+    // NOTE(jordan): only tally the first pass; the rest are identical.
+    auto const first = settings(opt, report);
+    auto rest = first;
+    rest.peephole = nullptr;
+    rest.layout   = nullptr;
+    rest.encode   = nullptr;
+    rest.barrier  = nullptr;
+    rest.allocate = nullptr;
+    rest.stackmap = nullptr;
+    auto start = std::chrono::steady_clock::now();
+    for (int pass = 0; pass < opt.passes; pass++) {
+      for (auto const & p : programs) {
+        codegen::L1::emit::buffer out (sink);
+        generate::root(*p.root, pass == 0 ? first : rest, out);
+        out.flush();
+        bytes += out.bytes();
+      }
+    }
+    auto stop = std::chrono::steady_clock::now();
+    close(sink);
+
+    double seconds = std::chrono::duration<double>(stop - start).count();
+    double megabytes = bytes / (1024.0 * 1024.0);
+    std::cout
+      << "programs: " << programs.size()
+      << " (" << skipped << " skipped)\n"
+      << "passes:   " << opt.passes << "\n"
+      << "asm:      " << bytes / opt.passes << " bytes/pass\n"
+      << "time:     " << seconds << " s\n"
+      << "rate:     " << megabytes / seconds << " MB/s\n";
+    print_report(opt, report);
+    return 0;
+  } // }}}
+
+  int execute (Options & opt) {
+    using Mode = Options::Mode;
+    switch (opt.mode) {
+      case Mode::x86       : return compile(opt);
+      case Mode::benchmark : return benchmark(opt);
+    }
+    assert(false && "execute: unreachable! Mode unrecognized.");
+  }
+}
@@ -0,0 +1,131 @@
+#pragma once
+#include <unistd.h>
+#include <cassert>
+#include <cstdlib>
+#include <cstring>
+
+namespace driver::L1 {
+  struct Options {
+    enum Mode {
+      x86,
+      benchmark,
+    } mode = Mode::x86;
+    bool parsed_mode = false;
+    bool print_trace = false;
+    bool print_ast   = false;
+    // Print what the optimization passes did (to stderr).
+    bool print_report = false;
+    int optimization_level = 0;
+    // Instrument the output to count taken branches (see profile.h)
+    bool count_branches = false;
+    // Emit write barriers, so the runtime can use a nursery (see barrier.h)
+    bool write_barriers = false;
+    // Profile allocations by call site (see profile.h)
+    bool allocation_sites = false;
+    // Where the assembly goes: a file name, or "-" for stdout.
+    char const * output_name = "prog.S";
+    // If set, pipe the assembly into `as -` and write this object file.
+    char const * object_name = nullptr;
+    // Benchmark: how many times to regenerate each program.
+    int passes = 10;
+    char * input_name;
+    char ** input_names;
+    int input_count;
+    static Options argv (int argc, char ** argv);
+  };
+
+  /* NOTE(jordan): just... gross. Not great. Ugh.
+   * You know what? If we can just keep all the gross getopt stuff in this
+   * one place, that's good enough. That's fine. I'll be ok.
+   */
+  void assert_single_mode (Options & opt) {
+    assert(!opt.parsed_mode && "Error: already parsed a mode!");
+    opt.parsed_mode = true;
+  }
+
+  /*
+   * ====================================================================
+   *  Handling CLI Input
+   * ====================================================================
+   *
+   * Same turd as every other compiler in here; same polish.
+   *
+   */
+  Options Options::argv (int argc, char ** argv) {
+    int c;
+    Options opt;
+    while ((c = getopt(argc, argv, "tpbrcGASBo:a:n:O:")) != -1)
+      switch (c) {
+      /*
+       * ----------------------------------------------------------------
+       *  Mode selection
+       * ----------------------------------------------------------------
+       */
+        case 'b':
+          assert_single_mode(opt);
+          opt.mode = Options::Mode::benchmark;
+          break;
+      /*
+       * ----------------------------------------------------------------
+       *  Output selection
+       * ----------------------------------------------------------------
+       */
+        case 'o':
+          opt.output_name = optarg;
+          break;
+        case 'a':
+          opt.object_name = optarg;
+          break;
+        case 'n':
+          opt.passes = atoi(optarg);
+          assert(opt.passes > 0 && "Error: need at least 1 pass!");
+          break;
+      /*
+       * ----------------------------------------------------------------
+       *  Optimization level
+       * ----------------------------------------------------------------
+       */
+        case 'O':
+          opt.optimization_level = atoi(optarg);
+          break;
+        case 'r':
+          opt.print_report = true;
+          break;
+        case 'c':
+          opt.count_branches = true;
+          break;
+        case 'G':
+          opt.write_barriers = true;
+          break;
+        case 'A':
+          opt.allocation_sites = true;
+          break;
+        case 'S':
+          // Stride headers: IR's business. Lc hands it down.
+          break;
+        case 'B':
+          // Bounds checks: likewise.
+          break;
+      /*
+       * ----------------------------------------------------------------
+       *  Debug flags
+       * ----------------------------------------------------------------
+       */
+        case 't':
+          opt.print_trace = true;
+          break;
+        case 'p':
+          opt.print_ast = true;
+          break;
+      }
+    /*
+     * ------------------------------------------------------------------
+     *  Input file name(s) (NOTE: benchmark takes any number of inputs)
+     * ------------------------------------------------------------------
+     */
+    opt.input_name  = argv[optind];
+    opt.input_names = argv + optind;
+    opt.input_count = argc - optind;
+    return opt;
+  }
+}
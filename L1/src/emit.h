@@ -0,0 +1,164 @@
+#pragma once
+#include <unistd.h>
+#include <cerrno>
+#include <cassert>
+#include <cstdint>
+#include <cstring>
+#include <string_view>
+
+#include "register.h"
+
+/*
+ * ======================================================================
+ *  Assembly emitter
+ * ======================================================================
+ *
+ * NOTE(jordan): codegen used to push every token of every instruction
+ * through an std::ofstream, one tiny `<<` at a time, and half of those
+ * tokens were temporary std::strings ("%" + name, "_" + label, ...).
+ * That's a lot of locale-aware, virtual-dispatching machinery to format
+ * what is basically a table lookup.
+ *
+ * So: one flat buffer, flushed with write(2) straight to a descriptor.
+ * The descriptor can be a file, stdout, or the write end of a pipe into
+ * `as -`; the buffer doesn't care. Registers and opcodes are formatted
+ * once, at compile time: opcodes below, registers in register.h.
+ */
+namespace codegen::L1::emit {
+  struct buffer {
+    static constexpr std::size_t capacity = 1 << 16;
+
+    explicit buffer (int fd) : fd(fd) {}
+    ~buffer () { flush(); }
+
+    buffer (buffer const &) = delete;
+    buffer & operator= (buffer const &) = delete;
+
+    void flush () {
+      drain(data, used);
+      used = 0;
+    }
+
+    void append (char const * bytes, std::size_t length) {
+      total += length;
+      if (used + length > capacity) {
+        flush();
+        // Anything bigger than the whole buffer goes straight through.
+        if (length > capacity) return drain(bytes, length);
+      }
+      std::memcpy(data + used, bytes, length);
+      used += length;
+    }
+
+    buffer & operator<< (std::string_view text) {
+      append(text.data(), text.size());
+      return *this;
+    }
+
+    buffer & operator<< (char c) {
+      if (used == capacity) flush();
+      data[used++] = c;
+      total++;
+      return *this;
+    }
+
+    buffer & operator<< (int64_t value) {
+      // Format backwards into a scratch array; 20 digits + sign is plenty
+      char scratch[24];
+      char * end    = scratch + sizeof(scratch);
+      char * cursor = end;
+      uint64_t magnitude = value < 0
+        ? ~static_cast<uint64_t>(value) + 1
+        : static_cast<uint64_t>(value);
+      do {
+        *--cursor = '0' + (magnitude % 10);
+        magnitude /= 10;
+      } while (magnitude > 0);
+      if (value < 0) *--cursor = '-';
+      append(cursor, end - cursor);
+      return *this;
+    }
+
+    buffer & operator<< (int value) {
+      return *this << static_cast<int64_t>(value);
+    }
+
+    // Bytes produced so far, flushed or not.
+    std::size_t bytes () const { return total; }
+
+    private:
+      void drain (char const * cursor, std::size_t remaining) {
+        while (remaining > 0) {
+          ssize_t count = ::write(fd, cursor, remaining);
+          if (count < 0 && errno == EINTR) continue;
+          assert(count > 0 && "emit::buffer: write failed!");
+          cursor    += count;
+          remaining -= count;
+        }
+      }
+
+      int fd;
+      std::size_t used  = 0;
+      std::size_t total = 0;
+      char data[capacity];
+  };
+}
+
+/*
+ * ----------------------------------------------------------------------
+ *  Preformatted operands & opcodes
+ * ----------------------------------------------------------------------
+ */
+namespace codegen::L1::emit {
+  inline buffer & operator<< (buffer & os, x86_64::Register r) {
+    return os << x86_64::gas(r);
+  }
+
+  // Mnemonics, pre-indented and pre-spaced: "  movq "
+  enum class op {
+    movq, movzbq, lea, addq, subq, imulq, andq, salq, sarq, inc, dec,
+    cmpq, sete, setl, setle, setg, setge, je, jne, jl, jle, jg, jge,
+    jmp, call, ret,
+    // Unsigned comparisons (<u, <=u)
+    setb, setbe, seta, setae, jb, jbe, ja, jae,
+    // Short forms; only picked by encoding selection (encode.h)
+    movl, xorl, testq,
+    // Only in inline allocation (allocate.h)
+    jnc, rep_stosq,
+    // Only in write barriers (barrier.h)
+    shrq, movb,
+    // Align a hot loop header; pads with at most 10 bytes of nops.
+    p2align,
+    // NOTE(jordan): not an opcode; a label definition. No mnemonic.
+    label,
+  };
+
+  constexpr std::string_view mnemonics [] = {
+    "  movq "  , "  movzbq ", "  lea "  , "  addq " , "  subq ",
+    "  imulq " , "  andq "  , "  salq " , "  sarq " , "  inc " ,
+    "  dec "   , "  cmpq "  , "  sete " , "  setl " , "  setle ",
+    "  setg "  , "  setge " , "  je "   , "  jne "  , "  jl "  ,
+    "  jle "   , "  jg "    , "  jge "  , "  jmp "  , "  call ",
+    "  ret"    ,
+    "  setb "  , "  setbe " , "  seta " , "  setae ", "  jb "  ,
+    "  jbe "   , "  ja "    , "  jae "  ,
+    "  movl "  , "  xorl "  , "  testq ",
+    "  jnc "   , "  rep stosq",
+    "  shrq "  , "  movb "  ,
+    "  .p2align 4,,10",
+    ""         ,
+  };
+
+  static_assert(
+    sizeof(mnemonics) / sizeof(*mnemonics) == static_cast<int>(op::label) + 1,
+    "emit::mnemonics: one per opcode!"
+  );
+
+  constexpr std::string_view mnemonic (op o) {
+    return mnemonics[static_cast<int>(o)];
+  }
+
+  inline buffer & operator<< (buffer & os, op o) {
+    return os << mnemonic(o);
+  }
+}
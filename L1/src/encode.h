@@ -0,0 +1,157 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <iomanip>
+#include <ostream>
+#include <utility>
+#include <string_view>
+
+#include "machine.h"
+
+/*
+ * ======================================================================
+ *  Encoding selection
+ * ======================================================================
+ *
+ * NOTE(jordan): codegen always reaches for the 64-bit form of everything.
+ * The assembler already shrinks displacements and add/sub/cmp immediates
+ * to 8 bits when it can, but it won't swap one instruction for another.
+ * That's this pass: same effect on every register that's live after, in
+ * fewer bytes (or fewer instructions).
+ *
+ *   movq $0, %rax                 xorl %eax, %eax            7 => 2
+ *   movq $42, %rax                movl $42, %eax             7 => 5
+ *   movq $_label, %rax            movl $_label, %eax         7 => 5
+ *   cmpq $0, %rax                 testq %rax, %rax           4 => 3
+ *   movq %rsi, %rax; addq $8, %rax    lea 8(%rsi), %rax      7 => 4
+ *   movq %rsi, %rax; addq %rdi, %rax  lea (%rsi, %rdi, 1), %rax
+ *
+ * 32-bit writes zero the upper half, so movl is only for values that are
+ * already non-negative 32-bit numbers. Labels count: we link -no-pie, so
+ * every code address fits. xor and lea disagree with movq/addq about the
+ * flags; that only matters if a flag reader comes next (see machine.h).
+ */
+namespace codegen::L1::encode {
+  using namespace machine;
+
+  enum struct Rule : uint8_t {
+    zero_idiom,   // movq $0, %r             => xorl %e, %e
+    move_imm32,   // movq $imm, %r           => movl $imm, %e
+    move_label32, // movq $_label, %r        => movl $_label, %e
+    test_zero,    // cmpq $0, %r             => testq %r, %r
+    lea_add,      // movq %a, %d; addq x, %d => lea x(%a), %d
+    count,
+  };
+
+  constexpr int rule_count = static_cast<int>(Rule::count);
+
+  constexpr std::string_view rule_names [] = {
+    "zero_idiom", "move_imm32", "move_label32", "test_zero", "lea_add",
+  };
+
+  struct report {
+    std::size_t selected [rule_count] = {};
+  };
+
+  inline void print (report const & r, std::ostream & os) {
+    os << "encode:\n";
+    os << "  " << std::left << std::setw(18) << "rule"
+       << std::right << std::setw(12) << "selected" << "\n";
+    for (int rule = 0; rule < rule_count; rule++)
+      os << "  " << std::left << std::setw(18) << rule_names[rule]
+         << std::right << std::setw(12) << r.selected[rule] << "\n";
+  }
+}
+
+namespace codegen::L1::encode {
+  namespace helper {
+    inline bool fits_u32 (int64_t value) {
+      return value >= 0 && value <= int64_t(UINT32_MAX);
+    }
+    inline bool fits_s32 (int64_t value) {
+      return value >= INT32_MIN && value <= INT32_MAX;
+    }
+    // Is it ok to clobber the flags right after `at`?
+    inline bool flags_dead (instructions const & code, std::size_t at) {
+      return at + 1 >= code.size() || !reads_flags(code[at + 1]);
+    }
+  }
+
+  inline void run (instructions & code, report * r = nullptr) {
+    using Kind = operand::Kind;
+    report scratch;
+    report & tally = r ? *r : scratch;
+    auto select = [&] (Rule rule) {
+      tally.selected[static_cast<int>(rule)]++;
+    };
+
+    instructions out;
+    out.reserve(code.size());
+    for (std::size_t i = 0; i < code.size(); i++) {
+      instruction const & here = code[i];
+
+      if (here.code == op::movq && here.dst.is(Kind::reg)) {
+        Register dst = here.dst.base;
+        operand  e   = operand::reg32(dst);
+        if (here.src.is(Kind::immediate) && here.src.value == 0
+            && helper::flags_dead(code, i)) {
+          out.push_back(make(op::xorl, e, e));
+          select(Rule::zero_idiom);
+          continue;
+        }
+        if (here.src.is(Kind::immediate) && helper::fits_u32(here.src.value)) {
+          out.push_back(make(op::movl, here.src, e));
+          select(Rule::move_imm32);
+          continue;
+        }
+        if (here.src.is(Kind::label_value)) {
+          out.push_back(make(op::movl, here.src, e));
+          select(Rule::move_label32);
+          continue;
+        }
+      }
+
+      if (here.code == op::cmpq && here.dst.is(Kind::reg)
+          && here.src.is(Kind::immediate) && here.src.value == 0) {
+        out.push_back(make(op::testq, here.dst, here.dst));
+        select(Rule::test_zero);
+        continue;
+      }
+
+      // movq %a, %d; {add,sub}q x, %d  =>  lea
+      if (here.code == op::movq
+          && here.src.is(Kind::reg) && here.dst.is(Kind::reg)
+          && here.src != here.dst
+          && i + 1 < code.size() && helper::flags_dead(code, i + 1)) {
+        instruction const & next = code[i + 1];
+        Register a = here.src.base;
+        Register d = here.dst.base;
+        bool updates_d = next.dst.is_reg(d);
+        bool add = next.code == op::addq && updates_d;
+        bool sub = next.code == op::subq && updates_d;
+        Register b = next.src.base;
+        // NOTE(jordan): rsp can be a base, but never an index.
+        if (b == Register::rsp) std::swap(a, b);
+        if (add && next.src.is(Kind::reg) && b != d && b != Register::rsp) {
+          operand sum = operand::address(a, b, 1);
+          out.push_back(make(op::lea, sum, here.dst));
+          select(Rule::lea_add);
+          i++;
+          continue;
+        }
+        if ((add || sub) && next.src.is(Kind::immediate)) {
+          int64_t offset = add ? next.src.value : -next.src.value;
+          if (helper::fits_s32(offset) && helper::fits_s32(next.src.value)) {
+            out.push_back(make(op::lea, operand::memory(a, offset), here.dst));
+            select(Rule::lea_add);
+            i++;
+            continue;
+          }
+        }
+      }
+
+      out.push_back(here);
+    }
+    code.swap(out);
+  }
+}
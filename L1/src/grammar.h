@@ -186,9 +186,12 @@ namespace grammar::L1 {
     struct less       : util::a<'<'> {};
     struct equal      : util::a<'='> {};
     struct less_equal : TAO_PEGTL_STRING("<=") {};
+    // Unsigned: -1 <u 0 doesn't hold. One compare for `0 <= x < n`.
+    struct below       : TAO_PEGTL_STRING("<u") {};
+    struct below_equal : TAO_PEGTL_STRING("<=u") {};
     // NOTE: order MATTERS!
-    // cmp ::= < | <= | =
-    struct any : peg::sor<less_equal, less, equal> {};
+    // cmp ::= < | <= | = | <u | <=u
+    struct any : peg::sor<below_equal, less_equal, below, less, equal> {};
   }
 
   // Shift <sop>
@@ -234,6 +237,8 @@ namespace grammar::L1 {
     using decrement   = unary::arithmetic::decrement;
     using address_at  = quaternary::address::at;
     using less_equal  = binary::comparison::less_equal;
+    using below       = binary::comparison::below;
+    using below_equal = binary::comparison::below_equal;
     using shift_left  = binary::shift::left;
     using bitwise_and = binary::arithmetic::bitwise_and;
     using shift_right = binary::shift::right;
@@ -0,0 +1,289 @@
+#pragma once
+#include <cmath>
+#include <vector>
+#include <cstddef>
+#include <cstdint>
+#include <iomanip>
+#include <ostream>
+#include <algorithm>
+#include <string_view>
+#include <unordered_map>
+
+#include "machine.h"
+
+/*
+ * ======================================================================
+ *  Block layout
+ * ======================================================================
+ *
+ * NOTE(jordan): blocks come out in source order, which is whatever order
+ * the L3 tiler (and everything above it) felt like. Loops end up with the
+ * test at the top, the body somewhere below, and a `jmp` back up; if
+ * statements jump over each other. Every taken branch costs a redirect.
+ *
+ * This is Pettis & Hansen's bottom-up chaining, without a profile:
+ *
+ *   1. Cut the function at every label. Each piece is a region.
+ *   2. Weigh every CFG edge. We don't have counts, so we guess: an edge
+ *      is worth 8^(loop depth), split evenly among a region's exits.
+ *      Loops are found the cheap way: a jump backwards (in source order)
+ *      makes everything between target and source one level deeper.
+ *   3. Heaviest edge first, glue source-chain's tail to target-chain's
+ *      head, so that edge becomes a fall-through.
+ *   4. Lay out the chains: entry first, then whichever chain the placed
+ *      code jumps to the most.
+ *   5. Patch up the ends of regions: drop jumps to the next region, flip
+ *      `jcc; jmp` pairs whose jcc now falls through, and add a `jmp`
+ *      where a region used to fall through and doesn't anymore.
+ *
+ * Loop headers (reached by a backward jump in the new order) that nothing
+ * falls into get a `.p2align`: the padding is never executed, and the
+ * loop starts on a fresh fetch block.
+ *
+ * Runs after the peephole pass, on one function at a time. We only move
+ * code around label boundaries, so nothing about the instructions inside
+ * a region changes.
+ */
+namespace codegen::L1::layout {
+  using namespace machine;
+
+  struct report {
+    std::size_t functions = 0;
+    std::size_t regions   = 0;
+    std::size_t moved     = 0; // regions not in their original spot
+    std::size_t inverted  = 0; // jcc senses flipped to fall through
+    std::size_t dropped   = 0; // jumps no longer needed
+    std::size_t added     = 0; // jumps needed for a lost fall-through
+    std::size_t aligned   = 0; // loop headers given a .p2align
+  };
+
+  inline void print (report const & r, std::ostream & os) {
+    auto row = [&] (char const * name, std::size_t value) {
+      os << "  " << std::left << std::setw(18) << name
+         << std::right << std::setw(12) << value << "\n";
+    };
+    os << "layout:\n";
+    row("functions", r.functions);
+    row("regions",   r.regions);
+    row("moved",     r.moved);
+    row("inverted",  r.inverted);
+    row("dropped",   r.dropped);
+    row("added",     r.added);
+    row("aligned",   r.aligned);
+  }
+}
+
+namespace codegen::L1::layout {
+  struct region {
+    std::size_t begin = 0; // [begin, end) in the function's code
+    std::size_t end   = 0;
+    bool falls_through = false;
+    int depth = 0;
+    int chain = -1;
+  };
+
+  struct edge {
+    int from;
+    int to;
+    bool jump; // an actual jump, rather than a fall-through or a return
+    double weight = 0;
+  };
+
+  struct graph {
+    std::vector<region> regions;
+    std::vector<edge>   edges;
+    // Label name => index of the region it starts
+    std::unordered_map<std::string_view, int> region_of;
+  };
+
+  namespace helper {
+    inline int target (graph const & g, instruction const & i) {
+      if (!is_direct_jump(i)) return -1;
+      auto found = g.region_of.find(i.dst.name);
+      return found == g.region_of.end() ? -1 : found->second;
+    }
+    inline bool leaves_function (graph const & g, instruction const & i) {
+      return i.code == op::jmp && target(g, i) == -1;
+    }
+  }
+
+  inline graph build (instructions const & code) {
+    graph g;
+    for (std::size_t i = 0; i < code.size(); i++) {
+      if (i == 0 || is_label(code[i])) {
+        if (!g.regions.empty()) g.regions.back().end = i;
+        g.regions.push_back({ i, code.size() });
+        if (is_label(code[i]))
+          g.region_of[code[i].dst.name] = int(g.regions.size()) - 1;
+      }
+    }
+
+    int count = int(g.regions.size());
+    for (int r = 0; r < count; r++) {
+      region & here = g.regions[r];
+      bool exits = here.begin < here.end
+        && is_unconditional_exit(code[here.end - 1]);
+      here.falls_through = !exits;
+      for (std::size_t i = here.begin; i < here.end; i++) {
+        int to = helper::target(g, code[i]);
+        if (to != -1) g.edges.push_back({ r, to, true });
+      }
+      if (r + 1 >= count) continue;
+      /* NOTE(jordan): an L1 call is `subq; jmp _f` and the return label
+       * comes next. We don't see the ret, but it lands right after us.
+       */
+      bool calls = exits && helper::leaves_function(g, code[here.end - 1]);
+      if (here.falls_through || calls)
+        g.edges.push_back({ r, r + 1, false });
+    }
+
+    // Backward edges in source order delimit loops.
+    for (auto const & e : g.edges)
+      if (e.to <= e.from)
+        for (int r = e.to; r <= e.from; r++) g.regions[r].depth++;
+
+    std::vector<int> exits (count, 0);
+    for (auto const & e : g.edges) exits[e.from]++;
+    for (auto & e : g.edges) {
+      int depth = std::min(g.regions[e.from].depth, g.regions[e.to].depth);
+      e.weight = std::pow(8.0, std::min(depth, 8)) / exits[e.from];
+    }
+    return g;
+  }
+
+  /* Chain regions together along the heaviest edges, then order chains.
+   * Returns region indices in layout order. Region 0 (the entry) is first.
+   */
+  inline std::vector<int> order (graph & g) {
+    int count = int(g.regions.size());
+    std::vector<std::vector<int>> chains (count);
+    for (int r = 0; r < count; r++) {
+      chains[r] = { r };
+      g.regions[r].chain = r;
+    }
+
+    std::vector<edge> by_weight = g.edges;
+    std::stable_sort(by_weight.begin(), by_weight.end(),
+      [] (edge const & a, edge const & b) { return a.weight > b.weight; });
+    for (auto const & e : by_weight) {
+      if (e.to == 0 || e.from == e.to) continue; // entry stays a head
+      int a = g.regions[e.from].chain;
+      int b = g.regions[e.to].chain;
+      if (a == b) continue;
+      if (chains[a].back() != e.from || chains[b].front() != e.to) continue;
+      for (int r : chains[b]) {
+        chains[a].push_back(r);
+        g.regions[r].chain = a;
+      }
+      chains[b].clear();
+    }
+
+    std::vector<std::vector<edge const *>> out (count);
+    for (auto const & e : g.edges) out[e.from].push_back(&e);
+
+    std::vector<int> layout;
+    layout.reserve(count);
+    std::vector<bool> placed (count, false);
+    // How much already-placed code jumps into each chain
+    std::vector<double> pull (count, 0);
+    auto place = [&] (int c) {
+      placed[c] = true;
+      for (int r : chains[c]) {
+        layout.push_back(r);
+        for (edge const * e : out[r])
+          pull[g.regions[e->to].chain] += e->weight;
+      }
+    };
+    place(g.regions[0].chain);
+    for (;;) {
+      int best = -1;
+      for (int c = 0; c < count; c++) {
+        if (placed[c] || chains[c].empty()) continue;
+        if (best == -1 || pull[c] > pull[best]) best = c;
+      }
+      if (best == -1) break;
+      place(best);
+    }
+    return layout;
+  }
+
+  inline void run (instructions & code, report * r = nullptr) {
+    report scratch;
+    report & tally = r ? *r : scratch;
+    if (code.empty()) return;
+    graph g = build(code);
+    int count = int(g.regions.size());
+    tally.functions++;
+    tally.regions += count;
+    // NOTE(jordan): falling off the end of a function lands in the next
+    // one. Nothing we can patch with a jmp; leave it be.
+    if (g.regions.back().falls_through) return;
+
+    std::vector<int> layout = order(g);
+    std::vector<int> position (count);
+    for (int p = 0; p < count; p++) position[layout[p]] = p;
+
+    // Loop headers: something placed at or after them jumps back.
+    std::vector<bool> header (count, false);
+    for (auto const & e : g.edges)
+      if (e.jump && position[e.from] >= position[e.to]) header[e.to] = true;
+
+    instructions out;
+    out.reserve(code.size() + count);
+    for (int p = 0; p < count; p++) {
+      int here = layout[p];
+      int next = p + 1 < count ? layout[p + 1] : -1;
+      region const & region = g.regions[here];
+      if (p != here) tally.moved++;
+
+      bool fallen_into = !out.empty() && !is_unconditional_exit(out.back());
+      if (header[here] && !fallen_into && p > 0) {
+        out.push_back(make(op::p2align));
+        tally.aligned++;
+      }
+
+      out.insert(
+        out.end(),
+        code.begin() + region.begin,
+        code.begin() + region.end
+      );
+
+      if (region.falls_through) {
+        int follower = here + 1;
+        if (follower == next) continue;
+        operand follower_label = code[g.regions[follower].begin].dst;
+        instruction & last = out.back();
+        // jcc next  =>  j!cc follower
+        if (region.begin < region.end && is_conditional_jump(last.code)
+            && helper::target(g, last) == next && next != -1) {
+          last = make(invert(last.code), follower_label);
+          tally.inverted++;
+          continue;
+        }
+        out.push_back(make(op::jmp, follower_label));
+        tally.added++;
+        continue;
+      }
+
+      instruction const & last = out.back();
+      if (last.code != op::jmp || helper::target(g, last) == -1) continue;
+      if (helper::target(g, last) == next) {
+        out.pop_back();
+        tally.dropped++;
+        continue;
+      }
+      // jcc next; jmp X  =>  j!cc X
+      if (region.end - region.begin >= 2) {
+        instruction & before = out[out.size() - 2];
+        if (is_conditional_jump(before.code)
+            && helper::target(g, before) == next) {
+          before = make(invert(before.code), last.dst);
+          out.pop_back();
+          tally.inverted++;
+          tally.dropped++;
+        }
+      }
+    }
+    code.swap(out);
+  }
+}
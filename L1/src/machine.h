@@ -0,0 +1,252 @@
+#pragma once
+#include <vector>
+#include <cassert>
+#include <cstdint>
+#include <string_view>
+
+#include "register.h"
+#include "emit.h"
+
+/*
+ * ======================================================================
+ *  Machine instructions
+ * ======================================================================
+ *
+ * NOTE(jordan): the thinnest possible layer between the L1 AST and text.
+ * Codegen fills a list of these per function; passes (peephole, ...) get
+ * to look at real x86 instead of re-parsing strings; emission prints
+ * them. An operand is a tagged bag of registers + an integer + a name;
+ * names are views into the parsed input, so nothing here allocates.
+ */
+namespace codegen::L1::machine {
+  using Register = x86_64::Register;
+  using op = emit::op;
+
+  struct operand {
+    enum struct Kind : uint8_t {
+      none,
+      reg,        // %rax
+      reg8,       // %al
+      reg32,      // %eax
+      immediate,  // $42
+      label_value,// $_label
+      memory,     // 8(%rsp)
+      address,    // (%rax, %rbx, 8)
+      label,      // _label
+      symbol,     // print (runtime functions: no underscore)
+      indirect,   // *%rax
+      local,      // .Lname_42 (assembler-local; never collides with L1)
+      rip,        // .Lname(%rip)
+      global,     // name(%rip) (runtime data)
+    } kind = Kind::none;
+    Register base  = Register::none;
+    Register index = Register::none;
+    int64_t value  = 0; // immediate; memory offset; address scale
+    std::string_view name;
+
+    static operand reg (Register r) {
+      operand o; o.kind = Kind::reg; o.base = r; return o;
+    }
+    static operand reg8 (Register r) {
+      operand o; o.kind = Kind::reg8; o.base = r; return o;
+    }
+    static operand reg32 (Register r) {
+      operand o; o.kind = Kind::reg32; o.base = r; return o;
+    }
+    static operand immediate (int64_t value) {
+      operand o; o.kind = Kind::immediate; o.value = value; return o;
+    }
+    static operand label_value (std::string_view name) {
+      operand o; o.kind = Kind::label_value; o.name = name; return o;
+    }
+    static operand memory (Register base, int64_t offset) {
+      operand o; o.kind = Kind::memory; o.base = base; o.value = offset;
+      return o;
+    }
+    static operand address (Register base, Register index, int64_t scale) {
+      operand o; o.kind = Kind::address;
+      o.base = base; o.index = index; o.value = scale;
+      return o;
+    }
+    static operand label (std::string_view name) {
+      operand o; o.kind = Kind::label; o.name = name; return o;
+    }
+    static operand symbol (std::string_view name) {
+      operand o; o.kind = Kind::symbol; o.name = name; return o;
+    }
+    static operand indirect (Register r) {
+      operand o; o.kind = Kind::indirect; o.base = r; return o;
+    }
+    static operand local (std::string_view name, int64_t number) {
+      operand o; o.kind = Kind::local; o.name = name; o.value = number;
+      return o;
+    }
+    static operand rip (std::string_view name) {
+      operand o; o.kind = Kind::rip; o.name = name; return o;
+    }
+    static operand global (std::string_view name) {
+      operand o; o.kind = Kind::global; o.name = name; return o;
+    }
+
+    bool is (Kind k) const { return kind == k; }
+    bool is_reg (Register r) const { return kind == Kind::reg && base == r; }
+  };
+
+  inline bool operator== (operand const & a, operand const & b) {
+    return a.kind  == b.kind
+        && a.base  == b.base
+        && a.index == b.index
+        && a.value == b.value
+        && a.name  == b.name;
+  }
+  inline bool operator!= (operand const & a, operand const & b) {
+    return !(a == b);
+  }
+
+  /* NOTE(jordan): AT&T order, because that's how we print: `op src, dst`.
+   * One-operand instructions only use `dst`; `ret` uses neither.
+   */
+  struct instruction {
+    op code;
+    operand src;
+    operand dst;
+  };
+
+  using instructions = std::vector<instruction>;
+
+  inline instruction make (op code) {
+    return { code, {}, {} };
+  }
+  inline instruction make (op code, operand dst) {
+    return { code, {}, dst };
+  }
+  inline instruction make (op code, operand src, operand dst) {
+    return { code, src, dst };
+  }
+  inline instruction define_label (std::string_view name) {
+    return make(op::label, operand::label(name));
+  }
+  inline instruction define_label (operand const & label) {
+    return make(op::label, label);
+  }
+
+  /* NOTE(jordan): code that goes in `.text 1`, after all the real code.
+   * Its labels are assembler-locals named after the function; passes that
+   * add code out here share the numbering, so they never collide.
+   */
+  struct out_of_line {
+    std::string_view function;
+    instructions code = {};
+    int64_t labels = 0;
+
+    operand fresh () { return operand::local(function, labels++); }
+  };
+}
+
+/*
+ * ----------------------------------------------------------------------
+ *  Predicates
+ * ----------------------------------------------------------------------
+ */
+namespace codegen::L1::machine {
+  inline bool is_label (instruction const & i) {
+    return i.code == op::label;
+  }
+  inline bool is_conditional_jump (op code) {
+    switch (code) {
+      case op::je: case op::jne: case op::jl: case op::jle:
+      case op::jg: case op::jge:
+      case op::jb: case op::jbe: case op::ja: case op::jae:
+        return true;
+      default:
+        return false;
+    }
+  }
+  // Jumps to a label we can see (not `jmp *%rax`)
+  inline bool is_direct_jump (instruction const & i) {
+    return (i.code == op::jmp || is_conditional_jump(i.code))
+      && i.dst.is(operand::Kind::label);
+  }
+  inline bool is_set (op code) {
+    switch (code) {
+      case op::sete: case op::setl: case op::setle:
+      case op::setg: case op::setge:
+      case op::setb: case op::setbe: case op::seta: case op::setae:
+        return true;
+      default:
+        return false;
+    }
+  }
+  /* NOTE(jordan): codegen only ever puts a flag reader right after the
+   * cmpq that feeds it; flags are never live across L1 instructions.
+   */
+  inline bool reads_flags (instruction const & i) {
+    return is_conditional_jump(i.code) || is_set(i.code);
+  }
+  // After these, control never reaches the next instruction.
+  inline bool is_unconditional_exit (instruction const & i) {
+    return i.code == op::jmp || i.code == op::ret;
+  }
+  inline op invert (op code) {
+    switch (code) {
+      case op::je : return op::jne;
+      case op::jne: return op::je;
+      case op::jl : return op::jge;
+      case op::jge: return op::jl;
+      case op::jle: return op::jg;
+      case op::jg : return op::jle;
+      case op::jb : return op::jae;
+      case op::jae: return op::jb;
+      case op::jbe: return op::ja;
+      case op::ja : return op::jbe;
+      default: assert(false && "machine::invert: not a conditional jump!");
+    }
+  }
+}
+
+/*
+ * ----------------------------------------------------------------------
+ *  Emission
+ * ----------------------------------------------------------------------
+ */
+namespace codegen::L1::machine {
+  inline emit::buffer & operator<< (emit::buffer & os, operand const & o) {
+    using Kind = operand::Kind;
+    switch (o.kind) {
+      case Kind::reg         : return os << x86_64::gas(o.base);
+      case Kind::reg8        : return os << x86_64::gas8(o.base);
+      case Kind::reg32       : return os << x86_64::gas32(o.base);
+      case Kind::immediate   : return os << '$' << o.value;
+      case Kind::label_value : return os << "$_" << o.name;
+      case Kind::memory      :
+        return os << o.value << '(' << x86_64::gas(o.base) << ')';
+      case Kind::address     :
+        return os
+          << '('  << x86_64::gas(o.base)
+          << ", " << x86_64::gas(o.index)
+          << ", " << o.value
+          << ')';
+      case Kind::label       : return os << '_' << o.name;
+      case Kind::symbol      : return os << o.name;
+      case Kind::indirect    : return os << '*' << x86_64::gas(o.base);
+      case Kind::local       :
+        return os << ".L" << o.name << '_' << o.value;
+      case Kind::rip         : return os << ".L" << o.name << "(%rip)";
+      case Kind::global      : return os << o.name << "(%rip)";
+      case Kind::none        : break;
+    }
+    assert(false && "machine::operand: cannot print an empty operand!");
+  }
+
+  inline emit::buffer & operator<< (emit::buffer & os, instruction const & i) {
+    if (i.code == op::label) return os << "  " << i.dst << ":\n";
+    os << i.code;
+    if (!i.src.is(operand::Kind::none)) os << i.src << ", ";
+    if (!i.dst.is(operand::Kind::none)) os << i.dst;
+    return os << '\n';
+  }
+
+  inline void write (instructions const & code, emit::buffer & os) {
+    for (auto const & i : code) os << i;
+  }
+}
@@ -0,0 +1,197 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <iomanip>
+#include <ostream>
+#include <string_view>
+
+#include "machine.h"
+
+/*
+ * ======================================================================
+ *  Peephole optimization
+ * ======================================================================
+ *
+ * NOTE(jordan): L1 is a very literal language, and the compilers above
+ * it are not subtle. Codegen faithfully emits whatever it is given, so:
+ *
+ *   cjump rax < 1 :then :else     jl _then; jmp _else   (else is next!)
+ *   rdi <- rdi                    movq %rdi, %rdi       (after coloring)
+ *   mem rsp -8 <- rdi             movq %rdi, -8(%rsp)
+ *   rsi <- mem rsp -8             movq -8(%rsp), %rsi   (just stored it)
+ *
+ * This pass looks at a function's worth of machine instructions through a
+ * two-instruction window (plus any labels in between) and cleans up.
+ * Every rewrite is local and obviously safe; it repeats until nothing
+ * changes, since one cleanup tends to expose the next.
+ */
+namespace codegen::L1::peephole {
+  using namespace machine;
+
+  enum struct Pattern : uint8_t {
+    self_move,        // movq %r, %r
+    jump_to_next,     // jmp L; L:
+    branch_over_jump, // jcc A; jmp B; A:   =>   j!cc B; A:
+    unreachable,      // jmp/ret; <anything but a label>
+    load_after_store, // movq x, M; movq M, %r   =>   movq x, M; movq x, %r
+    store_after_load, // movq M, %r; movq %r, M  =>   movq M, %r
+    count,
+  };
+
+  constexpr int pattern_count = static_cast<int>(Pattern::count);
+
+  constexpr std::string_view pattern_names [] = {
+    "self_move", "jump_to_next", "branch_over_jump", "unreachable",
+    "load_after_store", "store_after_load",
+  };
+
+  /* NOTE(jordan): "eliminated" means the instruction is gone. "rewritten"
+   * means something cheaper took its place (e.g. a load became a move).
+   */
+  struct report {
+    std::size_t functions    = 0;
+    std::size_t instructions = 0; // before the pass
+    std::size_t eliminated [pattern_count] = {};
+    std::size_t rewritten  [pattern_count] = {};
+
+    std::size_t total_eliminated () const {
+      std::size_t total = 0;
+      for (auto count : eliminated) total += count;
+      return total;
+    }
+  };
+
+  inline void print (report const & r, std::ostream & os) {
+    os << "peephole: " << r.functions << " functions, "
+       << r.instructions << " instructions\n";
+    os << "  " << std::left << std::setw(18) << "pattern"
+       << std::right << std::setw(12) << "eliminated"
+       << std::setw(12) << "rewritten" << "\n";
+    for (int p = 0; p < pattern_count; p++)
+      os << "  " << std::left << std::setw(18) << pattern_names[p]
+         << std::right << std::setw(12) << r.eliminated[p]
+         << std::setw(12) << r.rewritten[p] << "\n";
+    os << "  " << std::left << std::setw(18) << "total"
+       << std::right << std::setw(12) << r.total_eliminated() << "\n";
+  }
+}
+
+namespace codegen::L1::peephole {
+  namespace helper {
+    // Is `target` defined at `at`, possibly after some other labels?
+    inline bool falls_through_to (
+      instructions const & code,
+      std::size_t at,
+      operand const & target
+    ) {
+      for (; at < code.size() && is_label(code[at]); at++)
+        if (code[at].dst == target) return true;
+      return false;
+    }
+    inline bool is_move (
+      instruction const & i,
+      operand::Kind src,
+      operand::Kind dst
+    ) {
+      return i.code == op::movq && i.src.is(src) && i.dst.is(dst);
+    }
+  }
+
+  /* NOTE(jordan): one sweep. Reads `code`, writes the survivors to `out`.
+   * Returns whether anything changed.
+   */
+  inline bool sweep (
+    instructions const & code,
+    instructions & out,
+    report & r
+  ) {
+    using Kind = operand::Kind;
+    bool changed = false;
+    auto eliminate = [&] (Pattern p, std::size_t n = 1) {
+      r.eliminated[static_cast<int>(p)] += n;
+      changed = true;
+    };
+    auto rewrite = [&] (Pattern p) {
+      r.rewritten[static_cast<int>(p)]++;
+      changed = true;
+    };
+
+    out.clear();
+    for (std::size_t i = 0; i < code.size(); i++) {
+      instruction const & here = code[i];
+      bool has_next = i + 1 < code.size();
+
+      // Nothing falls into this, and it isn't a label. Nobody can reach it.
+      bool after_exit = !out.empty() && is_unconditional_exit(out.back());
+      if (after_exit && !is_label(here)) {
+        eliminate(Pattern::unreachable);
+        continue;
+      }
+
+      if (helper::is_move(here, Kind::reg, Kind::reg) && here.src == here.dst) {
+        eliminate(Pattern::self_move);
+        continue;
+      }
+
+      bool direct = is_direct_jump(here);
+      if (direct && helper::falls_through_to(code, i + 1, here.dst)) {
+        eliminate(Pattern::jump_to_next);
+        continue;
+      }
+
+      if (direct && is_conditional_jump(here.code) && has_next) {
+        instruction const & next = code[i + 1];
+        if (next.code == op::jmp && is_direct_jump(next)
+            && helper::falls_through_to(code, i + 2, here.dst)) {
+          out.push_back(make(invert(here.code), next.dst));
+          eliminate(Pattern::branch_over_jump);
+          i++;
+          continue;
+        }
+      }
+
+      if (here.code == op::movq && here.dst.is(Kind::memory) && has_next) {
+        instruction const & next = code[i + 1];
+        bool load = helper::is_move(next, Kind::memory, Kind::reg);
+        if (load && next.src == here.dst) {
+          out.push_back(here);
+          // Whatever we stored is what we'd load; use it directly.
+          if (here.src == next.dst) {
+            eliminate(Pattern::load_after_store);
+          } else {
+            out.push_back(make(op::movq, here.src, next.dst));
+            rewrite(Pattern::load_after_store);
+          }
+          i++;
+          continue;
+        }
+      }
+
+      if (helper::is_move(here, Kind::memory, Kind::reg) && has_next) {
+        instruction const & next = code[i + 1];
+        // NOTE(jordan): if the load clobbered its own base, M moved.
+        bool same_place = !here.dst.is_reg(here.src.base);
+        if (same_place && next.code == op::movq
+            && next.src == here.dst && next.dst == here.src) {
+          out.push_back(here);
+          eliminate(Pattern::store_after_load);
+          i++;
+          continue;
+        }
+      }
+
+      out.push_back(here);
+    }
+    return changed;
+  }
+
+  inline void run (instructions & code, report * r = nullptr) {
+    report scratch;
+    report & tally = r ? *r : scratch;
+    tally.functions++;
+    tally.instructions += code.size();
+    instructions out;
+    out.reserve(code.size());
+    while (sweep(code, out, tally)) code.swap(out);
+  }
+}
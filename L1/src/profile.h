@@ -0,0 +1,211 @@
+#pragma once
+#include <deque>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <unordered_set>
+#include <string_view>
+
+#include "machine.h"
+#include "emit.h"
+
+/*
+ * ======================================================================
+ *  Profiling instrumentation
+ * ======================================================================
+ *
+ * NOTE(jordan): no perf in here, so we count things ourselves. With -c,
+ * every taken jump between two places in the same function bumps a
+ * counter, and `go` prints the total to stderr on the way out:
+ *
+ *   jmp _L    =>  addq $1, .Ltaken_branches(%rip); jmp _L
+ *   jl _L     =>  jl .Lmain_3
+ *                 ...
+ *                 .text 1   # out of line, after all the real code
+ *               .Lmain_3: addq $1, .Ltaken_branches(%rip); jmp _L
+ *
+ * Calls (`jmp _f`), returns, and indirect jumps aren't counted; they're
+ * the same no matter how a function is laid out. The flags are dead by
+ * the time addq runs (see machine.h), so it's free to clobber them.
+ *
+ * This runs last, after every optimization pass: we're measuring what
+ * they produced.
+ */
+namespace codegen::L1::profile {
+  using namespace machine;
+
+  constexpr std::string_view counter = "taken_branches";
+  constexpr std::string_view format  = "taken_branches_format";
+
+  /* Rewrites `code` in place. Out-of-line stubs are appended to `stubs`;
+   * the caller emits them into a subsection.
+   */
+  inline void taken_branches (instructions & code, out_of_line & stubs) {
+    std::unordered_set<std::string_view> local;
+    for (auto const & i : code)
+      if (is_label(i)) local.insert(i.dst.name);
+    auto is_local = [&] (instruction const & i) {
+      return is_direct_jump(i) && local.count(i.dst.name) > 0;
+    };
+
+    instruction const bump =
+      make(op::addq, operand::immediate(1), operand::rip(counter));
+    instructions out;
+    out.reserve(code.size() + code.size() / 4);
+    for (auto const & i : code) {
+      if (!is_local(i)) {
+        out.push_back(i);
+        continue;
+      }
+      if (i.code == op::jmp) {
+        out.push_back(bump);
+        out.push_back(i);
+        continue;
+      }
+      operand const detour = stubs.fresh();
+      out.push_back(make(i.code, detour));
+      stubs.code.push_back(define_label(detour));
+      stubs.code.push_back(bump);
+      stubs.code.push_back(make(op::jmp, i.dst));
+    }
+    code.swap(out);
+  }
+
+  // After `call _main` in `go`. rax is main's result; keep it.
+  inline void print_taken_branches (emit::buffer & os) {
+    os << "  pushq %rax\n"
+          "  movq stderr(%rip), %rdi\n"
+          "  leaq .L" << format << "(%rip), %rsi\n"
+          "  movq .L" << counter << "(%rip), %rdx\n"
+          "  xorl %eax, %eax\n"
+          "  call fprintf\n"
+          "  popq %rax\n";
+  }
+
+  inline void data (emit::buffer & os) {
+    os << "  .data\n"
+          "  .p2align 3\n"
+          ".L" << counter << ":\n"
+          "  .quad 0\n"
+          ".L" << format << ":\n"
+          "  .asciz \"taken branches: %ld\\n\"\n"
+          "  .text\n";
+  }
+}
+
+/*
+ * ======================================================================
+ *  Allocation sites
+ * ======================================================================
+ *
+ * NOTE(jordan): with -A, every `call allocate` tells the runtime who's
+ * calling, by going through a different door with a site of its own:
+ *
+ *   call allocate  =>  leaq .Lsite.main.0(%rip), %rdx
+ *                      call allocate_at
+ *
+ * allocate only takes rdi and rsi, and clobbers every other caller-save
+ * register anyway, so rdx is ours. Each site is a record the runtime
+ * counts into (allocations, words, and how much lived through a
+ * collection), named after its function, the closest L1 label above it,
+ * and which allocation after that label it is:
+ *
+ *   .data 2
+ *   .Lsite.main.0:
+ *     .quad .Lsite.main.0.name, 0, 0, 0, 0
+ *   .data 3
+ *   .Lsite.main.0.name:
+ *     .asciz ":main :loop #2"
+ *
+ * The records are back to back, from `allocation_sites` to a zero. At
+ * exit, the runtime prints them, busiest first (see runtime.c). Dots
+ * can't be in L1 names, so no site collides with a local label.
+ *
+ * Runs after the optimizations (the labels are where layout left them),
+ * and before inline allocation, which leaves allocate_at alone: every
+ * allocation gets counted, at the price of a runtime call each.
+ */
+namespace codegen::L1::profile {
+  constexpr std::string_view sites_table = "allocation_sites";
+  constexpr std::string_view allocate_at = "allocate_at";
+
+  struct site {
+    std::string record;       // rip-relative; .L is implied
+    std::string name;         // what the runtime prints
+  };
+
+  /* NOTE(jordan): operands only hold views, so the names live in here,
+   * where they stay put until the function's been written out.
+   */
+  struct sites {
+    std::deque<site> all;
+  };
+
+  inline void allocation_sites (
+    instructions & code,
+    std::string_view function,
+    sites & found
+  ) {
+    std::string_view label;
+    int64_t since_label = 0;
+    instructions out;
+    out.reserve(code.size() + code.size() / 8);
+    for (auto const & i : code) {
+      if (is_label(i) && i.dst.is(operand::Kind::label)) {
+        label = i.dst.name;
+        since_label = 0;
+      }
+      bool allocates = i.code == op::call
+        && i.dst.is(operand::Kind::symbol)
+        && i.dst.name == "allocate";
+      if (!allocates) {
+        out.push_back(i);
+        continue;
+      }
+      site & s = found.all.emplace_back();
+      s.record = "site.";
+      s.record += function;
+      s.record += '.';
+      s.record += std::to_string(found.all.size() - 1);
+      s.name = ":";
+      s.name += function;
+      if (!label.empty()) {
+        s.name += " :";
+        s.name += label;
+      }
+      s.name += " #";
+      s.name += std::to_string(++since_label);
+      out.push_back(make(op::lea, operand::rip(s.record),
+        operand::reg(Register::rdx)));
+      out.push_back(make(op::call, operand::symbol(allocate_at)));
+    }
+    code.swap(out);
+  }
+
+  inline void write_sites (sites const & found, emit::buffer & os) {
+    if (found.all.empty()) return;
+    for (auto const & s : found.all) {
+      os << "  .data 2\n"
+            ".L" << s.record << ":\n"
+            "  .quad .L" << s.record << ".name, 0, 0, 0, 0\n"
+            "  .data 3\n"
+            ".L" << s.record << ".name:\n"
+            "  .asciz \"" << s.name << "\"\n";
+    }
+    os << "  .text 0\n";
+  }
+
+  // The table starts in `program`, and ends with a null name.
+  inline void begin_sites (emit::buffer & os) {
+    os << "  .data 2\n"
+          "  .p2align 3\n"
+          "  .globl " << sites_table << "\n"
+       << sites_table << ":\n"
+          "  .text 0\n";
+  }
+  inline void end_sites (emit::buffer & os) {
+    os << "  .data 2\n"
+          "  .quad 0\n"
+          "  .text 0\n";
+  }
+}
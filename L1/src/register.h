@@ -0,0 +1,128 @@
+#pragma once
+#include <cassert>
+#include <cstdint>
+#include <string_view>
+
+/*
+ * ======================================================================
+ *  x86-64 registers
+ * ======================================================================
+ *
+ * NOTE(jordan): every compiler in this chain used to ask "is this rcx?"
+ * by comparing strings. The answer is a constant. So: an enum, a handful
+ * of constexpr tables indexed by it, and sets of registers as bitmasks
+ * (there are exactly 16 of them; a uint16_t holds any set).
+ *
+ * This header is shared: L2 reaches it through its `L1` symlink.
+ */
+namespace x86_64 {
+  enum struct Register : uint8_t {
+    rax, rbx, rcx, rdx, rsi, rdi, rbp, rsp,
+    r8 , r9 , r10, r11, r12, r13, r14, r15,
+    // NOTE(jordan): not a register. "Lookup failed."
+    none,
+  };
+
+  constexpr int register_count = static_cast<int>(Register::none);
+
+  constexpr int index (Register r) { return static_cast<int>(r); }
+
+  enum struct Save : uint8_t { caller, callee, neither };
+
+  namespace table {
+    constexpr std::string_view name [] = {
+      "rax", "rbx", "rcx", "rdx", "rsi", "rdi", "rbp", "rsp",
+      "r8" , "r9" , "r10", "r11", "r12", "r13", "r14", "r15",
+    };
+    constexpr std::string_view gas [] = {
+      "%rax", "%rbx", "%rcx", "%rdx", "%rsi", "%rdi", "%rbp", "%rsp",
+      "%r8" , "%r9" , "%r10", "%r11", "%r12", "%r13", "%r14", "%r15",
+    };
+    constexpr std::string_view gas8 [] = {
+      "%al"  , "%bl"  , "%cl"  , "%dl"  , "%sil" , "%dil" , "%bpl" , "%spl" ,
+      "%r8b" , "%r9b" , "%r10b", "%r11b", "%r12b", "%r13b", "%r14b", "%r15b",
+    };
+    // Writing one of these zeroes the upper half of the 64-bit register.
+    constexpr std::string_view gas32 [] = {
+      "%eax" , "%ebx" , "%ecx" , "%edx" , "%esi" , "%edi" , "%ebp" , "%esp" ,
+      "%r8d" , "%r9d" , "%r10d", "%r11d", "%r12d", "%r13d", "%r14d", "%r15d",
+    };
+    // NOTE(jordan): rsp belongs to nobody. Don't allocate it.
+    constexpr Save save [] = {
+      Save::caller , Save::callee , Save::caller , Save::caller ,
+      Save::caller , Save::caller , Save::callee , Save::neither,
+      Save::caller , Save::caller , Save::caller , Save::caller ,
+      Save::callee , Save::callee , Save::callee , Save::callee ,
+    };
+  }
+
+  constexpr std::string_view name (Register r) { return table::name[index(r)]; }
+  constexpr std::string_view gas  (Register r) { return table::gas [index(r)]; }
+  constexpr std::string_view gas8 (Register r) { return table::gas8[index(r)]; }
+  constexpr std::string_view gas32 (Register r) {
+    return table::gas32[index(r)];
+  }
+  constexpr Save save (Register r) { return table::save[index(r)]; }
+
+  constexpr Register from_name (std::string_view s) {
+    for (int i = 0; i < register_count; i++)
+      if (table::name[i] == s) return static_cast<Register>(i);
+    return Register::none;
+  }
+
+  // Calling convention: argument registers, in order.
+  constexpr Register arguments [] = {
+    Register::rdi, Register::rsi, Register::rdx,
+    Register::rcx, Register::r8 , Register::r9 ,
+  };
+  constexpr Register out = Register::rax;
+}
+
+/*
+ * ----------------------------------------------------------------------
+ *  Register sets
+ * ----------------------------------------------------------------------
+ */
+namespace x86_64::set {
+  using mask = uint16_t;
+
+  constexpr mask of (Register r) { return mask(1u << index(r)); }
+
+  constexpr bool has (mask m, Register r) { return m & of(r); }
+
+  constexpr mask with_save (Save s) {
+    mask m = 0;
+    for (int i = 0; i < register_count; i++)
+      if (table::save[i] == s) m |= mask(1u << i);
+    return m;
+  }
+
+  constexpr mask all         = mask(~0u);
+  constexpr mask caller_save = with_save(Save::caller);
+  constexpr mask callee_save = with_save(Save::callee);
+  // NOTE(jordan): everything the register allocator gets to think about
+  constexpr mask analyzable  = mask(all & ~of(Register::rsp));
+
+  constexpr mask arguments (int n) {
+    mask m = 0;
+    for (int i = 0; i < n && i < 6; i++) m |= of(x86_64::arguments[i]);
+    return m;
+  }
+
+  constexpr int size (mask m) { return __builtin_popcount(m); }
+
+  // Lowest register in a non-empty set. Pair with `m &= m - 1` to walk.
+  constexpr Register first (mask m) {
+    assert(m != 0 && "x86_64::set::first: empty set!");
+    return static_cast<Register>(__builtin_ctz(m));
+  }
+
+  template <typename F>
+  void each (mask m, F f) {
+    for (; m != 0; m &= m - 1) f(first(m));
+  }
+
+  static_assert(size(caller_save) == 9 , "9 caller-save registers");
+  static_assert(size(callee_save) == 6 , "6 callee-save registers");
+  static_assert(size(analyzable)  == 15, "15 allocatable registers");
+}
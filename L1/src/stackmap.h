@@ -0,0 +1,311 @@
+#pragma once
+#include <vector>
+#include <cstddef>
+#include <cstdint>
+#include <iomanip>
+#include <ostream>
+#include <algorithm>
+#include <string_view>
+#include <unordered_map>
+#include <unordered_set>
+
+#include "machine.h"
+#include "emit.h"
+
+/*
+ * ======================================================================
+ *  Stack maps
+ * ======================================================================
+ *
+ * NOTE(jordan): the GC used to treat every word of the stack as a maybe-
+ * pointer. It has no choice: nobody tells it what's in there. So now we
+ * tell it. For every place a function can be suspended while the GC runs
+ * (right after `call allocate` or `allocate_at`, and every return label of
+ * an L1 call), we write down which of the function's stack slots are live
+ * there:
+ *
+ *   .data 1
+ *   .quad .Lmain_7, 3, 2, 0, 2    # return address, frame, count, slots
+ *   .text 0
+ *
+ * The frame is the function's locals and stack arguments, in words; the
+ * return address sits right above it. Starting from allocate, the runtime
+ * hops from frame to frame through the return addresses, and only looks
+ * at the live slots of each (see runtime.c).
+ *
+ * Liveness is per slot: a `mem rsp N` load uses slot N/8, a movq into it
+ * kills it. Register allocation (L2) lowers every spill to one of these,
+ * so that's the whole story, as long as nobody takes rsp's address or
+ * moves it around behind our backs. If a function does, it gets no map,
+ * and the runtime scans everything from its frame up, like it used to.
+ *
+ * Runs last, on exactly what gets printed (stubs in `.text 1` included).
+ */
+namespace codegen::L1::stackmap {
+  using namespace machine;
+
+  struct report {
+    std::size_t functions = 0;
+    std::size_t precise   = 0; // functions that got a map
+    std::size_t sites     = 0; // suspension points described
+    std::size_t live      = 0; // live slots, summed over every site
+  };
+
+  inline void print (report const & r, std::ostream & os) {
+    auto row = [&] (char const * name, std::size_t value) {
+      os << "  " << std::left << std::setw(18) << name
+         << std::right << std::setw(12) << value << "\n";
+    };
+    os << "stackmap:\n";
+    row("functions", r.functions);
+    row("precise",   r.precise);
+    row("sites",     r.sites);
+    row("live slots", r.live);
+  }
+
+  struct site {
+    operand at;             // the return address
+    std::vector<int64_t> live;
+  };
+
+  struct map {
+    int64_t frame = 0;      // words between rsp and the return address
+    bool precise = true;
+    std::vector<site> sites;
+  };
+}
+
+namespace codegen::L1::stackmap {
+  namespace helper {
+    using bits = std::vector<uint64_t>;
+
+    inline bool is_runtime_call (instruction const & i, std::string_view f) {
+      return i.code == op::call
+        && i.dst.is(operand::Kind::symbol)
+        && i.dst.name == f;
+    }
+    inline bool touches_rsp (operand const & o) {
+      using Kind = operand::Kind;
+      switch (o.kind) {
+        case Kind::reg: case Kind::reg8: case Kind::reg32:
+        case Kind::indirect:
+          return o.base == Register::rsp;
+        case Kind::address:
+          return o.base == Register::rsp || o.index == Register::rsp;
+        default:
+          return false;
+      }
+    }
+    inline bool is_label_operand (operand const & o) {
+      return o.is(operand::Kind::label) || o.is(operand::Kind::local);
+    }
+
+    /* NOTE(jordan): labels are either L1 labels (by name) or locals (by
+     * number; they all share the function's name).
+     */
+    struct labels {
+      std::unordered_map<std::string_view, std::size_t> named;
+      std::unordered_map<int64_t, std::size_t> numbered;
+
+      void add (operand const & label, std::size_t at) {
+        if (label.is(operand::Kind::local)) numbered[label.value] = at;
+        else named[label.name] = at;
+      }
+      // -1 if the label isn't in this function
+      long find (operand const & label) const {
+        if (label.is(operand::Kind::local)) {
+          auto found = numbered.find(label.value);
+          return found == numbered.end() ? -1 : long(found->second);
+        }
+        if (!label.is(operand::Kind::label)) return -1;
+        auto found = named.find(label.name);
+        return found == named.end() ? -1 : long(found->second);
+      }
+    };
+  }
+
+  /* Fills in `m`, and puts a label after every `call allocate` (in code
+   * or stubs) so the runtime can find it. `frame` is in words.
+   */
+  inline map run (
+    instructions & code,
+    out_of_line & stubs,
+    int64_t frame,
+    report * r = nullptr
+  ) {
+    using Kind = operand::Kind;
+    report scratch;
+    report & tally = r ? *r : scratch;
+    tally.functions++;
+
+    map m;
+    m.frame = frame;
+
+    // NOTE(jordan): one list, so control can flow into the stubs and back.
+    instructions whole;
+    whole.reserve(code.size() + stubs.code.size());
+    whole.insert(whole.end(), code.begin(), code.end());
+    whole.insert(whole.end(), stubs.code.begin(), stubs.code.end());
+    std::size_t const n = whole.size();
+    std::size_t const main_end = code.size();
+
+    helper::labels labels;
+    for (std::size_t i = 0; i < n; i++)
+      if (is_label(whole[i])) labels.add(whole[i].dst, i);
+
+    // Return labels: any label in here whose address gets taken.
+    std::unordered_set<std::string_view> taken;
+    for (auto const & i : whole) {
+      if (i.src.is(Kind::label_value)) taken.insert(i.src.name);
+      if (i.dst.is(Kind::label_value)) taken.insert(i.dst.name);
+    }
+    std::vector<std::size_t> returns;
+    for (std::size_t i = 0; i < n; i++)
+      if (is_label(whole[i]) && whole[i].dst.is(Kind::label)
+          && taken.count(whole[i].dst.name) > 0)
+        returns.push_back(i);
+
+    // Does anybody do anything with rsp besides `mem rsp N`?
+    auto slot = [&] (operand const & o) -> long {
+      if (!o.is(Kind::memory) || o.base != Register::rsp) return -1;
+      if (o.value < 0 || o.value >= 8 * frame) return -1;
+      if (o.value % 8 != 0) { m.precise = false; return -1; }
+      return long(o.value / 8);
+    };
+    for (std::size_t i = 0; i < n && m.precise; i++) {
+      instruction const & here = whole[i];
+      bool moves_rsp = here.dst.is_reg(Register::rsp);
+      if (moves_rsp) {
+        // The prologue, the epilogue, and `subq; jmp` calls are fine.
+        bool adjusts = (here.code == op::addq || here.code == op::subq)
+          && here.src.is(Kind::immediate);
+        bool prologue = i == 0;
+        bool before_exit = i + 1 < n && is_unconditional_exit(whole[i + 1]);
+        if (!adjusts || !(prologue || before_exit)) m.precise = false;
+      }
+      if (helper::touches_rsp(here.src)) m.precise = false;
+      if (!moves_rsp && helper::touches_rsp(here.dst)) m.precise = false;
+      if (here.code == op::lea && here.src.is(Kind::memory)
+          && here.src.base == Register::rsp) m.precise = false;
+      slot(here.src);
+      slot(here.dst);
+    }
+    if (!m.precise) return m;
+    tally.precise++;
+
+    std::size_t const width = (frame + 63) / 64;
+    auto set = [&] (helper::bits & b, long s) {
+      b[s >> 6] |= uint64_t(1) << (s & 63);
+    };
+    std::vector<helper::bits> use (n, helper::bits(width, 0));
+    std::vector<helper::bits> def (n, helper::bits(width, 0));
+    for (std::size_t i = 0; i < n; i++) {
+      instruction const & here = whole[i];
+      long read = slot(here.src);
+      if (read != -1) set(use[i], read);
+      long write = slot(here.dst);
+      if (write == -1) continue;
+      if (here.code == op::movq) set(def[i], write);
+      else set(use[i], write); // read-modify-write
+    }
+
+    /* Successors. A jump out of the function (a call) or through a
+     * register could come back at any return label.
+     */
+    std::vector<std::vector<std::size_t>> next (n);
+    for (std::size_t i = 0; i < n; i++) {
+      instruction const & here = whole[i];
+      bool falls = i + 1 < n && i + 1 != main_end;
+      if (here.code == op::ret) continue;
+      bool jumps = here.code == op::jmp || is_conditional_jump(here.code)
+        || here.code == op::ja || here.code == op::jae
+        || here.code == op::jnc;
+      if (!jumps) {
+        if (falls) next[i].push_back(i + 1);
+        continue;
+      }
+      long target = helper::is_label_operand(here.dst)
+        ? labels.find(here.dst) : -1;
+      if (target != -1) next[i].push_back(std::size_t(target));
+      else next[i].insert(next[i].end(), returns.begin(), returns.end());
+      if (here.code != op::jmp && falls) next[i].push_back(i + 1);
+    }
+
+    std::vector<helper::bits> live_in (n, helper::bits(width, 0));
+    helper::bits out (width);
+    for (bool changed = true; changed; ) {
+      changed = false;
+      for (std::size_t k = n; k-- > 0; ) {
+        std::fill(out.begin(), out.end(), 0);
+        for (std::size_t s : next[k])
+          for (std::size_t w = 0; w < width; w++) out[w] |= live_in[s][w];
+        for (std::size_t w = 0; w < width; w++) {
+          uint64_t in = use[k][w] | (out[w] & ~def[k][w]);
+          if (in != live_in[k][w]) {
+            live_in[k][w] = in;
+            changed = true;
+          }
+        }
+      }
+    }
+
+    auto slots = [&] (helper::bits const & b) {
+      std::vector<int64_t> result;
+      for (int64_t s = 0; s < frame; s++)
+        if ((b[s >> 6] >> (s & 63)) & 1) result.push_back(s);
+      return result;
+    };
+    for (std::size_t i : returns)
+      m.sites.push_back({ whole[i].dst, slots(live_in[i]) });
+
+    // Label every allocate; what's live after it is what the GC needs.
+    instructions code_out, stubs_out;
+    code_out.reserve(code.size());
+    stubs_out.reserve(stubs.code.size());
+    for (std::size_t i = 0; i < n; i++) {
+      instructions & to = i < main_end ? code_out : stubs_out;
+      to.push_back(whole[i]);
+      bool allocates = helper::is_runtime_call(whole[i], "allocate")
+        || helper::is_runtime_call(whole[i], "allocate_at");
+      if (!allocates) continue;
+      helper::bits after (width, 0);
+      for (std::size_t s : next[i])
+        for (std::size_t w = 0; w < width; w++) after[w] |= live_in[s][w];
+      operand const point = stubs.fresh();
+      to.push_back(define_label(point));
+      m.sites.push_back({ point, slots(after) });
+    }
+    code.swap(code_out);
+    stubs.code.swap(stubs_out);
+
+    tally.sites += m.sites.size();
+    for (auto const & s : m.sites) tally.live += s.live.size();
+    return m;
+  }
+
+  inline void write (map const & m, emit::buffer & os) {
+    if (m.sites.empty()) return;
+    os << "  .data 1\n";
+    for (auto const & s : m.sites) {
+      os << "  .quad " << s.at << ", " << m.frame << ", "
+         << int64_t(s.live.size());
+      for (int64_t slot : s.live) os << ", " << slot;
+      os << '\n';
+    }
+    os << "  .text 0\n";
+  }
+
+  // The table starts in `program`, and ends with a zero address.
+  inline void begin (emit::buffer & os) {
+    os << "  .data 1\n"
+          "  .p2align 3\n"
+          "  .globl stack_maps\n"
+          "stack_maps:\n"
+          "  .text 0\n";
+  }
+  inline void end (emit::buffer & os) {
+    os << "  .data 1\n"
+          "  .quad 0\n"
+          "  .text 0\n";
+  }
+}
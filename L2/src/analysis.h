@@ -1,7 +1,9 @@
 // vim: set foldmethod=marker:
 #pragma once
 #include <set>
+#include <vector>
 #include <cassert>
+#include <algorithm>
 #include <iostream>
 
 #include "grammar.h"
@@ -17,11 +19,45 @@ namespace analysis::L2 {
   using up_node  = helper::L2::up_node;
   using up_nodes = helper::L2::up_nodes;
   using string = std::string;
+  using Register = x86_64::Register;
+  using register_mask = x86_64::set::mask;
+  // NOTE(jordan): registers are a 16-bit mask; only variables need a set.
+  struct live_set {
+    register_mask registers = 0;
+    std::set<string> variables;
+  };
   using successor_map    = std::map<node const *, std::set<node const *>>;
-  using liveness_map     = std::map<node const *, std::set<string>>;
+  using liveness_map     = std::map<node const *, live_set>;
   using interference_map = std::map<string const, std::set<string>>;
 }
 
+namespace analysis::L2::live {
+  // Everything in the set, by name, in the order a std::set<string> would
+  // have listed it. (For printing, and for the string-keyed graph.)
+  std::vector<string> elements (live_set const & s) {
+    std::vector<string> result (s.variables.begin(), s.variables.end());
+    x86_64::set::each(s.registers, [&] (Register r) {
+      result.push_back(std::string(x86_64::name(r)));
+    });
+    std::sort(result.begin(), result.end());
+    return result;
+  }
+  bool equal (live_set const & a, live_set const & b) {
+    return a.registers == b.registers
+      && helper::set_equal(a.variables, b.variables);
+  }
+  // dest = dest U a U b
+  void accumulate (live_set const & a, live_set const & b, live_set & dest) {
+    dest.registers |= a.registers | b.registers;
+    helper::set_union(a.variables, b.variables, dest.variables);
+  }
+  // dest = a - b
+  void difference (live_set const & a, live_set const & b, live_set & dest) {
+    dest.registers = a.registers & ~b.registers;
+    helper::set_difference(a.variables, b.variables, dest.variables);
+  }
+}
+
 // successor analysis {{{
 /**
  *
@@ -226,37 +262,50 @@ namespace helper::L2::liveness::gen_kill {
       }
       bool is_variable = v.is<grammar::operand::variable>();
       assert(
-        is_variable || helper::matches<grammar::register_set::any>(v)
+        (is_variable
+         || helper::L2::x86_64_register::from_node(v) != x86_64::Register::none)
         && "gen/kill: node is not register or variable!"
       );
-      // NOTE(jordan): generalized handling of rsp being out of scope
-      if (helper::matches<grammar::register_set::unanalyzable>(v)) {
-        if (DBG)
-          std::cout
-            << "gen/kill: ignoring unanalyzable register:"
-            << " " << v.name() << "\n";
-        return;
+      if (!is_variable) {
+        namespace register_helper = helper::L2::x86_64_register;
+        auto const reg = register_helper::from_node(v);
+        // NOTE(jordan): generalized handling of rsp being out of scope
+        if (!x86_64::set::has(x86_64::set::analyzable, reg)) {
+          if (DBG)
+            std::cout
+              << "gen/kill: ignoring unanalyzable register:"
+              << " " << v.name() << "\n";
+          return;
+        }
+        return generic(which, i, reg, result);
       }
       std::string content = v.content();
       if (DBG) std::cout << "gen/kill: of var: " << content << "\n";
       switch (which) {
-        case GenKill::gen  : result.gen [&i].insert(content); return;
-        case GenKill::kill : result.kill[&i].insert(content); return;
+        case GenKill::gen  : result.gen [&i].variables.insert(content); return;
+        case GenKill::kill : result.kill[&i].variables.insert(content); return;
         default: assert(false && "gen/kill: unreachable!");
       }
     }
-    template <typename Reg>
-    static void generic (GenKill which, node const & i, result & result) {
-      assert(!matches<Reg>("rsp") && "gen/kill: cannot gen rsp!");
-      namespace register_helper = helper::L2::x86_64_register;
-      std::string const & reg = register_helper::convert<Reg>::string;
-      if (DBG) std::cout << "gen/kill<Register>: " << reg << "\n";
+    static void generic (
+      GenKill which,
+      node const & i,
+      x86_64::Register reg,
+      result & result
+    ) {
+      assert(reg != x86_64::Register::rsp && "gen/kill: cannot gen rsp!");
+      if (DBG) std::cout << "gen/kill<Register>: " << x86_64::name(reg) << "\n";
       switch (which) {
-        case GenKill::gen  : result.gen [&i].insert(reg); return;
-        case GenKill::kill : result.kill[&i].insert(reg); return;
+        case GenKill::gen  : result.gen [&i].registers |= x86_64::set::of(reg); return;
+        case GenKill::kill : result.kill[&i].registers |= x86_64::set::of(reg); return;
         default: assert(false && "gen/kill<Register>: unreachable!");
       }
     }
+    template <typename Reg>
+    static void generic (GenKill which, node const & i, result & result) {
+      namespace register_helper = helper::L2::x86_64_register;
+      return generic(which, i, register_helper::convert<Reg>, result);
+    }
     static void gen  (node const & i, node const & v, result & result) {
       return generic(GenKill::gen, i, v, result);
     }
@@ -574,15 +623,8 @@ namespace analysis::L2::liveness::gen_kill {
     }
 
     if (n.is<invoke::ret>()) {
-      namespace calling_convention = grammar::L2::calling_convention;
-      helper::variable::gen<calling_convention::call::out>(n, result);
-      namespace callee = calling_convention::callee_save;
-      helper::variable::gen<callee::r12>(n, result);
-      helper::variable::gen<callee::r13>(n, result);
-      helper::variable::gen<callee::r14>(n, result);
-      helper::variable::gen<callee::r15>(n, result);
-      helper::variable::gen<callee::rbp>(n, result);
-      helper::variable::gen<callee::rbx>(n, result);
+      namespace set = x86_64::set;
+      result.gen[&n].registers |= set::of(x86_64::out) | set::callee_save;
       return;
     }
 
@@ -592,30 +634,12 @@ namespace analysis::L2::liveness::gen_kill {
       || n.is<invoke::call::intrinsic::allocate>()
       || n.is<invoke::call::intrinsic::array_error>()
     ) {
-      namespace calling_convention = grammar::L2::calling_convention;
-      namespace arg                = calling_convention::call::argument;
+      namespace set = x86_64::set;
       assert(n.children.size() == 2);
       node const & integer  = *n.children.at(1);
       int args  = ::helper::L2::integer(integer);
-      if (args > 0) {
-        if (args >= 1) helper::variable::gen<arg::rdi>(n, result);
-        if (args >= 2) helper::variable::gen<arg::rsi>(n, result);
-        if (args >= 3) helper::variable::gen<arg::rdx>(n, result);
-        if (args >= 4) helper::variable::gen<arg::rcx>(n, result);
-        if (args >= 5) helper::variable::gen<arg::r8 >(n, result);
-        if (args >= 6) helper::variable::gen<arg::r9 >(n, result);
-      }
-      helper::variable::kill<calling_convention::call::out>(n, result);
-      namespace caller = calling_convention::caller_save;
-      helper::variable::kill<caller::r8 >(n, result);
-      helper::variable::kill<caller::r9 >(n, result);
-      helper::variable::kill<caller::r10>(n, result);
-      helper::variable::kill<caller::r11>(n, result);
-      helper::variable::kill<caller::rax>(n, result);
-      helper::variable::kill<caller::rcx>(n, result);
-      helper::variable::kill<caller::rdi>(n, result);
-      helper::variable::kill<caller::rdx>(n, result);
-      helper::variable::kill<caller::rsi>(n, result);
+      result.gen [&n].registers |= set::arguments(args);
+      result.kill[&n].registers |= set::of(x86_64::out) | set::caller_save;
       if (n.is<invoke::call::callable>()) {
         node const & callable_node = *n.children.at(0);
         helper::operand::callable::gen(n, callable_node, result);
@@ -681,22 +705,23 @@ namespace analysis::L2::liveness {
         auto in  = result.in [&instruction];
         auto out = result.out[&instruction];
         // out_minus_kill = OUT[i] - KILL[i]
-        std::set<std::string> out_minus_kill;
-        helper::set_difference(out, kill, out_minus_kill);
+        live_set out_minus_kill;
+        live::difference(out, kill, out_minus_kill);
         // debug {{{
         if (debug & DBG_IN_OUT_LOOP_OUT_MINUS_KILL) {
           std::cout << "OUT[" << index << "] - KILL[" << index << "] = ";
-          for (auto x : out_minus_kill) {
+          for (auto x : live::elements(out_minus_kill)) {
             std::cout << x << " ";
           }
           std::cout << "\n";
         } // }}}
         // IN[i] = GEN[i] U (out_minus_kill)
-        helper::set_union(gen, out_minus_kill, in);
+        live::accumulate(gen, out_minus_kill, in);
         // OUT[i] = U(s : successor of(i)) IN[s]
         for (node const * successor : successors) {
           auto & in_s = result.in[successor];
-          helper::set_union(in_s, out, out);
+          out.registers |= in_s.registers;
+          helper::set_union(in_s.variables, out.variables, out.variables);
         }
 
         auto const & in_original  = result.in [&instruction];
@@ -704,22 +729,22 @@ namespace analysis::L2::liveness {
         // debug {{{
         if (debug & DBG_IN_OUT_LOOP_ORIG) {
           std::cout << "in_original[" << index << "]  = ";
-          for (auto i : in_original) std::cout << i << " ";
+          for (auto i : live::elements(in_original)) std::cout << i << " ";
           std::cout << "\n";
           std::cout << "out_original[" << index << "] = ";
-          for (auto o : out_original) std::cout << o << " ";
+          for (auto o : live::elements(out_original)) std::cout << o << " ";
           std::cout << "\n";
           std::cout << "in[" << index << "]  = ";
-          for (auto i : in) std::cout << i << " ";
+          for (auto i : live::elements(in)) std::cout << i << " ";
           std::cout << "\n";
           std::cout << "out[" << index << "] = ";
-          for (auto o : out) std::cout << o << " ";
+          for (auto o : live::elements(out)) std::cout << o << " ";
           std::cout << "\n";
         }
         // }}}
         fixed_state = fixed_state
-          && helper::set_equal(in_original, in)
-          && helper::set_equal(out_original, out);
+          && live::equal(in_original, in)
+          && live::equal(out_original, out);
 
         result.in [&instruction] = in;
         result.out[&instruction] = out;
@@ -749,10 +774,12 @@ namespace analysis::L2::liveness {
         node const & wrapper = *instructions.at(index);
         node const & instruction = helper::unwrap_assert(wrapper);
         std::cout << "gen[" << index << "]  = ";
-        for (auto g : result.gen[&instruction]) std::cout << g << " ";
+        for (auto g : live::elements(result.gen[&instruction]))
+          std::cout << g << " ";
         std::cout << "\n";
         std::cout << "kill[" << index << "] = ";
-        for (auto r : result.kill[&instruction]) std::cout << r << " ";
+        for (auto r : live::elements(result.kill[&instruction]))
+          std::cout << r << " ";
         std::cout << "\n";
       }
       std::cout << "\n";
@@ -765,10 +792,12 @@ namespace analysis::L2::liveness {
         node const & wrapper = *result.instructions.children.at(index);
         node const & instruction = *wrapper.children.at(0);
         std::cout << "in[" << index << "]  = ";
-        for (auto i : result.in[&instruction]) std::cout << i << " ";
+        for (auto i : live::elements(result.in[&instruction]))
+          std::cout << i << " ";
         std::cout << "\n";
         std::cout << "out[" << index << "] = ";
-        for (auto o : result.out[&instruction]) std::cout << o << " ";
+        for (auto o : live::elements(result.out[&instruction]))
+          std::cout << o << " ";
         std::cout << "\n";
       }
       std::cout << "\n";
@@ -805,7 +834,7 @@ namespace analysis::L2::liveness {
       node const & instruction = *instruction_wrapper.children.at(0);
       auto in = result.in.at(&instruction);
       os << (pretty ? "  (" : "\n(");
-      for (auto var : in)
+      for (auto var : live::elements(in))
         os << helper::L2::strip_variable_prefix(var) << " ";
       os << (pretty ? ")\n" : ")");
     }
@@ -817,7 +846,7 @@ namespace analysis::L2::liveness {
       node const & instruction = *instruction_wrapper.children.at(0);
       auto out = result.out.at(&instruction);
       os << (pretty ? "  (" : "\n(");
-      for (auto var : out)
+      for (auto var : live::elements(out))
         os << helper::L2::strip_variable_prefix(var) << " ";
       os << (pretty ? ")\n" : ")");
     }
@@ -856,19 +885,17 @@ namespace analysis::L2::interference::graph {
 
 // FIXME(jordan): these helpers are gross.
 namespace analysis::L2::interference::graph::x86_64_register {
-  namespace register_set = grammar::L2::register_set;
+  namespace set = x86_64::set;
   namespace register_helper = helper::L2::x86_64_register;
-  using namespace grammar::L2::identifier::x86_64_register;
   void connect_to_all (result & result, std::string const & origin) {
-    auto & interferes = result.graph[origin];
-    for (auto const & reg : register_helper::analyzable_registers()) {
-      biconnect(result, origin, reg);
-    }
+    set::each(set::analyzable, [&] (Register reg) {
+      biconnect(result, origin, register_helper::to_string(reg));
+    });
   }
   void connect_all (result & result) {
-    for (auto const & reg : register_helper::analyzable_registers()) {
-      connect_to_all(result, reg);
-    }
+    set::each(set::analyzable, [&] (Register reg) {
+      connect_to_all(result, register_helper::to_string(reg));
+    });
   }
 }
 // }}}
@@ -884,9 +911,9 @@ namespace analysis::L2::interference {
     for (int index = 0; index < result.instructions.children.size(); index++) {
       node const & instruction_wrapper = *result.instructions.children.at(index);
       node const & instruction = *instruction_wrapper.children.at(0);
-      auto const in   = result.liveness.in[&instruction];
-      auto const out  = result.liveness.out[&instruction];
-      auto const kill = result.liveness.kill[&instruction];
+      auto const in   = live::elements(result.liveness.in[&instruction]);
+      auto const out  = live::elements(result.liveness.out[&instruction]);
+      auto const kill = live::elements(result.liveness.kill[&instruction]);
       // 1. Connect each pair of variables in the same IN set
       for (auto const & variable : in) {
         for (auto const & sibling : in) {
@@ -934,10 +961,8 @@ namespace analysis::L2::interference {
         bool is_variable = value.is<grammar::L2::operand::variable>();
         std::string const & variable = value.content();
         graph::x86_64_register::connect_to_all(result, variable);
-        // FIXME(jordan): this is kinda gross
-        using rcx = grammar::L2::identifier::x86_64_register::rcx;
         namespace register_helper = helper::L2::x86_64_register;
-        std::string rcx_string = register_helper::convert<rcx>::string;
+        std::string rcx_string = register_helper::to_string(Register::rcx);
         result.graph[variable].erase(rcx_string);
         result.graph[rcx_string].erase(variable);
       }
@@ -1037,7 +1062,7 @@ namespace analysis::L2::color {
     interference::result interference;
     std::vector<entry::uncolored> removed;
     std::map<std::string const, Color> mapping;
-    std::map<Color const, std::string> color_to_register;
+    std::map<Color const, Register> color_to_register;
   };
 }
 
@@ -1086,9 +1111,9 @@ namespace analysis::L2::color::graph {
     if (available_colors.size() != 0) {
       // NOTE(jordan): prefer caller-save colors
       for (auto color : available_colors) {
-        namespace caller = grammar::L2::calling_convention::caller_save;
-        auto color_register = result.color_to_register[color];
-        if (helper::matches<caller::any>(color_register))
+        auto color_register = result.color_to_register.find(color);
+        if (color_register == result.color_to_register.end()) continue;
+        if (x86_64::save(color_register->second) == x86_64::Save::caller)
           return color;
       }
       return *available_colors.begin();
@@ -1119,13 +1144,14 @@ namespace analysis::L2::color {
     };
     // 0. color all register nodes
     namespace register_helper = helper::L2::x86_64_register;
-    for (auto const & reg : register_helper::analyzable_registers()) {
+    for (Register reg : register_helper::analyzable_in_name_order) {
+      std::string const name = register_helper::to_string(reg);
       entry::uncolored entry = std::make_pair(
-        reg, result.interference.graph.at(reg)
+        name, result.interference.graph.at(name)
       );
       Color color = graph::choose_color(entry, result);
       graph::color(entry, color, result); // => entry::colored
-      result.color_to_register[color] = std::string(reg);
+      result.color_to_register[color] = reg;
     }
     // 1. sort the variables so those with most edges pop last
     std::vector<std::string> variable_vector;
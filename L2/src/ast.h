@@ -260,6 +260,8 @@ namespace ast::L2::filter {
         op::less,
         op::equal,
         op::less_equal,
+        op::below,
+        op::below_equal,
         op::add,
         op::subtract,
         op::multiply,
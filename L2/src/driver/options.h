@@ -53,7 +53,7 @@ namespace driver::L2 {
   Options Options::argv (int argc, char ** argv) {
     int c;
     Options opt;
-    while ((c = getopt(argc, argv, "tpisl:g:O:")) != -1)
+    while ((c = getopt(argc, argv, "tpisrl:g:O:GASB")) != -1)
       switch (c) {
       /*
        * ----------------------------------------------------------------
@@ -88,6 +88,21 @@ namespace driver::L2 {
         case 'O':
           // TODO(jordan): maybe we should care about opt level later.
           break;
+        case 'G':
+          // Write barriers: L1's business. Lc hands it down.
+          break;
+        case 'A':
+          // Allocation sites: likewise.
+          break;
+        case 'S':
+          // Stride headers: IR's business.
+          break;
+        case 'B':
+          // Bounds checks: likewise.
+          break;
+        case 'r':
+          // Optimization reports: each level that has some prints them.
+          break;
       /*
        * ----------------------------------------------------------------
        *  Debug flags
@@ -260,9 +260,12 @@ namespace grammar::L2 {
     struct less       : util::a<'<'> {};
     struct equal      : util::a<'='> {};
     struct less_equal : TAO_PEGTL_STRING("<=") {};
+    // Unsigned (see L1)
+    struct below       : TAO_PEGTL_STRING("<u") {};
+    struct below_equal : TAO_PEGTL_STRING("<=u") {};
     // NOTE: order MATTERS!
-    // cmp ::= < | <= | =
-    struct any : peg::sor<less_equal, less, equal> {};
+    // cmp ::= < | <= | = | <u | <=u
+    struct any : peg::sor<below_equal, less_equal, below, less, equal> {};
   }
 
   // Shift <sop>
@@ -314,6 +317,8 @@ namespace grammar::L2 {
     using decrement   = unary::arithmetic::decrement;
     using address_at  = quaternary::address::at;
     using less_equal  = binary::comparison::less_equal;
+    using below       = binary::comparison::below;
+    using below_equal = binary::comparison::below_equal;
     using shift_left  = binary::shift::left;
     using bitwise_and = binary::arithmetic::bitwise_and;
     using shift_right = binary::shift::right;
@@ -1,11 +1,13 @@
 #pragma once
 
 #include <set>
-#include <typeindex>
+#include <string_view>
 #include <algorithm>
 
 #include "tao/pegtl.hpp"
 
+#include "L1/register.h"
+
 #include "grammar.h"
 #include "ast.h"
 
@@ -142,50 +144,40 @@ namespace helper::L2 {
   // NOTE(jordan): woof. Template specialization, amirite?
   namespace x86_64_register {
     namespace reg = grammar::identifier::x86_64_register;
-    template <typename Register> struct convert {
-      static const std::type_index index;
-      static const std::string string;
-    };
+    namespace set = ::x86_64::set;
+    using Register = ::x86_64::Register;
+    template <typename Reg> constexpr Register convert = Register::none;
     // REFACTOR(jordan): look at that register call pattern...
-    #define mkreg2s(R) \
-      template<> std::string const convert<reg::R>::string = #R
-    mkreg2s(rax); mkreg2s(rbx); mkreg2s(rcx); mkreg2s(rdx); mkreg2s(rsi);
-    mkreg2s(rdi); mkreg2s(rbp); mkreg2s(rsp); mkreg2s(r8 ); mkreg2s(r9 );
-    mkreg2s(r10); mkreg2s(r11); mkreg2s(r12); mkreg2s(r13); mkreg2s(r14);
-    mkreg2s(r15);
-    #undef mkreg2s
-    #define mkreg2i(R)                                                   \
-      template<> std::type_index const                                   \
-      convert<reg::R>::index = std::type_index(typeid(reg::R))
-    mkreg2i(rax); mkreg2i(rbx); mkreg2i(rcx); mkreg2i(rdx); mkreg2i(rsi);
-    mkreg2i(rdi); mkreg2i(rbp); mkreg2i(rsp); mkreg2i(r8 ); mkreg2i(r9 );
-    mkreg2i(r10); mkreg2i(r11); mkreg2i(r12); mkreg2i(r13); mkreg2i(r14);
-    mkreg2i(r15);
-    #undef mkreg2i
-    #define r2i(R) convert<reg::R>::index
-    std::set<std::type_index> all_register_indices = {
-      r2i(rax), r2i(rbx), r2i(rcx), r2i(rdx), r2i(rsi), r2i(rdi),
-      r2i(rbp), r2i(rsp), r2i(r8 ), r2i(r9 ), r2i(r10), r2i(r11),
-      r2i(r12), r2i(r13), r2i(r14), r2i(r15),
-    };
-    #undef r2i
-    #define ri2s(R) \
-      if (convert<reg::R>::index == reg) return convert<reg::R>::string
-    std::string index_to_string (std::type_index reg) {
-      ri2s(rax); ri2s(rbx); ri2s(rcx); ri2s(rdx); ri2s(rsi); ri2s(rdi);
-      ri2s(rbp); ri2s(rsp); ri2s(r8 ); ri2s(r9 ); ri2s(r10); ri2s(r11);
-      ri2s(r12); ri2s(r13); ri2s(r14); ri2s(r15);
-      assert(false && "register_index_to_string: unrecognized index!");
+    #define mkreg(R) \
+      template<> constexpr Register convert<reg::R> = Register::R
+    mkreg(rax); mkreg(rbx); mkreg(rcx); mkreg(rdx); mkreg(rsi);
+    mkreg(rdi); mkreg(rbp); mkreg(rsp); mkreg(r8 ); mkreg(r9 );
+    mkreg(r10); mkreg(r11); mkreg(r12); mkreg(r13); mkreg(r14);
+    mkreg(r15);
+    #undef mkreg
+    Register from_node (node const & n) {
+      assert(n.has_content() && "x86_64_register::from_node: no content!");
+      return ::x86_64::from_name(std::string_view(
+        n.m_begin.data, n.m_end.data - n.m_begin.data
+      ));
     }
-    #undef ri2s
-    std::set<std::string> analyzable_registers () {
-      std::set<std::string> result;
-      for (auto & index : all_register_indices) {
-        std::string const reg = index_to_string(index);
-        if (!helper::matches<grammar::register_set::unanalyzable>(reg))
-          result.insert(reg);
-      }
-      return result;
+    std::string to_string (Register r) {
+      return std::string(::x86_64::name(r));
     }
+    /* NOTE(jordan): the allocator used to walk the registers out of a
+     * std::set<std::string>, i.e. in name order; "r10" first, "rsi" last.
+     * Keep that order so a given program keeps getting the same registers.
+     */
+    constexpr Register analyzable_in_name_order [] = {
+      Register::r10, Register::r11, Register::r12, Register::r13,
+      Register::r14, Register::r15, Register::r8 , Register::r9 ,
+      Register::rax, Register::rbp, Register::rbx, Register::rcx,
+      Register::rdi, Register::rdx, Register::rsi,
+    };
+    static_assert(
+      sizeof(analyzable_in_name_order) / sizeof(Register)
+        == set::size(set::analyzable),
+      "analyzable_in_name_order is missing a register!"
+    );
   }
 }
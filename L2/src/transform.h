@@ -572,6 +572,9 @@ namespace transform::L2::spill {
           << " " << lhs.content()
           << " " << op.content()
           << " " << rhs.content();
+        os << "\n\t";
+        // mem rsp OFF <- %SN
+        os << helper::spill::save(spilled, offset);
       } else {
         os << dest.content()
           << " <- "
@@ -1088,7 +1091,7 @@ namespace helper::L2::transform::color {
     if (helper::matches<grammar::identifier::variable>(operand)) {
       assert(coloring.mapping.find(operand.content()) != coloring.mapping.end());
       auto color = coloring.mapping.at(operand.content());
-      return coloring.color_to_register.at(color);
+      return x86_64_register::to_string(coloring.color_to_register.at(color));
     } else {
       return operand.content();
     }
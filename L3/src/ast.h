@@ -77,6 +77,8 @@ namespace ast::L3::filter {
         op::greater,
         op::less_equal,
         op::greater_equal,
+        op::below,
+        op::below_equal,
         // arithmetic
         op::add,
         op::subtract,
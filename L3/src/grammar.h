@@ -90,7 +90,14 @@ namespace grammar::L3 {
     struct equal         : TAO_PEGTL_STRING("=")  {};
     struct less_equal    : TAO_PEGTL_STRING("<=") {};
     struct greater_equal : TAO_PEGTL_STRING(">=") {};
-    using any = peg::sor<less_equal, greater_equal, less, greater, equal>;
+    // Unsigned (see L1)
+    struct below         : TAO_PEGTL_STRING("<u")  {};
+    struct below_equal   : TAO_PEGTL_STRING("<=u") {};
+    using any = peg::sor<
+      below_equal, less_equal, greater_equal,
+      below, less, greater,
+      equal
+    >;
   }
 
   namespace op::binary::assignment {
@@ -111,6 +118,8 @@ namespace grammar::L3 {
     using greater       = binary::comparison::greater;
     using less_equal    = binary::comparison::less_equal;
     using greater_equal = binary::comparison::greater_equal;
+    using below         = binary::comparison::below;
+    using below_equal   = binary::comparison::below_equal;
     using equal         = binary::comparison::equal;
     using gets          = binary::assignment::gets;
   }
@@ -74,6 +74,8 @@ namespace ast::LA::filter {
         op::greater,
         op::less_equal,
         op::greater_equal,
+        op::below,
+        op::below_equal,
         // arithmetic
         op::add,
         op::subtract,
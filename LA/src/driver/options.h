@@ -51,7 +51,7 @@ namespace driver::LA {
   Options Options::argv (int argc, char ** argv) {
     int c;
     Options opt;
-    while ((c = getopt(argc, argv, "tpQg:O:")) != -1)
+    while ((c = getopt(argc, argv, "tpQrg:O:GASB")) != -1)
       switch (c) {
       /*
        * ----------------------------------------------------------------
@@ -76,6 +76,21 @@ namespace driver::LA {
         case 'O':
           // TODO(jordan): maybe we should care about opt level later.
           break;
+        case 'G':
+          // Write barriers: L1's business. Lc hands it down.
+          break;
+        case 'A':
+          // Allocation sites: likewise.
+          break;
+        case 'S':
+          // Stride headers: IR's business.
+          break;
+        case 'B':
+          // Bounds checks: likewise.
+          break;
+        case 'r':
+          // Optimization reports: each level that has some prints them.
+          break;
       /*
        * ----------------------------------------------------------------
        *  Debug flags
@@ -21,56 +21,287 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <inttypes.h>
+#include <time.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
 
-#define HEAP_SIZE 1048576    // one megabyte
-//#define HEAP_SIZE 200      // small heap size for testing
+/*
+ * Heap sizing
+ *
+ * Both semispaces start at HEAP_INITIAL_WORDS. After each collection,
+ * the idle semispace is resized for the next one: if more than
+ * HEAP_GROW_AT of the space survived, it grows by HEAP_GROWTH; if less
+ * than HEAP_SHRINK_AT survived, it shrinks by the same factor (but never
+ * below the initial size). If an allocation still doesn't fit after a
+ * collection, we grow right away and collect again into the bigger space.
+ * Nothing grows past HEAP_MAX_WORDS.
+ *
+ * Every setting can be changed when the runtime is compiled (L1c passes
+ * $RUNTIME_CFLAGS along, e.g. -DHEAP_INITIAL_WORDS=200) or when the
+ * program starts, through the environment:
+ *
+ *   L_HEAP_INITIAL=64m L_HEAP_MAX=4g L_HEAP_GROWTH=2 ./a.out
+ *
+ * Sizes in the environment are in bytes, with an optional k/m/g suffix.
+ */
+#ifndef HEAP_INITIAL_WORDS
+#define HEAP_INITIAL_WORDS 1048576    // one megaword (8 MB)
+#endif
+#ifndef HEAP_MAX_WORDS
+#define HEAP_MAX_WORDS 268435456      // 256 megawords (2 GB)
+#endif
+#ifndef HEAP_GROWTH
+#define HEAP_GROWTH 2.0
+#endif
+#ifndef HEAP_GROW_AT
+#define HEAP_GROW_AT 0.5
+#endif
+#ifndef HEAP_SHRINK_AT
+#define HEAP_SHRINK_AT 0.1
+#endif
+
+/*
+ * Generational mode
+ *
+ * If the program marks its cards (L1 -G; see barrier.h in L1), new objects
+ * go in a nursery of NURSERY_WORDS instead. When it fills up, we collect
+ * just the nursery: whatever is still reachable from it gets promoted into
+ * the semispace (the old space), and the nursery starts over empty. The
+ * old space is only collected (nursery and all, like before) once it can't
+ * take another nursery's worth. Arrays bigger than half the nursery go
+ * straight into the old space.
+ *
+ * The roots of a nursery collection are the stack, plus every card of the
+ * old space (CARD_WORDS words) written to since the last one: compiled code
+ * marks the card of every slot it stores a register into.
+ *
+ * L_NURSERY sets the size (in bytes, like the rest) when the program
+ * starts; L_NURSERY=0 turns the nursery off. It never gets bigger than half
+ * the initial heap.
+ */
+#ifndef NURSERY_WORDS
+#define NURSERY_WORDS 262144          // 256 kilowords (2 MB)
+#endif
+#define CARD_SHIFT 9                  // 512-byte cards (barrier.h agrees)
+#define CARD_WORDS ((1 << CARD_SHIFT) / 8)
+
+/*
+ * Large objects
+ *
+ * Arrays of LARGE_OBJECT_WORDS elements or more don't go in the heap: each
+ * one gets pages of its own (see Memory, below), and never moves. A
+ * collection marks the ones it reaches (forwarding their fields in place),
+ * then gives back the pages of the rest. Inside, they look like any other
+ * array: the size, then the data.
+ *
+ * They're old objects as far as a nursery collection is concerned:
+ * their written-to cards are roots, like the old space's.
+ *
+ * L_LARGE_OBJECT sets the threshold (in bytes) when the program starts;
+ * L_LARGE_OBJECT=0 puts everything back in the heap. Mapping more than a
+ * semispace's worth of them since the last collection starts a new one,
+ * so that dead ones don't pile up forever.
+ */
+#ifndef LARGE_OBJECT_WORDS
+#define LARGE_OBJECT_WORDS 65536      // 64 kilowords (512 KB)
+#endif
 //#define GC_DEBUG           // uncomment this to enable GC debugging
 //#define GC_DUMP            // prints the entire heap before/after each gc
+//#define GC_RECURSIVE       // the old depth-first gc_copy, instead of Cheney
+//#define GC_CONSERVATIVE    // ignore the stack maps; scan the whole stack
 
 typedef struct {
    int64_t *allocptr;           // current allocation position
    int64_t words_allocated;
+   int64_t size;                // capacity, in words
    void **data;
-   char *valid;
+   uint64_t *starts;            // object-start bitmap, one bit per word
+   uint8_t *cards;              // written-to cards, one byte per CARD_WORDS
 } heap_t;
 
+struct {
+   int64_t initial_words;
+   int64_t max_words;
+   double growth;
+   double grow_at;
+   double shrink_at;
+   int64_t nursery_words;
+   int64_t large_object_words;
+} heap_policy = {
+   HEAP_INITIAL_WORDS,
+   HEAP_MAX_WORDS,
+   HEAP_GROWTH,
+   HEAP_GROW_AT,
+   HEAP_SHRINK_AT,
+   NURSERY_WORDS,
+   LARGE_OBJECT_WORDS,
+};
+
 heap_t heap;      // the current heap
 heap_t heap2;     // the heap for copying
+heap_t nursery;   // new objects, in generational mode
+heap_t *young = &heap; // where new objects go
+
+/*
+ * Statistics
+ *
+ * L_RUNTIME_STATS=1 prints what the program allocated, how much the GC had
+ * to do about it, and how long it spent printing, on stderr at exit (as
+ * JSON with L_RUNTIME_STATS=json, every pause included). Off, it costs a
+ * branch per allocate() call and collection.
+ *
+ * Compiled code allocates without calling us (see allocate.h in L1), so we
+ * count its arrays in bulk: everything between where the young space's
+ * allocation pointer was when we last handed it over, and where it is the
+ * next time we get it back, is packed back to back, header after header.
+ *
+ * Sizes are binned by powers of two (in elements): 0, 1, 2-3, 4-7, ...
+ */
+#define SIZE_BINS 64
+
+struct {
+   int on;
+   int json;
+   int64_t allocations;
+   int64_t words_allocated;     // headers included
+   int64_t sizes[SIZE_BINS];
+   int64_t *counted;            // young objects below this are counted
+   int64_t collections;
+   int64_t minor;               // collections of just the nursery
+   int64_t words_copied;
+   int64_t words_collected;     // in from-spaces, copied or not
+   int64_t roots;               // stack words looked at
+   int64_t max_in_use;          // bytes, at the start of any collection
+   double *pauses;              // seconds, one per collection
+   int64_t pauses_capacity;
+   int64_t prints;
+   double print_seconds;
+} stats;
 
 int64_t *stack; // pointer to the bottom of the stack (i.e. value
                 // upon program startup)
 
+double seconds_since(struct timespec *start) {
+   struct timespec end;
+   clock_gettime(CLOCK_MONOTONIC, &end);
+   return (end.tv_sec - start->tv_sec) + (end.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/*
+ * Output
+ *
+ * What the program prints goes into one big buffer, and out to stdout in
+ * a single write() whenever the buffer fills up, and at exit (array_error
+ * included). printf would take a lock and parse a format for every
+ * number, comma and brace; we just copy bytes, and turn numbers into
+ * digits two at a time. If stdout is a terminal, every print() goes out
+ * right away, the way stdio would have done it at the newline.
+ *
+ * The runtime's other messages (running out of memory, and so on) still
+ * use printf: they're all followed by exit(), which writes ours first.
+ */
+#define OUTPUT_BYTES 65536
+
+struct {
+   char data[OUTPUT_BYTES];
+   int64_t used;
+   int eager;                   // flush after every print()
+} output;
+
+void flush_output() {
+   char *next = output.data;
+   while(output.used > 0) {
+      ssize_t written = write(1, next, output.used);
+      if(written < 0) {
+         if(errno == EINTR) continue;
+         break;
+      }
+      next += written;
+      output.used -= written;
+   }
+   output.used = 0;
+}
+
+static inline void output_text(const char *text, int64_t length) {
+   if(output.used + length > OUTPUT_BYTES) flush_output();
+   memcpy(output.data + output.used, text, length);
+   output.used += length;
+}
+
+static const char digit_pairs[] =
+   "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+   "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+   "8081828384858687888990919293949596979899";
+
+static inline void output_int(int64_t value) {
+   char digits[20];
+   char *first = digits + sizeof(digits);
+   uint64_t magnitude = (value < 0) ? -(uint64_t)value : (uint64_t)value;
+
+   while(magnitude >= 100) {
+      const char *pair = digit_pairs + 2 * (magnitude % 100);
+      magnitude /= 100;
+      *--first = pair[1];
+      *--first = pair[0];
+   }
+   if(magnitude >= 10) {
+      *--first = digit_pairs[2 * magnitude + 1];
+      *--first = digit_pairs[2 * magnitude];
+   } else {
+      *--first = '0' + magnitude;
+   }
+   if(value < 0) *--first = '-';
+   output_text(first, digits + sizeof(digits) - first);
+}
+
 /*
  * Helper for the print() function
  */
 void print_content(int64_t *in, int depth) {
    if(depth >= 4) {
-     printf("...");
+     output_text("...", 3);
      return;
    }
    // NOTE: this function crashes quite messily if "in" is 0
    // so we've added this check
    if(in == NULL) {
-     printf("nil");
+     output_text("nil", 3);
      return;
    }
    int64_t x = (int64_t)in;
    if(x & 1) {
-     printf("%" PRId64, x >> 1);
+     output_int(x >> 1);
    } else {
      int64_t size = *((int64_t*)in);
      int64_t *data = in + 1;
-     int i;
-     printf("{s:%" PRId64, size);
+     int64_t i;
+     // Arrays laid out with strides (IR -S) say how many dimensions they
+     // have as 8n + 2 (not a number, not a pointer). Print them as if the
+     // strides weren't there.
+     int64_t strides = 0;
+     if(size > 0 && (data[0] & 7) == 2) strides = (data[0] >> 3) - 1;
+     output_text("{s:", 3);
+     output_int(size - strides);
      for(i = 0; i < size; i++) {
-       printf(", ");
-       print_content((int64_t *)(*data), depth + 1);
+       output_text(", ", 2);
+       if(strides > 0 && i == 0) {
+         output_int(strides + 1);
+       } else {
+         print_content((int64_t *)(*data), depth + 1);
+       }
        data++;
+       if(strides > 0 && i == strides + 1) {
+         data += strides;
+         i += strides;
+       }
      }
-     printf("}");
+     output_text("}", 1);
      // check for bad pointers
      if (size==-1) {
-       printf("\nfound -1 in an array; internal GC failure\n");
+       const char *failure = "\nfound -1 in an array; internal GC failure\n";
+       output_text(failure, strlen(failure));
        exit(-1);
      }
    }
@@ -80,43 +311,569 @@ void print_content(int64_t *in, int depth) {
  * Runtime "print" function
  */
 int64_t print(void *l) {
+   struct timespec start;
+   if(stats.on) clock_gettime(CLOCK_MONOTONIC, &start);
+
    print_content(l, 0);
-   printf("\n");
+   output_text("\n", 1);
+   if(output.eager) flush_output();
 
+   if(stats.on) {
+      stats.prints++;
+      stats.print_seconds += seconds_since(&start);
+   }
    return 1;
 }
 
+/*
+ * Object-start bitmap
+ *
+ * Bit i of a heap's bitmap is set when data[i] is the first word (the
+ * size) of an object; the GC uses it to tell real objects from pointers
+ * into the middle of one. Only headers are ever marked, and emptying a
+ * heap clears the used part of the bitmap 64 words at a time.
+ *
+ * Compiled code allocates without calling us (see allocate.h in L1), so
+ * nobody marks anything while allocating. Instead, the GC walks the heap
+ * from header to header right before it collects; objects are packed
+ * back to back, so each header says where the next one is.
+ */
+#define BITMAP_WORDS(words) (((words) + 63) / 64)
+#define CARDS(words) (((words) + CARD_WORDS - 1) / CARD_WORDS)
+
+static inline void mark_object_start(heap_t *h, int64_t index) {
+   h->starts[index >> 6] |= (uint64_t)1 << (index & 63);
+}
+
+static inline int is_object_start(heap_t *h, int64_t index) {
+   return (h->starts[index >> 6] >> (index & 63)) & 1;
+}
+
+void mark_object_starts(heap_t *h) {
+   int64_t index = 0;
+   while(index < h->words_allocated) {
+      int64_t size = ((int64_t*)h->data)[index];
+      mark_object_start(h, index);
+      index += (size == 0) ? 2 : size + 1;
+   }
+}
+
 void reset_heap(heap_t *h) {
+   memset(h->starts, 0, BITMAP_WORDS(h->words_allocated) * sizeof(uint64_t));
+   memset(h->cards, 0, CARDS(h->words_allocated));
    h->allocptr = (int64_t*)h->data;
    h->words_allocated = 0;
 }
 
-int alloc_heap(heap_t *h) {
-   h->data = (void*)malloc(HEAP_SIZE * sizeof(void*));
-   h->valid = (void*)malloc(HEAP_SIZE * sizeof(char));
-   reset_heap(h);
-   return (h->data != NULL && h->valid != NULL);
+/*
+ * Memory
+ *
+ * Both semispaces and the large objects live in one range of address
+ * space, reserved up front and never touched: room for the biggest
+ * semispace we'd ever grow (plus a nursery's worth) twice, and as much
+ * again for large objects. A semispace commits (makes accessible) only
+ * what it's currently sized to, and the kernel only backs a page once we
+ * write to it. After each collection, we hand the pages of the space we
+ * copied out of back (MADV_DONTNEED), so what's resident follows what's
+ * live, plus whatever has been allocated since.
+ *
+ * Committed space asks for transparent huge pages: allocation sweeps
+ * through it front to back, which is what they're best at.
+ *
+ * One card table covers the whole range, so compiled code marks cards in
+ * large objects the same way it does in the old space.
+ */
+struct {
+   char *base;
+   int64_t bytes;
+   int64_t space_bytes;         // each semispace's share
+   char *large;                 // where large objects go
+   uint8_t *cards;
+} arena;
+
+int64_t page_round(int64_t bytes) {
+   int64_t page = sysconf(_SC_PAGESIZE);
+   return (bytes + page - 1) / page * page;
 }
 
-void switch_heaps() {
-   int64_t *temp_allocptr = heap.allocptr;
-   int temp_words_allocated = heap.words_allocated;
-   void **temp_data = heap.data;
-   char *temp_valid = heap.valid;
+void *map_memory(int64_t bytes, int prot) {
+   void *p = mmap(NULL, bytes, prot, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+   return p == MAP_FAILED ? NULL : p;
+}
+
+int commit(void *at, int64_t bytes) {
+   if(mprotect(at, bytes, PROT_READ | PROT_WRITE) != 0) return 0;
+   madvise(at, bytes, MADV_HUGEPAGE);     // just a hint; fine if it fails
+   return 1;
+}
+
+void decommit(void *at, int64_t bytes) {
+   madvise(at, bytes, MADV_DONTNEED);
+   mprotect(at, bytes, PROT_NONE);
+}
+
+int reserve_heaps() {
+   int64_t huge = 2 << 20;
+   int64_t words = heap_policy.max_words + heap_policy.nursery_words + 1;
+   arena.space_bytes = (words * sizeof(int64_t) + huge - 1) / huge * huge;
+   arena.bytes = 3 * arena.space_bytes;
+   arena.base = (char*)map_memory(arena.bytes, PROT_NONE);
+   arena.large = arena.base + 2 * arena.space_bytes;
+   arena.cards = (uint8_t*)map_memory(arena.bytes >> CARD_SHIFT, PROT_READ | PROT_WRITE);
+   return (arena.base != NULL && arena.cards != NULL);
+}
+
+/*
+ * Resize an idle (empty) semispace, committing or decommitting the
+ * difference
+ */
+int resize_heap(heap_t *h, int64_t words) {
+   int64_t now = page_round(h->size * sizeof(int64_t));
+   int64_t then = page_round(words * sizeof(int64_t));
+   if(then > arena.space_bytes) return 0;
+   if(then > now && !commit((char*)h->data + now, then - now)) return 0;
+   if(then < now) decommit((char*)h->data + then, now - then);
+   h->size = words;
+   return 1;
+}
+
+/*
+ * A semispace, at its place in the arena
+ */
+int place_heap(heap_t *h, char *at, int64_t words) {
+   int64_t bitmap = BITMAP_WORDS(arena.space_bytes / sizeof(int64_t));
+   h->data = (void**)at;
+   h->starts = (uint64_t*)map_memory(bitmap * sizeof(uint64_t), PROT_READ | PROT_WRITE);
+   h->cards = arena.cards + ((at - arena.base) >> CARD_SHIFT);
+   h->size = 0;
+   h->allocptr = (int64_t*)h->data;
+   h->words_allocated = 0;
+   return (h->starts != NULL && resize_heap(h, words));
+}
+
+/*
+ * A space of its own (the nursery), all committed
+ */
+int map_heap(heap_t *h, int64_t words) {
+   h->size = words;
+   h->data = (void**)map_memory(page_round(words * sizeof(int64_t)), PROT_READ | PROT_WRITE);
+   h->starts = (uint64_t*)map_memory(BITMAP_WORDS(words) * sizeof(uint64_t), PROT_READ | PROT_WRITE);
+   h->cards = (uint8_t*)map_memory(CARDS(words), PROT_READ | PROT_WRITE);
+   h->allocptr = (int64_t*)h->data;
+   h->words_allocated = 0;
+   if(h->data != NULL) madvise(h->data, words * sizeof(int64_t), MADV_HUGEPAGE);
+   return (h->data != NULL && h->starts != NULL && h->cards != NULL);
+}
+
+/*
+ * Empty a semispace we just copied out of, and give its pages back. It
+ * stays committed; touching it again just gets fresh zero pages.
+ */
+void release_heap(heap_t *h) {
+   int64_t used = h->words_allocated;
+   memset(h->cards, 0, CARDS(used));
+   madvise(h->data, page_round(used * sizeof(int64_t)), MADV_DONTNEED);
+   madvise(h->starts, BITMAP_WORDS(used) * sizeof(uint64_t), MADV_DONTNEED);
+   h->allocptr = (int64_t*)h->data;
+   h->words_allocated = 0;
+}
+
+static inline uint8_t *card_of(void *p) {
+   return arena.cards + (((char*)p - arena.base) >> CARD_SHIFT);
+}
+
+typedef struct {
+   int64_t *object;
+   int64_t bytes;               // the whole block
+   int marked;
+} large_t;
+
+struct {
+   large_t *objects;            // sorted by address
+   int64_t count;
+   int64_t capacity;
+   int64_t words_since_gc;      // mapped since the last collection
+   int64_t **stack;             // marked, but fields not forwarded yet
+   int64_t stack_count;
+   int marking;                 // only a full collection marks
+} large;
+
+large_t *find_large(int64_t *p) {
+   int64_t low = 0, high = large.count;
+   while(low < high) {
+      int64_t middle = low + (high - low) / 2;
+      if(large.objects[middle].object < p) low = middle + 1;
+      else high = middle;
+   }
+   if(low < large.count && large.objects[low].object == p) {
+      return &large.objects[low];
+   }
+   return NULL;
+}
+
+/*
+ * A new large object, of `words` words (size included), or NULL. It goes
+ * in the first gap between the others big enough to hold it.
+ */
+int64_t *allocate_large(int64_t words) {
+   int64_t bytes = page_round(words * sizeof(int64_t));
+   char *block = arena.large;
+   int64_t i;
+
+   if(large.count == large.capacity) {
+      large.capacity = large.capacity ? 2 * large.capacity : 16;
+      large.objects = (large_t*)realloc(large.objects, large.capacity * sizeof(large_t));
+      large.stack = (int64_t**)realloc(large.stack, large.capacity * sizeof(int64_t*));
+      if(large.objects == NULL || large.stack == NULL) return NULL;
+   }
+   for(i = 0; i < large.count; i++) {
+      char *next = (char*)large.objects[i].object;
+      if(next - block >= bytes) break;
+      block = next + large.objects[i].bytes;
+   }
+   if(block + bytes > arena.large + arena.space_bytes) return NULL;
+   if(!commit(block, bytes)) return NULL;
+
+   memmove(&large.objects[i + 1], &large.objects[i], (large.count - i) * sizeof(large_t));
+   large.objects[i].object = (int64_t*)block;
+   large.objects[i].bytes = bytes;
+   large.objects[i].marked = 0;
+   large.count++;
+   large.words_since_gc += words;
+   return (int64_t*)block;
+}
+
+/*
+ * Mark a large object, if that's what `p` is, and queue it up for its
+ * fields to be forwarded
+ */
+void mark_large(int64_t *p) {
+   large_t *entry;
+   if(!large.marking || large.count == 0) return;
+   if((entry = find_large(p)) == NULL || entry->marked) return;
+   entry->marked = 1;
+   large.stack[large.stack_count++] = p;
+}
+
+/*
+ * Decommit every large object the collection didn't reach. The nursery is
+ * empty now, so no card needs looking at either.
+ */
+void sweep_large() {
+   int64_t i, kept = 0;
+   for(i = 0; i < large.count; i++) {
+      large_t *entry = &large.objects[i];
+      memset(card_of(entry->object), 0, entry->bytes >> CARD_SHIFT);
+      if(entry->marked) {
+         entry->marked = 0;
+         large.objects[kept++] = *entry;
+      } else {
+         decommit(entry->object, entry->bytes);
+      }
+   }
+   large.count = kept;
+   large.words_since_gc = 0;
+}
+
+/*
+ * Statistics keeping (see Statistics, above)
+ */
+void count_allocation(int64_t size) {
+   int bin = 0;
+   while(bin < SIZE_BINS - 1 && (size >> bin) > 0) bin++;
+   stats.allocations++;
+   stats.words_allocated += (size == 0) ? 2 : size + 1;
+   stats.sizes[bin]++;
+}
+
+void count_allocations(int64_t *from, int64_t *to) {
+   while(from < to) {
+      count_allocation(from[0]);
+      from += (from[0] == 0) ? 2 : from[0] + 1;
+   }
+}
+
+void note_in_use() {
+   int64_t bytes = (heap.words_allocated + nursery.words_allocated) * sizeof(int64_t);
+   int64_t i;
+   for(i = 0; i < large.count; i++) bytes += large.objects[i].bytes;
+   if(bytes > stats.max_in_use) stats.max_in_use = bytes;
+}
+
+void begin_collection(struct timespec *start) {
+   note_in_use();
+   clock_gettime(CLOCK_MONOTONIC, start);
+}
+
+void end_collection(struct timespec *start, int64_t collected, int64_t copied) {
+   if(stats.collections == stats.pauses_capacity) {
+      stats.pauses_capacity = stats.pauses_capacity ? 2 * stats.pauses_capacity : 64;
+      stats.pauses = (double*)realloc(stats.pauses, stats.pauses_capacity * sizeof(double));
+      if(stats.pauses == NULL) {
+         printf("out of memory\n");
+         exit(-1);
+      }
+   }
+   stats.pauses[stats.collections++] = seconds_since(start);
+   stats.words_collected += collected;
+   stats.words_copied += copied;
+}
+
+/*
+ * Allocation sites
+ *
+ * Programs compiled with L1 -A (see profile.h in L1) allocate through
+ * allocate_at, which also hands us the call site's record. We count what
+ * each site allocates, and remember where every object came from, keyed
+ * by address, so that after a collection we can tell which ones made it
+ * (and where they went). Objects that haven't lived through a collection
+ * yet are kept apart from the ones that have: a nursery collection only
+ * needs to look at the former, and the first time an object survives is
+ * the only time it counts.
+ *
+ * At exit, the sites are printed on stderr, busiest first.
+ */
+typedef struct {
+   const char *name;
+   int64_t allocations;
+   int64_t words;               // headers included
+   int64_t survivors;           // objects that lived through a collection
+   int64_t survivor_words;
+} site_t;
+
+// Defined by programs compiled with allocation sites; ends with a NULL name
+extern site_t allocation_sites[] __attribute__((weak));
+
+typedef struct {
+   int64_t **objects;           // NULL where there's nothing
+   site_t **sites;
+   int64_t capacity;            // a power of two
+   int64_t count;
+} tracked_t;
+
+tracked_t tracked_new;          // allocated since the last collection
+tracked_t tracked_old;          // survived at least one
+
+static inline int64_t object_words(int64_t *object) {
+   return (object[0] == 0) ? 2 : object[0] + 1;
+}
+
+/*
+ * Empty a table, at `capacity`, and hand back what was in it
+ */
+tracked_t untrack_all(tracked_t *t, int64_t capacity) {
+   tracked_t old = *t;
+   t->objects = (int64_t**)calloc(capacity, sizeof(int64_t*));
+   t->sites = (site_t**)calloc(capacity, sizeof(site_t*));
+   t->capacity = capacity;
+   t->count = 0;
+   if(t->objects == NULL || t->sites == NULL) {
+      printf("out of memory\n");
+      exit(-1);
+   }
+   return old;
+}
+
+void track(tracked_t *t, int64_t *object, site_t *site) {
+   uint64_t hash;
+   int64_t i, mask;
+
+   if(2 * (t->count + 1) > t->capacity) {
+      tracked_t old = untrack_all(t, t->capacity ? 2 * t->capacity : 1024);
+      for(i = 0; i < old.capacity; i++) {
+         if(old.objects[i] != NULL) track(t, old.objects[i], old.sites[i]);
+      }
+      free(old.objects);
+      free(old.sites);
+   }
+   mask = t->capacity - 1;
+   hash = ((uint64_t)object >> 3) * 0x9E3779B97F4A7C15ull;
+   for(i = (int64_t)(hash >> 32) & mask; t->objects[i] != NULL; i = (i + 1) & mask);
+   t->objects[i] = object;
+   t->sites[i] = site;
+   t->count++;
+}
+
+static inline int in_space(heap_t *h, int64_t *p) {
+   return (void**)p >= h->data && (void**)p < h->data + h->words_allocated;
+}
+
+/*
+ * Where a tracked object is now that a collection is over (but before its
+ * from-spaces are emptied), or NULL if it didn't make it. `full` says
+ * whether the old space and the large objects were collected too.
+ */
+int64_t *survivor(int64_t *object, int full) {
+   large_t *entry;
+   if(in_space(&nursery, object) || (full && in_space(&heap2, object))) {
+      return (object[0] == -1) ? (int64_t*)object[1] : NULL;
+   }
+   if(full && (entry = find_large(object)) != NULL) {
+      return entry->marked ? object : NULL;
+   }
+   return object;
+}
+
+void track_survivors(int full) {
+   tracked_t t;
+   int64_t i, *now;
+
+   if(tracked_new.count > 0) {
+      t = untrack_all(&tracked_new, tracked_new.capacity);
+      for(i = 0; i < t.capacity; i++) {
+         if(t.objects[i] == NULL || (now = survivor(t.objects[i], full)) == NULL) continue;
+         t.sites[i]->survivors++;
+         t.sites[i]->survivor_words += object_words(now);
+         track(&tracked_old, now, t.sites[i]);
+      }
+      free(t.objects);
+      free(t.sites);
+   }
+
+   if(!full || tracked_old.count == 0) return;
+   t = untrack_all(&tracked_old, tracked_old.capacity);
+   for(i = 0; i < t.capacity; i++) {
+      if(t.objects[i] == NULL || (now = survivor(t.objects[i], full)) == NULL) continue;
+      track(&tracked_old, now, t.sites[i]);
+   }
+   free(t.objects);
+   free(t.sites);
+}
+
+int compare_sites(const void *a, const void *b) {
+   const site_t *x = *(const site_t* const*)a;
+   const site_t *y = *(const site_t* const*)b;
+   return (y->words > x->words) - (y->words < x->words);
+}
+
+void print_sites() {
+   site_t **sorted;
+   int64_t count = 0, i;
+
+   while(allocation_sites[count].name != NULL) count++;
+   sorted = (site_t**)malloc((count + 1) * sizeof(site_t*));
+   if(sorted == NULL) return;
+   for(i = 0; i < count; i++) sorted[i] = &allocation_sites[i];
+   qsort(sorted, count, sizeof(site_t*), compare_sites);
+
+   fprintf(stderr, "allocation sites:\n");
+   fprintf(stderr, "  %-40s %12s %14s %12s %14s\n",
+           "site", "allocations", "bytes", "survivors", "survivor bytes");
+   for(i = 0; i < count; i++) {
+      site_t *site = sorted[i];
+      if(site->allocations == 0) continue;
+      fprintf(stderr, "  %-40s %12" PRId64 " %14" PRId64 " %12" PRId64 " %14" PRId64 "\n",
+              site->name, site->allocations, site->words * 8,
+              site->survivors, site->survivor_words * 8);
+   }
+   free(sorted);
+}
+
+/*
+ * Where compiled code allocates (see allocate.h in L1): the next object
+ * goes at allocation_pointer, and if its last word wouldn't come before
+ * allocation_limit, it calls allocate() instead. The runtime reads the
+ * pointer back whenever allocate() is called, and publishes both before
+ * it returns.
+ *
+ * The write barriers (see barrier.h in L1) need to know where the old
+ * objects (the arena) and their cards are, and somewhere to park a
+ * register. Outside of generational mode the old space is empty, and no
+ * card is ever marked.
+ */
+int64_t *allocation_pointer;
+int64_t *allocation_limit;
+int64_t large_object_words;     // longer arrays go through allocate()
+int64_t old_space_start;
+int64_t old_space_bytes;
+uint8_t *card_table;
+int64_t barrier_scratch;
 
-   heap.allocptr = heap2.allocptr;
-   heap.words_allocated = heap2.words_allocated;
-   heap.data = heap2.data;
-   heap.valid = heap2.valid;
+// Defined by programs compiled with write barriers
+extern int64_t write_barriers[] __attribute__((weak));
 
-   heap2.allocptr = temp_allocptr;
-   heap2.words_allocated = temp_words_allocated;
-   heap2.data = temp_data;
-   heap2.valid = temp_valid;
+void load_allocation_pointer() {
+   young->allocptr = allocation_pointer;
+   young->words_allocated = allocation_pointer - (int64_t*)young->data;
+}
+
+void publish_allocation_pointer() {
+   allocation_pointer = young->allocptr;
+   allocation_limit = (int64_t*)young->data + young->size - 1;
+   if(young == &nursery) {
+      old_space_start = (int64_t)arena.base;
+      old_space_bytes = arena.bytes;
+      card_table = arena.cards;
+   }
+}
+
+void switch_heaps() {
+   heap_t temp = heap;
+   heap = heap2;
+   heap2 = temp;
 
    reset_heap(&heap);
 }
 
+/*
+ * Parse a size in bytes ("512k", "64m", "2g") into words
+ */
+int64_t parse_words(const char *text) {
+   char *end;
+   double bytes = strtod(text, &end);
+   switch(*end) {
+      case 'g': case 'G': bytes *= 1024; // fall through
+      case 'm': case 'M': bytes *= 1024; // fall through
+      case 'k': case 'K': bytes *= 1024;
+   }
+   return (int64_t)(bytes / sizeof(int64_t));
+}
+
+void configure_heap() {
+   const char *value;
+   if((value = getenv("L_HEAP_INITIAL")))  heap_policy.initial_words = parse_words(value);
+   if((value = getenv("L_HEAP_MAX")))      heap_policy.max_words = parse_words(value);
+   if((value = getenv("L_HEAP_GROWTH")))   heap_policy.growth = strtod(value, NULL);
+   if((value = getenv("L_HEAP_GROW_AT")))  heap_policy.grow_at = strtod(value, NULL);
+   if((value = getenv("L_HEAP_SHRINK_AT"))) heap_policy.shrink_at = strtod(value, NULL);
+   if((value = getenv("L_NURSERY")))       heap_policy.nursery_words = parse_words(value);
+   if((value = getenv("L_LARGE_OBJECT")))  heap_policy.large_object_words = parse_words(value);
+
+   // Keep the policy sane: at least 2 words (one empty array), and a
+   // growth factor that actually grows
+   if(heap_policy.initial_words < 2) heap_policy.initial_words = 2;
+   if(heap_policy.max_words < heap_policy.initial_words)
+      heap_policy.max_words = heap_policy.initial_words;
+   if(heap_policy.growth <= 1.0) heap_policy.growth = 2.0;
+   if(heap_policy.nursery_words > heap_policy.initial_words / 2)
+      heap_policy.nursery_words = heap_policy.initial_words / 2;
+   if(heap_policy.large_object_words <= 0)
+      heap_policy.large_object_words = INT64_MAX;
+   large_object_words = heap_policy.large_object_words;
+}
+
+/*
+ * How big the next semispace should be, given how much survived the last
+ * collection and how much we need to allocate right now
+ */
+int64_t next_heap_size(int64_t live, int64_t needed) {
+   int64_t size = heap.size;
+   double survival = (double)live / (double)heap.size;
+
+   if(survival > heap_policy.grow_at) {
+      size = (int64_t)(size * heap_policy.growth);
+   } else if(survival < heap_policy.shrink_at) {
+      size = (int64_t)(size / heap_policy.growth);
+      if(size < heap_policy.initial_words) size = heap_policy.initial_words;
+   }
+   while(size < heap_policy.max_words && live + needed >= size) {
+      size = (int64_t)(size * heap_policy.growth);
+   }
+   if(size > heap_policy.max_words) size = heap_policy.max_words;
+   return size;
+}
+
+#ifdef GC_RECURSIVE
 /*
  * Helper for the gc() function.
  * Copies (compacts) an object from the old heap into
@@ -127,18 +884,28 @@ int64_t *gc_copy(int64_t *old)  {
    int64_t *old_array, *new_array, *first_array_location;
    int valid_index;
    char is_valid;
-   char *valid;
 
    // If not a pointer or not a pointer to a heap location, return input value
-   if((int64_t)old % 8 != 0 ||
-      (void**)old < heap2.data ||
+   if((int64_t)old % 8 != 0) {
+      return old;
+   }
+   if((void**)old < heap2.data ||
       (void**)old >= heap2.data + heap2.words_allocated) {
+      // A large object stays put; just copy what it points at
+      mark_large(old);
+      while(large.stack_count > 0) {
+         int64_t *object = large.stack[--large.stack_count];
+         int64_t j;
+         for(j = 1; j <= object[0]; j++) {
+            object[j] = (int64_t)gc_copy((int64_t*)object[j]);
+         }
+      }
       return old;
    }
    
    // if not pointing at a valid heap object, return input value
    valid_index = (int64_t)((void**)old - heap2.data);
-   is_valid = heap2.valid[valid_index];
+   is_valid = is_object_start(&heap2, valid_index);
    if(!is_valid) {
       return old;
    }
@@ -162,8 +929,6 @@ int64_t *gc_copy(int64_t *old)  {
    // printf("gc_copy(): valid=%d old=%p new=%p: size=%d asize=%d total=%d\n", is_valid, old, heap.allocptr, size, array_size, heap.words_allocated);
 #endif
 
-   valid = heap.valid + heap.words_allocated;
-
    // Mark the old array as invalid, create the new array
    old_array[0] = -1;
    new_array = heap.allocptr;
@@ -179,24 +944,269 @@ int64_t *gc_copy(int64_t *old)  {
    new_array[0] = size;
    new_array[1] = (int64_t)gc_copy(first_array_location);
 
-   valid[0] = 1;
-   valid[1] = 0;
-
    // Call gc_copy on the remaining values of the array
    for (i = 2; i < array_size; i++) {
       new_array[i] = (int64_t)gc_copy((int64_t*)old_array[i]);
-      valid[i] = 0;
    }
 
    return new_array;
 }
+#else
+/*
+ * Helpers for the gc() function (Cheney's algorithm).
+ *
+ * gc_forward copies one object into the new heap as-is, without looking
+ * at its fields, and leaves a forwarding pointer behind. gc_scan then
+ * walks the new heap from `scan` up to the allocation pointer, forwarding
+ * every field it finds; whatever it hasn't reached yet is the queue. The
+ * copy is breadth-first, and no matter how deep the data structure goes,
+ * the C stack doesn't.
+ *
+ * What gets copied is whatever is in the spaces being collected: the old
+ * semispace and the nursery, or just the nursery.
+ */
+heap_t *from_spaces[2];
+int from_space_count;
+
+static inline heap_t *from_space(int64_t *p) {
+   int i;
+   for(i = 0; i < from_space_count; i++) {
+      heap_t *h = from_spaces[i];
+      if((void**)p >= h->data && (void**)p < h->data + h->words_allocated) {
+         return h;
+      }
+   }
+   return NULL;
+}
+
+int64_t *gc_forward(int64_t *old) {
+   int64_t size, array_size;
+   int64_t *new_array;
+   heap_t *from;
+
+   // If not a pointer or not a pointer to a heap location, return input value
+   if((int64_t)old % 8 != 0) {
+      return old;
+   }
+   if((from = from_space(old)) == NULL) {
+      mark_large(old);
+      return old;
+   }
+
+   // if not pointing at a valid heap object, return input value
+   if(!is_object_start(from, (void**)old - from->data)) {
+      return old;
+   }
+
+   // Already copied: the second word is the new address
+   size = old[0];
+   if(size == -1) {
+      return (int64_t*)old[1];
+   }
+   array_size = (size == 0) ? 2 : size + 1;
+
+   new_array = heap.allocptr;
+   memcpy(new_array, old, array_size * sizeof(int64_t));
+   heap.allocptr += array_size;
+   heap.words_allocated += array_size;
+
+   old[0] = -1;
+   old[1] = (int64_t)new_array;
+   return new_array;
+}
+
+void gc_scan(int64_t *scan) {
+   int64_t i, array_size;
+   while(scan < heap.allocptr) {
+      array_size = (scan[0] == 0) ? 2 : scan[0] + 1;
+      for(i = 1; i < array_size; i++) {
+         scan[i] = (int64_t)gc_forward((int64_t*)scan[i]);
+      }
+      scan += array_size;
+   }
+}
+
+void gc_scan_large(int64_t *object) {
+   int64_t i;
+   for(i = 1; i <= object[0]; i++) {
+      object[i] = (int64_t)gc_forward((int64_t*)object[i]);
+   }
+}
+
+/*
+ * gc_scan, until the large objects marked along the way are done too
+ */
+void gc_trace(int64_t *scan) {
+   for(;;) {
+      gc_scan(scan);
+      scan = heap.allocptr;
+      if(large.stack_count == 0) return;
+      gc_scan_large(large.stack[--large.stack_count]);
+   }
+}
+
+/*
+ * Forward every nursery pointer in the written-to cards of `words` words
+ * of old objects, starting at `data` (which starts a card), and wipe the
+ * cards clean. We look at every word of a card, wherever its objects
+ * start: a header is a size, and never looks like a pointer.
+ */
+void gc_cards(int64_t *data, int64_t words, uint8_t *cards) {
+   int64_t card, i, last;
+
+   for(card = 0; card < CARDS(words); card++) {
+      if(!cards[card]) continue;
+      cards[card] = 0;
+      last = (card + 1) * CARD_WORDS;
+      if(last > words) last = words;
+      for(i = card * CARD_WORDS; i < last; i++) {
+         data[i] = (int64_t)gc_forward((int64_t*)data[i]);
+      }
+   }
+}
+#endif
+
+/*
+ * Mark the cards of an old object that might point into the nursery
+ */
+void mark_cards(int64_t *object, int64_t words) {
+   uint8_t *first = card_of(object);
+   uint8_t *last = card_of(object + words - 1);
+   memset(first, 1, last - first + 1);
+}
+
+int is_young(int64_t *p) {
+   return (int64_t)p % 8 == 0 && young == &nursery &&
+          (void**)p >= nursery.data &&
+          (void**)p < nursery.data + nursery.words_allocated;
+}
+
+/*
+ * Stack maps
+ *
+ * The compiler lists every place a function can be stopped while we
+ * collect (after a call to allocate, or at the return label of a call),
+ * along with the stack slots that are live there (see stackmap.h in L1):
+ *
+ *   return address, frame size in words, slot count, slot...
+ *
+ * and a zero address at the end. The return address of a frame sits right
+ * above its slots, and the caller's frame starts right above that, so we
+ * can walk the whole stack and only look at live slots. Once we reach a
+ * frame without a map (go, or a function the compiler couldn't figure
+ * out), we fall back to looking at every word from there up.
+ *
+ * Programs built without stack maps don't define the table at all.
+ */
+extern int64_t stack_maps[] __attribute__((weak));
+
+typedef struct {
+   int64_t address;
+   int64_t frame;
+   int64_t count;
+   int64_t *slots;
+} frame_map_t;
+
+frame_map_t *frame_maps;
+int64_t frame_map_count = -1;   // not loaded yet
+
+int compare_frame_maps(const void *a, const void *b) {
+   int64_t x = ((const frame_map_t*)a)->address;
+   int64_t y = ((const frame_map_t*)b)->address;
+   return (x > y) - (x < y);
+}
+
+void load_stack_maps() {
+   int64_t *entry;
+   int64_t i = 0;
+
+   frame_map_count = 0;
+   if(stack_maps == NULL) return;
+   for(entry = stack_maps; entry[0] != 0; entry += 3 + entry[2]) {
+      frame_map_count++;
+   }
+   frame_maps = (frame_map_t*)malloc(frame_map_count * sizeof(frame_map_t));
+   for(entry = stack_maps; entry[0] != 0; entry += 3 + entry[2], i++) {
+      frame_maps[i].address = entry[0];
+      frame_maps[i].frame = entry[1];
+      frame_maps[i].count = entry[2];
+      frame_maps[i].slots = entry + 3;
+   }
+   qsort(frame_maps, frame_map_count, sizeof(frame_map_t), compare_frame_maps);
+}
+
+frame_map_t *find_frame_map(int64_t address) {
+   int64_t low = 0, high = frame_map_count;
+   while(low < high) {
+      int64_t middle = low + (high - low) / 2;
+      if(frame_maps[middle].address < address) low = middle + 1;
+      else high = middle;
+   }
+   if(low < frame_map_count && frame_maps[low].address == address) {
+      return &frame_maps[low];
+   }
+   return NULL;
+}
+
+#ifdef GC_RECURSIVE
+#define gc_root gc_copy
+#else
+#define gc_root gc_forward
+#endif
 
 /*
- * Initiates garbage collection
+ * Copy whatever the stack points at. rsp is where allocate() saved the
+ * callee-save registers; right above them is its return address, and
+ * then the frame of whoever called it.
  */
-void gc(int64_t *rsp) {
+void gc_stack(int64_t *rsp) {
+   int64_t *frame = rsp + 7;
+   int64_t *p;
+   int64_t i;
+
+   // The registers could belong to anybody
+   for(i = 0; i < 6; i++) {
+      rsp[i] = (int64_t)gc_root((int64_t*)rsp[i]);
+   }
+   stats.roots += 6;
+
+#ifndef GC_CONSERVATIVE
+   int64_t address = rsp[6];
+   frame_map_t *map;
+
+   if(frame_map_count < 0) load_stack_maps();
+   while((map = find_frame_map(address)) != NULL &&
+         frame + map->frame <= stack) {
+      for(i = 0; i < map->count; i++) {
+         p = frame + map->slots[i];
+         *p = (int64_t)gc_root((int64_t*)*p);
+      }
+      stats.roots += map->count;
+      address = frame[map->frame];
+      frame += map->frame + 1;
+   }
+#endif
+
+   for(p = frame; p <= stack; p++) {
+      *p = (int64_t)gc_root((int64_t*)*p);
+   }
+   stats.roots += stack + 1 - frame;
+}
+
+/*
+ * Initiates garbage collection. `fill` is allocate()'s fill value, which
+ * is a root too.
+ */
+void gc(int64_t *rsp, int64_t **fill) {
+   int64_t collected;
+#ifdef GC_DUMP
    int i;
+#endif
+#ifdef GC_DEBUG
    int stack_size = stack - rsp + 1;       // calculate the stack size
+#endif
+   struct timespec start;
+   if(stats.on) begin_collection(&start);
 #ifdef GC_DEBUG
    int prev_words_alloc = heap.words_allocated;
 
@@ -204,7 +1214,7 @@ void gc(int64_t *rsp) {
 
 #ifdef GC_DUMP
    printf("\n(");
-   for (i=0;i<HEAP_SIZE;i++) {
+   for (i=0;i<heap.size;i++) {
      if (i != 0) printf (" ");
      printf("(%p %p)\n",&(heap.data[i]),heap.data[i]);
    }
@@ -212,9 +1222,25 @@ void gc(int64_t *rsp) {
 #endif
 #endif
 
+   // find the objects we're about to copy, then
    // swap in the empty heap to use for storing
    // compacted objects
+   collected = heap.words_allocated + nursery.words_allocated;
+   mark_object_starts(&heap);
+   if(young == &nursery) mark_object_starts(&nursery);
+   // Everything could survive; make sure it fits (the idle space might
+   // have shrunk since, or there might be a nursery to empty, too)
+   if(heap2.size <= heap.words_allocated + nursery.words_allocated &&
+      !resize_heap(&heap2, heap.words_allocated + nursery.words_allocated + 1)) {
+      printf("out of memory\n");
+      exit(-1);
+   }
    switch_heaps();
+#ifndef GC_RECURSIVE
+   from_spaces[0] = &heap2;
+   from_spaces[1] = &nursery;
+   from_space_count = (young == &nursery) ? 2 : 1;
+#endif
 
    // NOTE: the edi/esi register contents could also be
    // roots, but these have been placed in the stack
@@ -223,15 +1249,26 @@ void gc(int64_t *rsp) {
 
    // Then, we need to copy anything pointed at
    // by the stack into our empty heap
-   for(i = 0; i < stack_size; i++) {
-      rsp[i] = (int64_t)gc_copy((int64_t*)rsp[i]);
-   }
+   large.marking = 1;
+   gc_stack(rsp);
+   *fill = gc_root(*fill);
+#ifndef GC_RECURSIVE
+   // The roots have only been forwarded; copy what they reach in one scan
+   gc_trace((int64_t*)heap.data);
+#endif
+   large.marking = 0;
+   if(allocation_sites != NULL) track_survivors(1);
+   sweep_large();
+   release_heap(&heap2);
+   if(young == &nursery) reset_heap(&nursery);
+
+   if(stats.on) end_collection(&start, collected, heap.words_allocated);
 
 #ifdef GC_DEBUG
    printf("reclaimed %d words\n", (prev_words_alloc - heap.words_allocated));
 #ifdef GC_DUMP
    printf("(");
-   for (i=0;i<HEAP_SIZE;i++) {
+   for (i=0;i<heap.size;i++) {
      if (i != 0) printf (" ");
      printf("(%p %p)\n",&(heap.data[i]),heap.data[i]);
    }
@@ -240,16 +1277,186 @@ void gc(int64_t *rsp) {
 #endif
 }
 
+#ifndef GC_RECURSIVE
+/*
+ * Collects just the nursery, promoting what survives into the old space
+ * (which has to have room for all of it)
+ */
+void gc_nursery(int64_t *rsp, int64_t **fill) {
+   int64_t *promoted = heap.allocptr;
+   int64_t collected = nursery.words_allocated;
+   int64_t i;
+   struct timespec start;
+   if(stats.on) begin_collection(&start);
+
+   mark_object_starts(&nursery);
+   from_spaces[0] = &nursery;
+   from_space_count = 1;
+
+   gc_stack(rsp);
+   *fill = gc_forward(*fill);
+   gc_cards((int64_t*)heap.data, promoted - (int64_t*)heap.data, heap.cards);
+   for(i = 0; i < large.count; i++) {
+      large_t *entry = &large.objects[i];
+      gc_cards(entry->object, entry->bytes / sizeof(int64_t), card_of(entry->object));
+   }
+   gc_scan(promoted);
+   if(allocation_sites != NULL) track_survivors(0);
+   reset_heap(&nursery);
+
+   if(stats.on) {
+      stats.minor++;
+      end_collection(&start, collected, heap.allocptr - promoted);
+   }
+}
+#endif
+
+/*
+ * Collects everything, and sizes the idle semispace for next time. If
+ * `needed` words still don't fit, don't wait: grow, and collect again
+ * into the bigger space.
+ */
+void collect(int64_t *rsp, int64_t **fill, int64_t needed) {
+   int64_t live, size;
+
+   gc(rsp, fill);
+   live = heap.words_allocated;
+   size = next_heap_size(live, needed);
+   if(!resize_heap(&heap2, size)) {
+      printf("out of memory\n");
+      exit(-1);
+   }
+   if(live + needed >= heap.size && size > heap.size) {
+      gc(rsp, fill);
+      if(!resize_heap(&heap2, size)) {
+         printf("out of memory\n");
+         exit(-1);
+      }
+   }
+}
+
+/*
+ * Empties the nursery: by promoting what's left in it, if the old space
+ * can take all of it, or else by collecting everything.
+ */
+void collect_nursery(int64_t *rsp, int64_t **fill) {
+#ifndef GC_RECURSIVE
+   if(heap.words_allocated + nursery.words_allocated < heap.size) {
+      gc_nursery(rsp, fill);
+      return;
+   }
+#endif
+   collect(rsp, fill, nursery.size);
+}
+
+int compare_pauses(const void *a, const void *b) {
+   double x = *(const double*)a, y = *(const double*)b;
+   return (x > y) - (x < y);
+}
+
+const char *size_bin_name(int bin, char *buffer) {
+   if(bin <= 1) sprintf(buffer, "%d", bin);
+   else sprintf(buffer, "%" PRId64 "-%" PRId64, (int64_t)1 << (bin - 1), ((int64_t)1 << bin) - 1);
+   return buffer;
+}
+
+void print_stats() {
+   struct rusage usage;
+   double gc_seconds = 0, longest = 0, median = 0, survival = 0;
+   double *sorted;
+   char name[48];
+   int64_t i;
+
+   count_allocations(stats.counted, allocation_pointer);
+   load_allocation_pointer();
+   note_in_use();
+   getrusage(RUSAGE_SELF, &usage);
+   for(i = 0; i < stats.collections; i++) gc_seconds += stats.pauses[i];
+   // Sort a copy: the JSON lists them in order
+   if(stats.collections > 0 && (sorted = (double*)malloc(stats.collections * sizeof(double)))) {
+      memcpy(sorted, stats.pauses, stats.collections * sizeof(double));
+      qsort(sorted, stats.collections, sizeof(double), compare_pauses);
+      longest = sorted[stats.collections - 1];
+      median = sorted[stats.collections / 2];
+      free(sorted);
+   }
+   if(stats.words_collected > 0)
+      survival = (double)stats.words_copied / (double)stats.words_collected;
+
+   if(stats.json) {
+      const char *separator = "";
+      fprintf(stderr, "{\"allocations\": %" PRId64 ", \"bytes_allocated\": %" PRId64 ", \"sizes\": {",
+              stats.allocations, stats.words_allocated * 8);
+      for(i = 0; i < SIZE_BINS; i++) {
+         if(stats.sizes[i] == 0) continue;
+         fprintf(stderr, "%s\"%s\": %" PRId64, separator, size_bin_name(i, name), stats.sizes[i]);
+         separator = ", ";
+      }
+      fprintf(stderr, "}, \"collections\": %" PRId64 ", \"nursery_collections\": %" PRId64
+              ", \"gc_ms\": %.3f, \"pauses_ms\": [",
+              stats.collections, stats.minor, gc_seconds * 1e3);
+      for(i = 0; i < stats.collections; i++)
+         fprintf(stderr, "%s%.3f", i ? ", " : "", stats.pauses[i] * 1e3);
+      fprintf(stderr, "], \"bytes_copied\": %" PRId64 ", \"bytes_collected\": %" PRId64
+              ", \"survivor_ratio\": %.4f, \"stack_words_scanned\": %" PRId64
+              ", \"max_heap_bytes\": %" PRId64 ", \"peak_resident_kb\": %ld"
+              ", \"prints\": %" PRId64 ", \"print_ms\": %.3f}\n",
+              stats.words_copied * 8, stats.words_collected * 8, survival, stats.roots,
+              stats.max_in_use, usage.ru_maxrss, stats.prints, stats.print_seconds * 1e3);
+      return;
+   }
+
+   fprintf(stderr, "runtime:\n");
+#define ROW(label, format, value) fprintf(stderr, "  %-24s %14" format "\n", label, value)
+   ROW("allocations", PRId64, stats.allocations);
+   ROW("bytes allocated", PRId64, stats.words_allocated * 8);
+   for(i = 0; i < SIZE_BINS; i++) {
+      char label[64];
+      if(stats.sizes[i] == 0) continue;
+      sprintf(label, "  of size %s", size_bin_name(i, name));
+      ROW(label, PRId64, stats.sizes[i]);
+   }
+   ROW("collections", PRId64, stats.collections);
+   ROW("  of the nursery", PRId64, stats.minor);
+   ROW("gc ms", ".3f", gc_seconds * 1e3);
+   ROW("  median pause ms", ".3f", median * 1e3);
+   ROW("  longest pause ms", ".3f", longest * 1e3);
+   ROW("bytes copied", PRId64, stats.words_copied * 8);
+   ROW("bytes collected", PRId64, stats.words_collected * 8);
+   ROW("survivor ratio", ".4f", survival);
+   ROW("stack words scanned", PRId64, stats.roots);
+   ROW("max heap bytes", PRId64, stats.max_in_use);
+   ROW("peak resident KB", "ld", usage.ru_maxrss);
+   ROW("prints", PRId64, stats.prints);
+   ROW("print ms", ".3f", stats.print_seconds * 1e3);
+#undef ROW
+}
+
+void configure_stats() {
+   const char *value = getenv("L_RUNTIME_STATS");
+   if(value == NULL || *value == '\0' || strcmp(value, "0") == 0) return;
+   stats.on = 1;
+   stats.json = (strcmp(value, "json") == 0);
+}
+
 /*
  * The "allocate" runtime function
- * (assembly stub that calls the 3-argument
- * allocate_helper function)
+ * (assembly stub that calls the 4-argument
+ * allocate_helper function). allocate_at is the
+ * same, plus the allocation site (in rdx).
  */
 extern void* allocate(int64_t fw_size, int64_t *fw_fill);
+extern void* allocate_at(int64_t fw_size, int64_t *fw_fill, site_t *site);
 asm(
+   ".globl allocate_at\n"
+   "allocate_at:\n"
+   "movq   %rdx, %rcx\n"    // fourth argument: the site
+   "jmp    1f\n"
    ".globl allocate\n"
    //   ".type allocate, @function\n"
    "allocate:\n"
+   "xorl   %ecx, %ecx\n"    // no site
+   "1:\n"
    "# grab the arguments (into rax,rdx)\n"
    "subq   $48, %rsp\n"
    "movq   %rsp, %rdx\n"    // set up third argument to allocate_helper
@@ -259,7 +1466,12 @@ asm(
    "movq   %r13,24(%rsp)\n"
    "movq   %r14,32(%rsp)\n"
    "movq   %r15,40(%rsp)\n"
+   // compiled code doesn't keep rsp 16-byte aligned, and gcc is free to
+   // assume it is (rbx is saved, and allocate_helper keeps it for us)
+   "movq   %rsp, %rbx\n"
+   "andq   $-16, %rsp\n"
    "call allocate_helper\n" // make the call
+   "movq   %rbx, %rsp\n"
    "movq   (%rsp),%rbx\n"
    "movq   8(%rsp),%rbp\n"
    "movq   16(%rsp),%r12\n"
@@ -319,12 +1531,14 @@ asm(
  * The real "allocate" runtime function
  * (called by the above assembly stub function)
  */
-void* allocate_helper(int64_t fw_size, int64_t *fw_fill, int64_t *rsp)
+void* allocate_helper(int64_t fw_size, int64_t *fw_fill, int64_t *rsp, site_t *site)
 {
    int i, data_size, array_size;
-   char *valid;
    int64_t *ret;
 
+   load_allocation_pointer();
+   if(stats.on) count_allocations(stats.counted, young->allocptr);
+
    if(!(fw_size & 1)) {
       printf("allocate called with size input that was not an encoded integer, %" 
 	     PRId64
@@ -353,51 +1567,77 @@ void* allocate_helper(int64_t fw_size, int64_t *fw_fill, int64_t *rsp)
 
 
 
-   // Check if the heap has space for the allocation
-   if(heap.words_allocated + array_size >= HEAP_SIZE)
-   {
-      // Garbage collect
-      gc(rsp);
-      // get correct value of fw_fill
-      fw_fill=gc_copy(fw_fill);
-
-      // Check if the garbage collection free enough space for the allocation
-      if(heap.words_allocated + array_size >= HEAP_SIZE) {
+   if(data_size >= large_object_words) {
+      // Collect first, if the dead ones might be piling up
+      if(large.words_since_gc + array_size > heap.size) {
+         collect(rsp, &fw_fill, 0);
+      }
+      ret = allocate_large(array_size);
+      if(ret == NULL) {
          printf("out of memory\n");
          exit(-1);
       }
-   }
+   } else if(young == &nursery && array_size <= nursery.size / 2) {
+      // Check if the nursery has space for the allocation
+      if(nursery.words_allocated + array_size >= nursery.size) {
+         collect_nursery(rsp, &fw_fill);
+      }
 
-   // Do the allocation
-   ret = heap.allocptr;
-   valid = heap.valid + heap.words_allocated;
-   heap.allocptr += array_size;
-   heap.words_allocated += array_size;
+      // Do the allocation
+      ret = nursery.allocptr;
+      nursery.allocptr += array_size;
+      nursery.words_allocated += array_size;
+   } else {
+      // Check if the heap has space for the allocation
+      if(heap.words_allocated + array_size >= heap.size) {
+         collect(rsp, &fw_fill, array_size);
+
+         // Check if the garbage collection free enough space for the allocation
+         if(heap.words_allocated + array_size >= heap.size) {
+            printf("out of memory\n");
+            exit(-1);
+         }
+      }
+
+      // Do the allocation
+      ret = heap.allocptr;
+      heap.allocptr += array_size;
+      heap.words_allocated += array_size;
+
+      // An old array full of pointers to a young object
+      if(is_young(fw_fill)) mark_cards(ret, array_size);
+   }
 
    // Set the size of the array to be the desired size
    ret[0] = data_size;
 
-   // record this as a heap object
-   valid[0] = 1;
-
    // If there is no data, set the value of the array to be a number
    // so it can be properly garbage collected
    if(data_size == 0) {
       ret[1] = 1;
-      valid[1] = 0;
       //printf(" set %p to 1\n", &ret[1]);
       //fflush(stdout);
    } else {
       // Fill the array with the fill value
       for(i = 1; i < array_size; i++) {
          ret[i] = (int64_t)fw_fill;
-         valid[i] = 0;
          //printf(" set %p to %d (%p)", &ret[i], fw_fill, fw_fill);
       }
       //printf("\n");
       //fflush(stdout);
    }
 
+   if(site != NULL) {
+      site->allocations++;
+      site->words += array_size;
+      track(&tracked_new, ret, site);
+   }
+
+   publish_allocation_pointer();
+   if(stats.on) {
+      count_allocation(data_size);
+      stats.counted = allocation_pointer;
+   }
    return ret;
 }
 
@@ -405,17 +1645,22 @@ void* allocate_helper(int64_t fw_size, int64_t *fw_fill, int64_t *rsp)
  * The "array-error" runtime function
  */
 int array_error (int64_t *array, int64_t fw_x) {
+  // Whatever the program printed goes first
+  flush_output();
   if (array == NULL){
     printf("attempted to access an array or tuple, which has not been allocated\n");
     exit(0);
   }
   int64_t decodedV = fw_x >> 1;
+  int64_t length = *array;
+  // Strides (IR -S) don't count; see print_content
+  if (length > 0 && (array[1] & 7) == 2) length -= (array[1] >> 3) - 1;
   printf("attempted to use position %" PRId64, decodedV);
-  if (decodedV >= *array){
-    printf(" in an array that only has %" PRId64 " position", *array);
-    if (*array != 1) printf("s");
+  if (decodedV >= length){
+    printf(" in an array that only has %" PRId64 " position", length);
+    if (length != 1) printf("s");
   } else {
-    printf(" (linearized array length: %" PRId64 ")", *array);
+    printf(" (linearized array length: %" PRId64 ")", length);
   }
   printf("\n");
   exit(0);
@@ -425,12 +1670,31 @@ int array_error (int64_t *array, int64_t fw_x) {
  * Program entry-point
  */
 int main() {
-   int b1 = alloc_heap(&heap);
-   int b2 = alloc_heap(&heap2);
-   if(!b1 || !b2) {
-      printf("malloc failed\n");
+   configure_heap();
+   configure_stats();
+   output.eager = isatty(1);
+   atexit(flush_output);
+   if(!reserve_heaps() ||
+      !place_heap(&heap, arena.base, heap_policy.initial_words) ||
+      !place_heap(&heap2, arena.base + arena.space_bytes, heap_policy.initial_words)) {
+      printf("mmap failed\n");
       exit(-1);
    }
+#ifndef GC_RECURSIVE
+   if(write_barriers != NULL && heap_policy.nursery_words >= 2) {
+      if(!map_heap(&nursery, heap_policy.nursery_words)) {
+         printf("mmap failed\n");
+         exit(-1);
+      }
+      young = &nursery;
+   }
+#endif
+   publish_allocation_pointer();
+   if(stats.on) {
+      stats.counted = allocation_pointer;
+      atexit(print_stats);
+   }
+   if(allocation_sites != NULL) atexit(print_sites);
 
    // Move esp into the bottom-of-stack pointer.
    // The "go" function's boilerplate, in conjunction
@@ -0,0 +1,33 @@
+#!/bin/bash
+
+if test $# -lt 3 ; then
+  echo "USAGE: `basename $0` EXTENSION_FILE COMPILER LEVEL..." ;
+  echo "  e.g. `basename $0` L1 ./bin/L1 -O0 -O1 -O2" ;
+  exit 1;
+fi
+extFile=$1 ;
+compiler=$2 ;
+shift 2 ;
+
+# Total .text bytes of every test in tests/, assembled at each level.
+# COMPILER must understand `-a OBJECT` (assemble straight to an object).
+object=`mktemp` ;
+baseline="" ;
+printf "%-8s %12s %10s %8s\n" "level" ".text" "delta" "%" ;
+for level in "$@" ; do
+  total=0 ;
+  for i in tests/*.${extFile} ; do
+    if ! ( ${compiler} ${level} -a ${object} ${i} ) &> /dev/null ; then
+      continue ;
+    fi
+    bytes=`size -A ${object} | awk '$1 == ".text" { print $2 }'` ;
+    let total=${total}+${bytes} ;
+  done
+  if test "${baseline}" == "" ; then
+    baseline=${total} ;
+  fi
+  let delta=${total}-${baseline} ;
+  percent=`awk "BEGIN { printf \"%.2f\", 100 * ${delta} / ${baseline} }"` ;
+  printf "%-8s %12d %10d %8s\n" "${level}" ${total} ${delta} ${percent} ;
+done
+rm -f ${object} ;
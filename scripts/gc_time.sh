@@ -0,0 +1,45 @@
+#!/bin/bash
+
+if test $# -lt 3 ; then
+  echo "USAGE: `basename $0` EXTENSION_FILE COMPILER PROGRAM..." ;
+  echo "  e.g. `basename $0` IR IRc tests/*.IR" ;
+  echo "  Set L_HEAP_INITIAL to change the starting heap (default 64k)." ;
+  exit 1;
+fi
+extFile=$1 ;
+compiler=$2 ;
+shift 2 ;
+
+# Build each program with each collector (the runtime is compiled with
+# -DGC_RECURSIVE for the old one), run it on a small heap so it actually
+# collects, and report the runtime's statistics (L_RUNTIME_STATS).
+# Programs that never collect are skipped.
+export L_HEAP_INITIAL=${L_HEAP_INITIAL:-64k} ;
+export L_RUNTIME_STATS=1 ;
+printf "%-40s %-10s %12s %14s %12s\n" "program" "collector" "collections" "bytes copied" "gc ms" ;
+for program in "$@" ; do
+  for collector in cheney recursive ; do
+    flags="" ;
+    if test ${collector} == "recursive" ; then
+      flags="-DGC_RECURSIVE" ;
+    fi
+    if ! ( RUNTIME_CFLAGS="${flags}" ./${compiler} ${program} ) &> /dev/null ; then
+      printf "%-40s %-10s %12s\n" `basename ${program}` ${collector} "FAILED" ;
+      break ;
+    fi
+    stats=`( ./a.out 2>&1 > /dev/null ) | awk '
+      /^  collections /  { collections = $2 }
+      /^  bytes copied / { copied = $3 }
+      /^  gc ms /        { ms = $3 }
+      END { if (collections != "") print collections, copied, ms }'` ;
+    if test "${stats}" == "" ; then
+      printf "%-40s %-10s %12s\n" `basename ${program}` ${collector} "CRASHED" ;
+      continue ;
+    fi
+    read collections copied milliseconds <<< "${stats}" ;
+    if test ${collections} -eq 0 ; then
+      break ;
+    fi
+    printf "%-40s %-10s %12d %14d %12s\n" `basename ${program}` ${collector} ${collections} ${copied} ${milliseconds} ;
+  done
+done
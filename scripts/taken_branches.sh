@@ -0,0 +1,21 @@
+#!/bin/bash
+
+if test $# -lt 1 ; then
+  echo "USAGE: `basename $0` L1_PROGRAM..." ;
+  echo "  Run from the L1 directory." ;
+  exit 1;
+fi
+
+# Build each program with taken-branch counting (-c) at every optimization
+# level, run it, and report the count it prints on stderr.
+printf "%-32s %-6s %16s\n" "program" "level" "taken branches" ;
+for program in "$@" ; do
+  for level in -O0 -O1 -O2 ; do
+    if ! ( ./L1c ${level} -c ${program} ) &> /dev/null ; then
+      printf "%-32s %-6s %16s\n" `basename ${program}` ${level} "FAILED" ;
+      continue ;
+    fi
+    taken=`./a.out 2>&1 > /dev/null | awk '/^taken branches:/ { print $3 }'` ;
+    printf "%-32s %-6s %16s\n" `basename ${program}` ${level} ${taken} ;
+  done
+done